@@ -0,0 +1,94 @@
+#include "alloc_counter.h"
+
+#include <atomic>
+
+#if defined(ALLOC_COUNTER) && defined(__GLIBC__)
+
+#include <cerrno>
+
+// glibc's real allocator entry points, our malloc() below takes precedence over libc's for every library
+extern "C"
+{
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t count, size_t size);
+    void *__libc_realloc(void *ptr, size_t size);
+    void *__libc_memalign(size_t alignment, size_t size);
+}
+
+static std::atomic<size_t> allocations(0);
+
+// Plain constant initialized TLS in the executable, reading it never allocates
+static thread_local bool countThisThread = true;
+
+extern "C"
+{
+    void *malloc(size_t size)
+    {
+        if (countThisThread)
+            allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_malloc(size);
+    }
+
+    void *calloc(size_t count, size_t size)
+    {
+        if (countThisThread)
+            allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_calloc(count, size);
+    }
+
+    void *realloc(void *ptr, size_t size)
+    {
+        if (countThisThread)
+            allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_realloc(ptr, size);
+    }
+
+    void *memalign(size_t alignment, size_t size)
+    {
+        if (countThisThread)
+            allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_memalign(alignment, size);
+    }
+
+    void *aligned_alloc(size_t alignment, size_t size)
+    {
+        if (countThisThread)
+            allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_memalign(alignment, size);
+    }
+
+    // cv::fastMalloc() goes through here
+    int posix_memalign(void **ptr, size_t alignment, size_t size)
+    {
+        if (countThisThread)
+            allocations.fetch_add(1, std::memory_order_relaxed);
+        void *p = __libc_memalign(alignment, size);
+        if (!p)
+            return ENOMEM;
+        *ptr = p;
+        return 0;
+    }
+}
+
+size_t allocationCount()
+{
+    return allocations.load(std::memory_order_relaxed);
+}
+
+void ignoreThreadAllocations()
+{
+    countThisThread = false;
+}
+
+#else
+
+size_t allocationCount()
+{
+    return 0;
+}
+
+void ignoreThreadAllocations()
+{
+}
+
+#endif
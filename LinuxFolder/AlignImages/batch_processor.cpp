@@ -0,0 +1,402 @@
+#include "batch_processor.h"
+#include "bayer.h"
+#include "ir_processing.h"
+#include "overlay.h"
+#include "raw_recording.h"
+#include "trace.h"
+#include "warp_cache.h"
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/videoio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Where the batch frames come from, either a mapped raw recording pair or two sorted image lists
+struct BatchInput
+{
+    bool raw = false;
+    RawDecode rawDecode = RawDecode::Full;
+    int imageBitDepth = 0;
+    RawRecording irRecording;
+    RawRecording visibleRecording;
+    std::vector<FramePair> pairs;
+
+    std::vector<cv::String> irFiles;
+    std::vector<cv::String> visibleFiles;
+
+    int frameCount() const
+    {
+        return raw ? (int)pairs.size() : (int)std::min(irFiles.size(), visibleFiles.size());
+    }
+
+    // Valid bits in the 16 bit IR samples, 0 = all 16
+    int irBitDepth() const
+    {
+        return raw ? decodedBitDepth(RAW_BIT_DEPTH, rawDecode) : imageBitDepth;
+    }
+
+    // Returns the IR frame at its native depth and an 8 bit grayscale visible frame
+    // Raw frames are decoded straight from the Bayer mosaic, the IR one to 16 bit so the threshold keeps every bit
+    bool load(int index, cv::Mat &ir, cv::Mat &visible) const
+    {
+        if (raw)
+        {
+            const FramePair &pair = pairs[index];
+            decodeRawFrame(irRecording.frame(pair.irIndex), RAW_BIT_DEPTH, rawDecode, CV_16U, ir);
+            decodeRawFrame(visibleRecording.frame(pair.visibleIndex), RAW_BIT_DEPTH, rawDecode, CV_8U, visible);
+            return true;
+        }
+
+        cv::Mat irFile = cv::imread(irFiles[index], cv::IMREAD_UNCHANGED);
+        cv::Mat visibleFile = cv::imread(visibleFiles[index], cv::IMREAD_GRAYSCALE);
+        if (irFile.empty() || visibleFile.empty())
+            return false;
+
+        ir = irFile;
+        normalizeTo8Bit(visibleFile, visible);
+        return true;
+    }
+
+    // Call once a frame is processed
+    void done(int index) const
+    {
+        if (!raw)
+            return;
+
+        // These pages won't be needed again, keep the resident set small on multi gigabyte recordings
+        const FramePair &pair = pairs[index];
+        irRecording.release(pair.irIndex, 1);
+        visibleRecording.release(pair.visibleIndex, 1);
+    }
+};
+
+// One reorder buffer slot, encoded holds the PNG / QOI bytes when writing an image sequence
+struct BatchResult
+{
+    bool ready = false;
+    bool failed = false;
+    std::string error; // Why it failed, empty = the pair couldn't be read
+    cv::Mat frame;
+    std::vector<uchar> encoded;
+};
+
+static bool hasExtension(const std::string &path, const std::string &extension)
+{
+    return path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+static bool openBatchInput(const BatchOptions &options, BatchInput &input)
+{
+    if (hasExtension(options.irInput, ".raw"))
+    {
+        input.raw = true;
+        input.rawDecode = options.rawDecode;
+        if (!input.irRecording.open(options.irInput) || !input.visibleRecording.open(options.visibleInput))
+            return false;
+
+        if (input.irRecording.hasTimestamps() && input.visibleRecording.hasTimestamps())
+        {
+            SyncStats syncStats;
+            input.pairs = pairRecordedFrames(input.irRecording.timestampList(), input.visibleRecording.timestampList(),
+                                             options.syncToleranceMs, options.syncPolicy, syncStats);
+            printSyncStats(syncStats);
+
+            // A recording cut short (full disk, killed recorder) can have more timestamps than frames
+            const int irFrames = input.irRecording.frameCount();
+            const int visibleFrames = input.visibleRecording.frameCount();
+            size_t pairCount = input.pairs.size();
+            input.pairs.erase(std::remove_if(input.pairs.begin(), input.pairs.end(), [&](const FramePair &pair)
+                                             { return pair.irIndex < 0 || pair.irIndex >= irFrames ||
+                                                      pair.visibleIndex < 0 || pair.visibleIndex >= visibleFrames; }),
+                              input.pairs.end());
+            if (input.pairs.size() != pairCount)
+            {
+                std::cerr << "Warning : dropped " << pairCount - input.pairs.size()
+                          << " pairs whose timestamps point past the end of the recordings" << std::endl;
+            }
+        }
+        else
+        {
+            std::cout << "No timestamp files found, pairing frames by index" << std::endl;
+            int count = std::min(input.irRecording.frameCount(), input.visibleRecording.frameCount());
+            for (int i = 0; i < count; i++)
+                input.pairs.push_back({i, i, 0.0});
+        }
+        return true;
+    }
+
+    // A plain directory means every file in it
+    auto pattern = [](const std::string &path)
+    { return std::filesystem::is_directory(path) ? path + "/*" : path; };
+
+    input.imageBitDepth = options.irBitDepth;
+    cv::glob(pattern(options.irInput), input.irFiles, false);
+    cv::glob(pattern(options.visibleInput), input.visibleFiles, false);
+
+    if (input.irFiles.size() != input.visibleFiles.size())
+    {
+        std::cerr << "Warning : " << input.irFiles.size() << " IR images but " << input.visibleFiles.size()
+                  << " visible images, only the first " << input.frameCount() << " pairs are processed" << std::endl;
+    }
+    return true;
+}
+
+int runBatch(const BatchOptions &options, const cv::Mat &homography)
+{
+    BatchInput input;
+    if (!openBatchInput(options, input))
+        return -1;
+
+    const int frameCount = input.frameCount();
+    if (frameCount == 0)
+    {
+        std::cerr << "No frames to process" << std::endl;
+        return -1;
+    }
+
+    // The warp maps only depend on the homography, offsets and sizes, build them once and share them read only
+    // The sizes come from the first pair that loads, pairs before it fail in the workers like any other bad pair
+    cv::Mat firstIR, firstVisible;
+    bool haveFirstPair = false;
+    for (int index = 0; index < frameCount && !haveFirstPair; index++)
+    {
+        try
+        {
+            haveFirstPair = input.load(index, firstIR, firstVisible);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Failed to read frame pair " << index << " : " << e.what() << std::endl;
+        }
+    }
+    if (!haveFirstPair)
+    {
+        std::cerr << "Could not read any of the " << frameCount << " frame pairs" << std::endl;
+        return -1;
+    }
+    // homography.yml and the offsets are in full resolution pixels
+    WarpMapCache warpCache;
+    if (input.raw && options.rawDecode == RawDecode::Half)
+        warpCache.update(scaleHomography(homography, 0.5), options.offsetX / 2, options.offsetY / 2, firstVisible.size(), firstIR.size());
+    else
+        warpCache.update(homography, options.offsetX, options.offsetY, firstVisible.size(), firstIR.size());
+
+    const bool writeVideo = hasExtension(options.output, ".avi");
+    const bool writeQoi = options.imageCodec != FRAME_CODEC_RAW;
+    if (!writeVideo)
+    {
+        std::error_code error;
+        std::filesystem::create_directories(options.output, error);
+        if (error)
+        {
+            std::cerr << "Failed to create " << options.output << " : " << error.message() << std::endl;
+            return -1;
+        }
+    }
+
+    int threadCount = options.threads > 0 ? options.threads : (int)std::max(1u, std::thread::hardware_concurrency());
+    std::cout << "Processing " << frameCount << " frames on " << threadCount << " threads" << std::endl;
+
+    // Parallelism comes from running whole frames side by side, so keep OpenCV's own thread pool out of the way
+    int previousOpenCVThreads = cv::getNumThreads();
+    cv::setNumThreads(1);
+
+    std::vector<BatchResult> reorderBuffer(BATCH_REORDER_WINDOW);
+    std::mutex reorderMutex;
+    std::condition_variable reorderCondition;
+    int nextToWrite = 0;
+    std::atomic<int> nextFrame(0);
+
+    auto worker = [&]()
+    {
+        // Per thread working frames, reused for every frame this worker handles
+        IRProcessingContext irContext;
+        irContext.setAnalysisScale(options.irAnalysisScale, options.irAnalysisOutput);
+        cv::Mat ir, visible, warped, blended;
+        FrameEncoder qoiEncoder(FRAME_CODEC_QOI);
+
+        traceSetThreadName("batch worker");
+
+        while (true)
+        {
+            int index = nextFrame++;
+            if (index >= frameCount)
+                break;
+
+            // Don't run more than a window ahead of the writer
+            {
+                TRACE_SCOPE("reorder wait");
+                std::unique_lock<std::mutex> lock(reorderMutex);
+                reorderCondition.wait(lock, [&]
+                                      { return index < nextToWrite + BATCH_REORDER_WINDOW; });
+            }
+
+            BatchResult result;
+            bool loaded;
+            {
+                TRACE_SCOPE("load");
+                try
+                {
+                    loaded = input.load(index, ir, visible);
+                }
+                catch (const std::exception &e)
+                {
+                    result.error = e.what();
+                    loaded = false;
+                }
+            }
+
+            // The maps were built for the first pair, an image that's a different size can't use them
+            if (loaded && (ir.size() != firstIR.size() || visible.size() != firstVisible.size()))
+            {
+                result.error = "size differs from the first pair";
+                loaded = false;
+            }
+
+            // An exception escaping a worker would std::terminate the whole batch, it only costs this frame
+            if (loaded)
+            {
+                try
+                {
+                    // Only the part of the IR frame the visible camera covers is processed, the maps are shared so it's the same for every frame
+                    const cv::Mat &colored = irContext.colorize(ir, input.irBitDepth(), warpCache.overlap());
+                    input.done(index);
+                    {
+                        TRACE_SCOPE("warp");
+                        warpCache.apply(visible, warped);
+                    }
+                    {
+                        TRACE_SCOPE("blend");
+                        blendIROverlay(colored, warped, blended, THRESHOLD_WEIGHT, WARPEDFRAME_WEIGHT, warpCache.overlap());
+                    }
+
+                    // Encoding is the expensive part of writing, do it here so the single writer thread never limits scaling
+                    TRACE_SCOPE("encode");
+                    if (writeVideo)
+                        cv::cvtColor(blended, result.frame, cv::COLOR_BGRA2BGR);
+                    else if (writeQoi)
+                        result.encoded.resize(qoiEncoder.encode(blended, result.encoded));
+                    else
+                        cv::imencode(".png", blended, result.encoded);
+                }
+                catch (const std::exception &e)
+                {
+                    result.error = e.what();
+                    loaded = false;
+                }
+            }
+            result.failed = !loaded;
+            result.ready = true;
+
+            {
+                std::lock_guard<std::mutex> lock(reorderMutex);
+                reorderBuffer[index % BATCH_REORDER_WINDOW] = std::move(result);
+            }
+            reorderCondition.notify_all();
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threadCount; i++)
+        workers.emplace_back(worker);
+
+    // ------------------ [ IN ORDER WRITER ] ------------------ //
+    cv::VideoWriter videoWriter;
+    bool videoOpenAttempted = false;
+    int failedFrames = 0;
+
+    traceSetThreadName("batch writer");
+
+    for (int index = 0; index < frameCount; index++)
+    {
+        // kill -USR1 : snapshot of the spans so far, the run keeps going
+        if (traceDumpRequested())
+            traceDumpReport("trace_batch.json", std::cout);
+
+        BatchResult result;
+        {
+            TRACE_SCOPE("writer wait");
+            std::unique_lock<std::mutex> lock(reorderMutex);
+            BatchResult &slot = reorderBuffer[index % BATCH_REORDER_WINDOW];
+            reorderCondition.wait(lock, [&]
+                                  { return slot.ready; });
+            result = std::move(slot);
+            slot = BatchResult();
+            nextToWrite = index + 1;
+        }
+        reorderCondition.notify_all();
+
+        if (result.failed)
+        {
+            if (result.error.empty())
+                std::cerr << "Failed to read frame pair " << index << std::endl;
+            else
+                std::cerr << "Failed to process frame pair " << index << " : " << result.error << std::endl;
+            failedFrames++;
+            continue;
+        }
+
+        TRACE_SCOPE("write");
+        if (writeVideo)
+        {
+            // Opened on the first frame that made it through since that's when the output size is known, pair 0 may
+            // have failed. Only tried once, a writer that can't open won't do better on the next frame
+            if (!videoWriter.isOpened() && !videoOpenAttempted)
+            {
+                videoOpenAttempted = true;
+                if (!videoWriter.open(options.output, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), options.fps, result.frame.size(), true))
+                    std::cerr << "Failed to open " << options.output << " for writing" << std::endl;
+            }
+
+            // Keep draining the workers even if the writer failed, they'd wait on the reorder window forever otherwise
+            if (!videoWriter.isOpened())
+            {
+                failedFrames++;
+                continue;
+            }
+            videoWriter.write(result.frame);
+        }
+        else
+        {
+            char name[32];
+            std::snprintf(name, sizeof(name), writeQoi ? "/overlay_%06d.qoi" : "/overlay_%06d.png", index);
+            std::ofstream out(options.output + name, std::ios::binary);
+            out.write((const char *)result.encoded.data(), result.encoded.size());
+            out.close();
+
+            // A full disk or an output directory that went away, don't report the frame as done
+            if (!out)
+            {
+                std::cerr << "Failed to write " << options.output << name << std::endl;
+                failedFrames++;
+            }
+        }
+    }
+
+    for (std::thread &thread : workers)
+        thread.join();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cv::setNumThreads(previousOpenCVThreads);
+
+    std::cout << "\nProcessed " << frameCount - failedFrames << "/" << frameCount << " frames in " << seconds << " s ("
+              << (frameCount - failedFrames) / seconds << " frames/sec)" << std::endl;
+
+    if (tracingEnabled)
+        tracePrintPercentiles(std::cout);
+
+    return failedFrames == frameCount ? -1 : 0;
+}
@@ -0,0 +1,216 @@
+#include "bayer.h"
+#include "trace.h"
+
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc.hpp>
+
+bool parseRawDecode(const std::string &name, RawDecode &decode)
+{
+    if (name == "full")
+        decode = RawDecode::Full;
+    else if (name == "half")
+        decode = RawDecode::Half;
+    else
+        return false;
+    return true;
+}
+
+// Everything a kernel's rows need, passed by one reference so the parallel_for_ lambdas don't allocate
+struct BayerJob
+{
+    const cv::Mat &raw;
+    cv::Mat &dst;
+    unsigned weights[4]; // Top left G, top right B, bottom left R, bottom right G
+    int down;            // A sum with `bits` significant bits becomes sum >> down
+};
+
+// The shift that takes a value with bits significant bits to 8 bits, CV_16U keeps it as is
+static int normalizeShift(int bits, int dstDepth)
+{
+    return dstDepth == CV_16U ? 0 : bits - 8;
+}
+
+static void checkMosaic(const cv::Mat &raw, int bitDepth, int dstDepth)
+{
+    CV_Assert(raw.type() == CV_16UC1 && raw.rows >= 2 && raw.cols >= 2);
+    CV_Assert(bitDepth >= 8 && bitDepth <= BAYER_MAX_BIT_DEPTH);
+    CV_Assert(dstDepth == CV_8U || dstDepth == CV_16U);
+}
+
+// ------------------ [ HALF RESOLUTION ] ------------------ //
+
+template <typename T>
+static void halfRows(const BayerJob &job, const cv::Range &range)
+{
+    const unsigned wg0 = job.weights[0], wb = job.weights[1], wr = job.weights[2], wg1 = job.weights[3];
+    const int down = job.down;
+    const int cols = job.dst.cols;
+
+    for (int y = range.start; y < range.end; y++)
+    {
+        const ushort *top = job.raw.ptr<ushort>(2 * y);
+        const ushort *bottom = job.raw.ptr<ushort>(2 * y + 1);
+        T *out = job.dst.ptr<T>(y);
+
+        // Branch free with the channel choice as weights, so it vectorizes like the blend
+        for (int x = 0; x < cols; x++)
+        {
+            unsigned sum = wg0 * top[2 * x] + wb * top[2 * x + 1] + wr * bottom[2 * x] + wg1 * bottom[2 * x + 1];
+            out[x] = (T)(sum >> down);
+        }
+    }
+}
+
+void bayerHalf(const cv::Mat &raw, int bitDepth, BayerChannel channel, int dstDepth, cv::Mat &dst)
+{
+    TRACE_SCOPE("bayer half");
+    checkMosaic(raw, bitDepth, dstDepth);
+    dst.create(raw.rows / 2, raw.cols / 2, CV_MAKETYPE(dstDepth, 1));
+
+    BayerJob job{raw, dst, {0, 0, 0, 0}, 0};
+    int bits = bitDepth;
+    switch (channel)
+    {
+    case BayerChannel::Luminance:
+        job.weights[0] = job.weights[1] = job.weights[2] = job.weights[3] = 1;
+        bits += 2;
+        break;
+    case BayerChannel::Red:
+        job.weights[2] = 1;
+        break;
+    case BayerChannel::Green:
+        job.weights[0] = job.weights[3] = 1;
+        bits += 1;
+        break;
+    case BayerChannel::Blue:
+        job.weights[1] = 1;
+        break;
+    }
+    job.down = normalizeShift(bits, dstDepth);
+
+    if (dstDepth == CV_8U)
+        cv::parallel_for_(cv::Range(0, dst.rows), [&job](const cv::Range &range)
+                          { halfRows<uchar>(job, range); });
+    else
+        cv::parallel_for_(cv::Range(0, dst.rows), [&job](const cv::Range &range)
+                          { halfRows<ushort>(job, range); });
+}
+
+// ------------------ [ FULL RESOLUTION LUMINANCE ] ------------------ //
+
+template <typename T>
+static void luminanceRows(const BayerJob &job, const cv::Range &range)
+{
+    const int down = job.down;
+    const int rows = job.raw.rows;
+    const int last = job.raw.cols - 1;
+
+    for (int y = range.start; y < range.end; y++)
+    {
+        // Mirrored without the edge (row -1 is row 1), so the missing row has the same colors as the real one would
+        const ushort *above = job.raw.ptr<ushort>(y > 0 ? y - 1 : 1);
+        const ushort *center = job.raw.ptr<ushort>(y);
+        const ushort *below = job.raw.ptr<ushort>(y < rows - 1 ? y + 1 : rows - 2);
+        T *out = job.dst.ptr<T>(y);
+
+        auto column = [&](int x)
+        { return (unsigned)above[x] + 2u * center[x] + below[x]; };
+
+        out[0] = (T)((2 * column(1) + 2 * column(0)) >> down);
+        for (int x = 1; x < last; x++)
+        {
+            unsigned sum = column(x - 1) + 2 * column(x) + column(x + 1);
+            out[x] = (T)(sum >> down);
+        }
+        out[last] = (T)((2 * column(last - 1) + 2 * column(last)) >> down);
+    }
+}
+
+void bayerLuminance(const cv::Mat &raw, int bitDepth, int dstDepth, cv::Mat &dst)
+{
+    TRACE_SCOPE("bayer luminance");
+    checkMosaic(raw, bitDepth, dstDepth);
+    dst.create(raw.size(), CV_MAKETYPE(dstDepth, 1));
+
+    // The 3x3 weights add up to 16, 4 more bits than a sample
+    BayerJob job{raw, dst, {0, 0, 0, 0}, 0};
+    job.down = normalizeShift(bitDepth + 4, dstDepth);
+
+    if (dstDepth == CV_8U)
+        cv::parallel_for_(cv::Range(0, dst.rows), [&job](const cv::Range &range)
+                          { luminanceRows<uchar>(job, range); });
+    else
+        cv::parallel_for_(cv::Range(0, dst.rows), [&job](const cv::Range &range)
+                          { luminanceRows<ushort>(job, range); });
+}
+
+// ------------------ [ DEMOSAIC ] ------------------ //
+
+void bayerDemosaic(const cv::Mat &raw, int bitDepth, bool half, cv::Mat &dst)
+{
+    TRACE_SCOPE("bayer demosaic");
+    checkMosaic(raw, bitDepth, CV_8U);
+
+    BayerJob job{raw, dst, {0, 0, 0, 0}, bitDepth - 8};
+    if (half)
+    {
+        dst.create(raw.rows / 2, raw.cols / 2, CV_8UC3);
+        cv::parallel_for_(cv::Range(0, dst.rows), [&job](const cv::Range &range)
+                          {
+                              const int down = job.down;
+                              for (int y = range.start; y < range.end; y++)
+                              {
+                                  const ushort *top = job.raw.ptr<ushort>(2 * y);
+                                  const ushort *bottom = job.raw.ptr<ushort>(2 * y + 1);
+                                  uchar *out = job.dst.ptr<uchar>(y);
+                                  for (int x = 0; x < job.dst.cols; x++)
+                                  {
+                                      out[3 * x + 0] = (uchar)(top[2 * x + 1] >> down);
+                                      out[3 * x + 1] = (uchar)((top[2 * x] + bottom[2 * x + 1]) >> (down + 1));
+                                      out[3 * x + 2] = (uchar)(bottom[2 * x] >> down);
+                                  }
+                              }
+                          });
+        return;
+    }
+
+    // Per thread 8 bit mosaic, reused from one frame to the next
+    static thread_local cv::Mat mosaic;
+    mosaic.create(raw.size(), CV_8UC1);
+    BayerJob narrow{raw, mosaic, {0, 0, 0, 0}, bitDepth - 8};
+    cv::parallel_for_(cv::Range(0, raw.rows), [&narrow](const cv::Range &range)
+                      {
+                          const int down = narrow.down;
+                          for (int y = range.start; y < range.end; y++)
+                          {
+                              const ushort *in = narrow.raw.ptr<ushort>(y);
+                              uchar *out = narrow.dst.ptr<uchar>(y);
+                              for (int x = 0; x < narrow.raw.cols; x++)
+                                  out[x] = (uchar)(in[x] >> down);
+                          }
+                      });
+
+    // OpenCV names Bayer layouts after the second row, so GBRG is its BayerGR
+    cv::cvtColor(mosaic, dst, cv::COLOR_BayerGR2BGR);
+}
+
+int decodedBitDepth(int bitDepth, RawDecode decode)
+{
+    return bitDepth + (decode == RawDecode::Half ? 2 : 4);
+}
+
+void decodeRawFrame(const cv::Mat &raw, int bitDepth, RawDecode decode, int dstDepth, cv::Mat &dst)
+{
+    if (decode == RawDecode::Half)
+        bayerHalf(raw, bitDepth, BayerChannel::Luminance, dstDepth, dst);
+    else
+        bayerLuminance(raw, bitDepth, dstDepth, dst);
+}
+
+cv::Mat scaleHomography(const cv::Mat &homography, double scale)
+{
+    cv::Mat H;
+    homography.convertTo(H, CV_64F);
+    cv::Matx33d S(scale, 0, 0, 0, scale, 0, 0, 0, 1);
+    return cv::Mat(S * cv::Matx33d(H) * S.inv());
+}
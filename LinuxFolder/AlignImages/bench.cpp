@@ -0,0 +1,518 @@
+// Stage level micro benchmarks for the IR / visible overlay pipeline, build and run with "make bench"
+//
+// Every stage and the full pipeline run on synthetic frames and on the bundled ir.jpg / visible.jpg and
+// images/*.tif at 640x480, 1280x720 and 1920x1080. Each row reports ns/frame (mean), MPix/s, heap allocations
+// per frame and the p50 / p99 frame times. A human readable table goes to stdout and the same rows go to a CSV
+// file (bench_results.csv by default) so runs on the Pi and the workstation can be diffed or plotted.
+//
+// colorize() also runs with its analysis at 1/2 and 1/4 scale (IRProcessingContext::setAnalysisScale()), those rows
+// go in the same table, and a quality report compares each one with the full resolution output : Yen threshold,
+// IoU of the hot pixel masks, mean absolute BGRA difference and the speedup. Written to bench_quality.csv by default.
+//
+// The *_incremental rows time --incremental (dirty_tiles.h) on a static frame and on one where a single block changes,
+// the quality report also has the incremental colors against a from scratch colorize() of the same frame.
+//
+// The 10 bit inputs also stand in for an SGBRG10 mosaic to time the Bayer kernels (bayer.h) against the demosaic +
+// color conversion they replace.
+//
+// Usage : alignBench [--iterations N] [--threads N] [--data DIR] [--csv FILE] [--quality-csv FILE] [--label NAME]
+
+#include "alloc_counter.h"
+#include "bayer.h"
+#include "dirty_tiles.h"
+#include "ir_processing.h"
+#include "overlay.h"
+#include "raw_recording.h"
+#include "warp_cache.h"
+#include "yen_threshold.h"
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#define BENCH_ITERATIONS 100
+#define BENCH_WARMUP_ITERATIONS 5 // First calls size the working buffers, they're not part of the steady state
+
+struct BenchInput
+{
+    std::string name;
+    cv::Mat ir;      // Native depth, CV_8U or CV_16U
+    cv::Mat visible; // 8 bit grayscale
+    int irBitDepth;  // Valid bits in 16 bit IR samples, 0 = all 16
+};
+
+struct BenchResult
+{
+    std::string input;
+    cv::Size size;
+    std::string stage;
+    int iterations = 0;
+    double meanNs = 0;
+    double p50Ns = 0;
+    double p99Ns = 0;
+    double mpixPerSec = 0;
+    double allocsPerFrame = 0;
+};
+
+// Reduced resolution colorize() against the full resolution one
+struct QualityResult
+{
+    std::string input;
+    cv::Size size;
+    std::string stage;
+    int referenceThreshold = 0;
+    int threshold = 0;
+    double maskIoU = 0;      // Pixels with alpha > 0 in both / in either
+    double meanAbsDiff = 0;  // Per BGRA channel, 0-255
+    double speedup = 0;      // Full resolution colorize() time / this one
+};
+
+// ------------------ [ SYNTHETIC FRAMES ] ------------------ //
+
+// Noisy background with a few warm blobs, roughly what the NoIR camera sees of a hand in front of a wall
+static cv::Mat syntheticIR(cv::Size size, int maxValue, int depth)
+{
+    cv::Mat frame(size, CV_32F);
+    cv::RNG rng(12345);
+    rng.fill(frame, cv::RNG::NORMAL, maxValue * 0.25, maxValue * 0.05);
+
+    for (int i = 0; i < 6; i++)
+    {
+        cv::Point center(rng.uniform(0, size.width), rng.uniform(0, size.height));
+        int radius = rng.uniform(size.height / 20, size.height / 6);
+        cv::circle(frame, center, radius, cv::Scalar(maxValue * rng.uniform(0.6, 0.95)), cv::FILLED, cv::LINE_AA);
+    }
+    cv::GaussianBlur(frame, frame, cv::Size(0, 0), size.height / 100.0);
+
+    cv::Mat out;
+    frame.convertTo(out, depth);
+    return out;
+}
+
+static cv::Mat syntheticVisible(cv::Size size)
+{
+    cv::Mat frame(size, CV_8UC1);
+    cv::RNG rng(54321);
+    for (int y = 0; y < size.height; y++)
+    {
+        uchar *row = frame.ptr<uchar>(y);
+        for (int x = 0; x < size.width; x++)
+            row[x] = cv::saturate_cast<uchar>(255 * x / size.width / 2 + 255 * y / size.height / 2 + rng.uniform(-8, 8));
+    }
+    return frame;
+}
+
+// ------------------ [ BUNDLED FRAMES ] ------------------ //
+
+static bool loadBundled(const std::string &name, const std::string &irPath, const std::string &visiblePath,
+                        int irBitDepth, cv::Size size, BenchInput &input)
+{
+    cv::Mat ir = cv::imread(irPath, cv::IMREAD_UNCHANGED);
+    cv::Mat visible = cv::imread(visiblePath, cv::IMREAD_UNCHANGED);
+    if (ir.empty() || visible.empty())
+    {
+        std::cerr << "Skipping " << name << ", could not read " << irPath << " / " << visiblePath << std::endl;
+        return false;
+    }
+
+    // The pipeline takes single channel IR and grayscale visible frames
+    if (ir.channels() != 1)
+        cv::cvtColor(ir, ir, cv::COLOR_BGR2GRAY);
+    if (visible.channels() != 1)
+        cv::cvtColor(visible, visible, cv::COLOR_BGR2GRAY);
+    normalizeTo8Bit(visible, visible);
+
+    input.name = name;
+    input.irBitDepth = ir.depth() == CV_16U ? irBitDepth : 0;
+    cv::resize(ir, input.ir, size, 0, 0, cv::INTER_LINEAR);
+    cv::resize(visible, input.visible, size, 0, 0, cv::INTER_LINEAR);
+    return true;
+}
+
+// ------------------ [ TIMING ] ------------------ //
+
+// Runs stage() for the warm up and then the measured iterations, the stage is a template parameter
+// so calling it doesn't go through std::function (which could allocate and skew the count)
+template <typename Stage>
+static BenchResult runStage(const std::string &stageName, const BenchInput &input, int iterations, std::vector<double> &times, Stage &&stage)
+{
+    for (int i = 0; i < BENCH_WARMUP_ITERATIONS; i++)
+        stage();
+
+    times.clear();
+    size_t allocations = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        size_t allocationsBefore = allocationCount();
+        auto start = std::chrono::steady_clock::now();
+
+        stage();
+
+        auto end = std::chrono::steady_clock::now();
+        allocations += allocationCount() - allocationsBefore;
+        times.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+    }
+
+    BenchResult result;
+    result.input = input.name;
+    result.size = input.ir.size();
+    result.stage = stageName;
+    result.iterations = iterations;
+
+    double total = 0;
+    for (double t : times)
+        total += t;
+    result.meanNs = total / iterations;
+
+    std::sort(times.begin(), times.end());
+    result.p50Ns = times[iterations / 2];
+    result.p99Ns = times[std::min(iterations - 1, (int)(iterations * 0.99))];
+
+    // pixels / ns * 1e9 / 1e6
+    result.mpixPerSec = result.meanNs > 0 ? input.ir.total() / result.meanNs * 1000.0 : 0.0;
+    result.allocsPerFrame = (double)allocations / iterations;
+    return result;
+}
+
+static void printResult(const BenchResult &r)
+{
+    std::printf("%-14s %4dx%-4d  %-20s %12.0f %9.1f %8.2f %12.0f %12.0f\n",
+                r.input.c_str(), r.size.width, r.size.height, r.stage.c_str(),
+                r.meanNs, r.mpixPerSec, r.allocsPerFrame, r.p50Ns, r.p99Ns);
+    std::fflush(stdout);
+}
+
+static void compareColorized(const cv::Mat &reference, const cv::Mat &frame, QualityResult &quality)
+{
+    long long both = 0, either = 0, difference = 0;
+    for (int y = 0; y < reference.rows; y++)
+    {
+        const uchar *a = reference.ptr<uchar>(y);
+        const uchar *b = frame.ptr<uchar>(y);
+        for (int x = 0; x < reference.cols * 4; x += 4)
+        {
+            both += a[x + 3] && b[x + 3];
+            either += a[x + 3] || b[x + 3];
+            for (int c = 0; c < 4; c++)
+                difference += std::abs(a[x + c] - b[x + c]);
+        }
+    }
+    quality.maskIoU = either > 0 ? (double)both / either : 1.0;
+    quality.meanAbsDiff = (double)difference / (reference.total() * 4);
+}
+
+static void printQuality(const QualityResult &q)
+{
+    std::printf("%-14s %4dx%-4d  %-20s %9d %9d %8.3f %8.2f %8.2fx\n",
+                q.input.c_str(), q.size.width, q.size.height, q.stage.c_str(),
+                q.referenceThreshold, q.threshold, q.maskIoU, q.meanAbsDiff, q.speedup);
+}
+
+// ------------------ [ STAGES ] ------------------ //
+
+static void benchInput(const BenchInput &input, const cv::Mat &homography, int iterations, std::vector<BenchResult> &results,
+                       std::vector<QualityResult> &quality)
+{
+    IRProcessingContext irContext;
+    WarpMapCache warpCache;
+    std::vector<double> times;
+    times.reserve(iterations);
+
+    // The standalone threshold / remap / Yen stages work on 8 bit frames like the original code did
+    cv::Mat ir8;
+    normalizeTo8Bit(input.ir, ir8);
+
+    double foundThresh = 0;
+    cv::Mat thresholded = irContext.yenThreshold(ir8, false, foundThresh).clone();
+    int threshold = (int)foundThresh;
+    int topk = 0;
+
+    cv::Mat hist;
+    int histSize = 256;
+    float range[] = {0, 256};
+    const float *histRange = range;
+    cv::calcHist(&ir8, 1, 0, cv::Mat(), hist, 1, &histSize, &histRange);
+
+    warpCache.update(homography, 0, 0, input.visible.size(), input.ir.size());
+    cv::Mat warped, blended;
+    warpCache.apply(input.visible, warped);
+    cv::Mat colored = irContext.colorize(input.ir, input.irBitDepth).clone();
+
+    auto add = [&](const BenchResult &r)
+    {
+        printResult(r);
+        results.push_back(r);
+    };
+
+    add(runStage("yen_threshold", input, iterations, times, [&]
+                 { irContext.yenThreshold(ir8, false, foundThresh); }));
+
+    add(runStage("remap_lut_threshold", input, iterations, times, [&]
+                 { irContext.remapLutThreshold(thresholded, TOPK_FRACTION, threshold, topk); }));
+
+    add(runStage("yen", input, iterations, times, [&]
+                 { threshold = std::max(Yen(hist), 0); }));
+
+    add(runStage(input.ir.depth() == CV_16U ? "colorize_16bit" : "colorize", input, iterations, times, [&]
+                 { irContext.colorize(input.ir, input.irBitDepth); }));
+    const double fullColorizeNs = results.back().meanNs;
+
+    // Analysis at 1/2 and 1/4 scale, with the palette applied at full resolution or at the analysis level
+    {
+        cv::Mat reference = irContext.colorize(input.ir, input.irBitDepth).clone();
+        const int referenceThreshold = irContext.lastThreshold();
+
+        for (int scale : {2, 4})
+        {
+            for (IRAnalysisOutput output : {IRAnalysisOutput::FullResolution, IRAnalysisOutput::Reduced})
+            {
+                IRProcessingContext reducedContext;
+                reducedContext.setAnalysisScale(scale, output);
+
+                std::string stage = std::string("colorize_1/") + std::to_string(scale) +
+                                    (output == IRAnalysisOutput::Reduced ? "_reduced" : "");
+                add(runStage(stage, input, iterations, times, [&]
+                             { reducedContext.colorize(input.ir, input.irBitDepth); }));
+
+                QualityResult q;
+                q.input = input.name;
+                q.size = input.ir.size();
+                q.stage = stage;
+                q.referenceThreshold = referenceThreshold;
+                compareColorized(reference, reducedContext.colorize(input.ir, input.irBitDepth), q);
+                q.threshold = reducedContext.lastThreshold();
+                q.speedup = results.back().meanNs > 0 ? fullColorizeNs / results.back().meanNs : 0.0;
+                quality.push_back(q);
+            }
+        }
+    }
+
+    add(runStage("warp", input, iterations, times, [&]
+                 { warpCache.apply(input.visible, warped); }));
+
+    add(runStage("blend", input, iterations, times, [&]
+                 { blendIROverlay(colored, warped, blended); }));
+
+    // Same per frame work as the live loop : colorize, warp with the cached maps, blend, all limited to the overlap
+    add(runStage("pipeline", input, iterations, times, [&]
+                 {
+                     warpCache.update(homography, 0, 0, input.visible.size(), input.ir.size());
+                     const cv::Mat &frame = irContext.colorize(input.ir, input.irBitDepth, warpCache.overlap());
+                     warpCache.apply(input.visible, warped);
+                     blendIROverlay(frame, warped, blended, THRESHOLD_WEIGHT, WARPEDFRAME_WEIGHT, warpCache.overlap());
+                 }));
+
+    // --incremental : a scene that doesn't move at all (only the tile compare runs), and one where a 64x64 block
+    // flips between two values every frame, with the warp and blend limited to the tiles that block covers
+    {
+        const int level = input.ir.depth() == CV_16U ? 1 << ((input.irBitDepth > 8 ? input.irBitDepth : 16) - 8) : 1;
+        const cv::Rect block(input.ir.cols / 2 - 32, input.ir.rows / 2 - 32, 64, 64);
+        cv::Mat patched = input.ir.clone();
+        cv::Mat patch = patched(block);
+        patch += cv::Scalar::all(40 * level);
+
+        IRProcessingContext incrementalContext;
+        incrementalContext.setIncremental(true);
+        incrementalContext.colorize(input.ir, input.irBitDepth);
+        add(runStage("colorize_incremental_static", input, iterations, times, [&]
+                     { incrementalContext.colorize(input.ir, input.irBitDepth); }));
+
+        int frame = 0;
+        add(runStage("colorize_incremental_patch", input, iterations, times, [&]
+                     { incrementalContext.colorize(++frame % 2 ? patched : input.ir, input.irBitDepth); }));
+
+        // Colors kept from an older palette against a from scratch colorize() of the same frame
+        QualityResult q;
+        q.input = input.name;
+        q.size = input.ir.size();
+        q.stage = "colorize_incremental_patch";
+        cv::Mat reference = irContext.colorize(patched, input.irBitDepth).clone();
+        q.referenceThreshold = irContext.lastThreshold();
+        compareColorized(reference, incrementalContext.colorize(patched, input.irBitDepth), q);
+        q.threshold = incrementalContext.lastThreshold();
+        q.speedup = results.back().meanNs > 0 ? fullColorizeNs / results.back().meanNs : 0.0;
+        quality.push_back(q);
+
+        DirtyTiles sourceTiles, warpedTiles;
+        sourceTiles.reset(input.visible.size());
+        sourceTiles.clear();
+        for (int ty = block.y / DIRTY_TILE_SIZE; ty <= std::min((block.y + block.height - 1) / DIRTY_TILE_SIZE, sourceTiles.rows() - 1); ty++)
+            for (int tx = block.x / DIRTY_TILE_SIZE; tx <= std::min((block.x + block.width - 1) / DIRTY_TILE_SIZE, sourceTiles.columns() - 1); tx++)
+                sourceTiles.mark(tx, ty);
+        warpedTiles.reset(input.ir.size());
+        add(runStage("warp_incremental_patch", input, iterations, times, [&]
+                     {
+                         warpedTiles.clear();
+                         warpCache.applyTiles(input.visible, warped, sourceTiles, warpedTiles);
+                     }));
+
+        blendIROverlay(colored, warped, blended);
+        add(runStage("blend_incremental_patch", input, iterations, times, [&]
+                     {
+                         warpedTiles.forEachRun([&](const cv::Rect &run)
+                                                { blendIROverlayRegion(colored, warped, blended, THRESHOLD_WEIGHT, WARPEDFRAME_WEIGHT, run); });
+                     }));
+    }
+
+    // Raw recording decoding, the 10 bit frame read as a GBRG mosaic
+    if (input.ir.depth() == CV_16U && input.irBitDepth == RAW_BIT_DEPTH)
+    {
+        cv::Mat gray, color;
+        add(runStage("raw_normalize", input, iterations, times, [&]
+                     { normalizeTo8Bit(input.ir, gray); }));
+        add(runStage("opencv_demosaic_gray", input, iterations, times, [&]
+                     {
+                         cv::cvtColor(input.ir, color, cv::COLOR_BayerGR2BGR);
+                         cv::cvtColor(color, gray, cv::COLOR_BGR2GRAY);
+                     }));
+        add(runStage("bayer_luminance", input, iterations, times, [&]
+                     { bayerLuminance(input.ir, input.irBitDepth, CV_8U, gray); }));
+        add(runStage("bayer_luminance_16bit", input, iterations, times, [&]
+                     { bayerLuminance(input.ir, input.irBitDepth, CV_16U, gray); }));
+        add(runStage("bayer_half", input, iterations, times, [&]
+                     { bayerHalf(input.ir, input.irBitDepth, BayerChannel::Luminance, CV_8U, gray); }));
+        add(runStage("bayer_half_16bit", input, iterations, times, [&]
+                     { bayerHalf(input.ir, input.irBitDepth, BayerChannel::Luminance, CV_16U, gray); }));
+        add(runStage("bayer_demosaic", input, iterations, times, [&]
+                     { bayerDemosaic(input.ir, input.irBitDepth, false, color); }));
+        add(runStage("bayer_demosaic_half", input, iterations, times, [&]
+                     { bayerDemosaic(input.ir, input.irBitDepth, true, color); }));
+    }
+}
+
+static bool writeQualityCsv(const std::string &path, const std::string &label, int threads, const std::vector<QualityResult> &quality)
+{
+    std::ofstream csv(path);
+    if (!csv.is_open())
+    {
+        std::cerr << "Failed to open " << path << std::endl;
+        return false;
+    }
+
+    csv << "label,threads,input,width,height,stage,reference_threshold,threshold,mask_iou,mean_abs_diff,speedup\n";
+    for (const QualityResult &q : quality)
+    {
+        csv << label << ',' << threads << ',' << q.input << ',' << q.size.width << ',' << q.size.height << ','
+            << q.stage << ',' << q.referenceThreshold << ',' << q.threshold << ',' << q.maskIoU << ','
+            << q.meanAbsDiff << ',' << q.speedup << '\n';
+    }
+    return true;
+}
+
+static bool writeCsv(const std::string &path, const std::string &label, int threads, const std::vector<BenchResult> &results)
+{
+    std::ofstream csv(path);
+    if (!csv.is_open())
+    {
+        std::cerr << "Failed to open " << path << std::endl;
+        return false;
+    }
+
+    csv << "label,threads,input,width,height,stage,iterations,ns_per_frame,mpix_per_s,allocs_per_frame,p50_ns,p99_ns\n";
+    for (const BenchResult &r : results)
+    {
+        csv << label << ',' << threads << ',' << r.input << ',' << r.size.width << ',' << r.size.height << ','
+            << r.stage << ',' << r.iterations << ',' << (long long)r.meanNs << ',' << r.mpixPerSec << ','
+            << r.allocsPerFrame << ',' << (long long)r.p50Ns << ',' << (long long)r.p99Ns << '\n';
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = BENCH_ITERATIONS;
+    int threads = -1;
+    std::string dataDir = ".";
+    std::string csvPath = "bench_results.csv";
+    std::string qualityCsvPath = "bench_quality.csv";
+
+    // Defaults to the host name so results from several machines can go in one spreadsheet
+    char hostName[256] = "unknown";
+    gethostname(hostName, sizeof(hostName) - 1);
+    std::string label = hostName;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--iterations" && i + 1 < argc)
+            iterations = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = std::atoi(argv[++i]);
+        else if (arg == "--data" && i + 1 < argc)
+            dataDir = argv[++i];
+        else if (arg == "--csv" && i + 1 < argc)
+            csvPath = argv[++i];
+        else if (arg == "--quality-csv" && i + 1 < argc)
+            qualityCsvPath = argv[++i];
+        else if (arg == "--label" && i + 1 < argc)
+            label = argv[++i];
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--iterations N] [--threads N] [--data DIR] [--csv FILE] [--quality-csv FILE] [--label NAME]" << std::endl;
+            return -1;
+        }
+    }
+
+    if (threads >= 0)
+        cv::setNumThreads(threads);
+    threads = cv::getNumThreads();
+
+    if (!allocationCounterEnabled())
+        std::cerr << "Built without ALLOC_COUNTER, allocations per frame will read 0" << std::endl;
+
+    cv::Mat homography = loadHomography(dataDir + "/homography.yml");
+    if (homography.empty())
+    {
+        std::cerr << "Using an identity homography" << std::endl;
+        homography = cv::Mat::eye(3, 3, CV_64F);
+    }
+
+    const cv::Size resolutions[] = {cv::Size(640, 480), cv::Size(1280, 720), cv::Size(1920, 1080)};
+    std::vector<BenchResult> results;
+    std::vector<QualityResult> quality;
+
+    std::printf("%s, %d OpenCV threads, %d iterations\n", label.c_str(), threads, iterations);
+    std::printf("%-14s %-10s %-20s %12s %9s %8s %12s %12s\n",
+                "input", "size", "stage", "ns/frame", "MPix/s", "allocs", "p50 ns", "p99 ns");
+
+    for (const cv::Size &size : resolutions)
+    {
+        BenchInput synthetic8{"synthetic_8bit", syntheticIR(size, 255, CV_8U), syntheticVisible(size), 0};
+        benchInput(synthetic8, homography, iterations, results, quality);
+
+        BenchInput synthetic10{"synthetic_10bit", syntheticIR(size, 1023, CV_16U), syntheticVisible(size), 10};
+        benchInput(synthetic10, homography, iterations, results, quality);
+
+        BenchInput bundled;
+        if (loadBundled("bundled_jpg", dataDir + "/ir.jpg", dataDir + "/visible.jpg", 0, size, bundled))
+            benchInput(bundled, homography, iterations, results, quality);
+
+        if (loadBundled("bundled_tiff", dataDir + "/images/irCamera_0-2-mod.tif", dataDir + "/images/visibleCamera_0-1mod.tif", 0, size, bundled))
+            benchInput(bundled, homography, iterations, results, quality);
+    }
+
+    std::printf("\nReduced resolution thresholding against full resolution\n");
+    std::printf("%-14s %-10s %-20s %9s %9s %8s %8s %9s\n",
+                "input", "size", "stage", "full thr", "thr", "IoU", "MAD", "speedup");
+    for (const QualityResult &q : quality)
+        printQuality(q);
+
+    if (!writeQualityCsv(qualityCsvPath, label, threads, quality))
+        return -1;
+
+    if (!writeCsv(csvPath, label, threads, results))
+        return -1;
+
+    std::cout << "Wrote " << results.size() << " results to " << csvPath << std::endl;
+    return 0;
+}
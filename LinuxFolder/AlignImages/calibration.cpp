@@ -0,0 +1,287 @@
+#include "calibration.h"
+#include "ir_processing.h"
+#include "trace.h"
+#include "warp_cache.h"
+
+#include <opencv2/calib3d.hpp>
+#ifndef HEADLESS_BUILD
+#include <opencv2/highgui.hpp>
+#endif
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+
+#define ESC_KEY 27
+
+bool listCalibrationPairs(const std::string &irInput, const std::string &visibleInput, std::vector<CalibrationPair> &pairs)
+{
+    // A plain directory means every file in it
+    auto pattern = [](const std::string &path)
+    { return std::filesystem::is_directory(path) ? path + "/*" : path; };
+
+    std::vector<cv::String> irFiles, visibleFiles;
+    cv::glob(pattern(irInput), irFiles, false);
+    cv::glob(pattern(visibleInput), visibleFiles, false);
+
+    if (irFiles.size() != visibleFiles.size())
+    {
+        std::cerr << "Warning : " << irFiles.size() << " IR images but " << visibleFiles.size()
+                  << " visible images, pairing the first " << std::min(irFiles.size(), visibleFiles.size()) << std::endl;
+    }
+
+    pairs.clear();
+    pairs.resize(std::min(irFiles.size(), visibleFiles.size()));
+    for (size_t i = 0; i < pairs.size(); i++)
+    {
+        pairs[i].irPath = irFiles[i];
+        pairs[i].visiblePath = visibleFiles[i];
+    }
+    return !pairs.empty();
+}
+
+bool captureCalibrationPairs(cv::VideoCapture &irCap, cv::VideoCapture &visibleCap, int count, std::vector<CalibrationPair> &pairs,
+                             bool preview)
+{
+    pairs.clear();
+    cv::Mat irFrame, visibleFrame;
+
+    for (int i = 0; i < count; i++)
+    {
+        // Grab both first so the two exposures are as close together as the drivers allow
+        if (!irCap.grab() || !visibleCap.grab() || !irCap.retrieve(irFrame) || !visibleCap.retrieve(visibleFrame))
+        {
+            std::cerr << "Error: Couldn't read a calibration frame pair" << std::endl;
+            break;
+        }
+
+        CalibrationPair pair;
+        cv::flip(irFrame, pair.ir, 1);
+        pair.visible = visibleFrame.clone();
+        pairs.push_back(std::move(pair));
+
+        std::cout << "Captured calibration pair " << i + 1 << "/" << count << std::endl;
+#ifndef HEADLESS_BUILD
+        if (preview)
+        {
+            cv::imshow("Calibration (move the board, ESC to stop)", visibleFrame);
+            if (cv::waitKey(CALIBRATION_DELAY) == ESC_KEY)
+                break;
+            continue;
+        }
+#endif
+        std::this_thread::sleep_for(std::chrono::milliseconds(CALIBRATION_DELAY));
+    }
+
+#ifndef HEADLESS_BUILD
+    if (preview)
+        cv::destroyAllWindows();
+#endif
+    return !pairs.empty();
+}
+
+// Finds the board on a downscaled copy, then refines the corners on the full resolution image
+static bool findCorners(const cv::Mat &image, std::vector<cv::Point2f> &corners)
+{
+    // Files come in single channel (any depth), camera frames as 8 bit BGR
+    cv::Mat gray;
+    if (image.channels() == 1)
+        normalizeTo8Bit(image, gray);
+    else
+        cv::cvtColor(image, gray, image.channels() == 4 ? cv::COLOR_BGRA2GRAY : cv::COLOR_BGR2GRAY);
+
+    const cv::Size boardSize(CHESSBOARD_COLUMNS, CHESSBOARD_ROWS);
+    double scale = std::min(1.0, (double)CALIBRATION_DETECTION_WIDTH / gray.cols);
+
+    cv::Mat small;
+    if (scale < 1.0)
+        cv::resize(gray, small, cv::Size(), scale, scale, cv::INTER_AREA);
+    else
+        small = gray;
+
+    // FAST_CHECK bails out early on views without a board, which is most of the cost of a bad pair
+    if (!cv::findChessboardCorners(small, boardSize, corners,
+                                   cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE | cv::CALIB_CB_FAST_CHECK))
+    {
+        return false;
+    }
+
+    for (cv::Point2f &corner : corners)
+        corner *= (float)(1.0 / scale);
+
+    // The search window has to cover the detection's error after scaling back up
+    int window = std::max(CALIBRATION_SUBPIX_WINDOW, (int)std::ceil(2.0 / scale));
+    cv::cornerSubPix(gray, corners, cv::Size(window, window), cv::Size(-1, -1),
+                     cv::TermCriteria(cv::TermCriteria::EPS | cv::TermCriteria::COUNT, 30, 0.01));
+    return true;
+}
+
+static void detectPair(CalibrationPair &pair)
+{
+    TRACE_SCOPE("chessboard detect");
+
+    // IMREAD_ANYDEPTH : single channel, 16 bit TIFFs stay 16 bit until normalizeTo8Bit()
+    if (pair.ir.empty() && !pair.irPath.empty())
+        pair.ir = cv::imread(pair.irPath, cv::IMREAD_ANYDEPTH);
+    if (pair.visible.empty() && !pair.visiblePath.empty())
+        pair.visible = cv::imread(pair.visiblePath, cv::IMREAD_ANYDEPTH);
+
+    pair.found = !pair.ir.empty() && !pair.visible.empty() &&
+                 findCorners(pair.visible, pair.visibleCorners) && findCorners(pair.ir, pair.irCorners);
+    if (!pair.found)
+        return;
+
+    pair.irSize = pair.ir.size();
+    pair.visibleSize = pair.visible.size();
+
+    // The board can be detected starting from opposite corners in the two views (it looks the same rotated by 180
+    // degrees), the cameras sit side by side so the first -> last corner direction must roughly agree
+    cv::Point2f visibleDirection = pair.visibleCorners.back() - pair.visibleCorners.front();
+    cv::Point2f irDirection = pair.irCorners.back() - pair.irCorners.front();
+    if (visibleDirection.dot(irDirection) < 0)
+        std::reverse(pair.irCorners.begin(), pair.irCorners.end());
+
+    // Only the corners are needed from here on, don't keep dozens of full resolution frames around
+    if (!pair.irPath.empty())
+        pair.ir.release();
+    if (!pair.visiblePath.empty())
+        pair.visible.release();
+}
+
+// Where the maps send the IR corner in the visible frame, bilinear between the four pixels around it
+// Returns false for a corner on the last row / column, or one the visible frame doesn't cover
+static bool mapCorner(const WarpMapCache &warpCache, cv::Size irSize, cv::Point2f irCorner, cv::Point2f &visibleCorner)
+{
+    const int x = cvFloor(irCorner.x), y = cvFloor(irCorner.y);
+    if (x < 0 || y < 0 || x + 1 >= irSize.width || y + 1 >= irSize.height)
+        return false;
+
+    const float fx = irCorner.x - x, fy = irCorner.y - y;
+    cv::Point2f top = warpCache.sourcePoint({x, y}) * (1 - fx) + warpCache.sourcePoint({x + 1, y}) * fx;
+    cv::Point2f bottom = warpCache.sourcePoint({x, y + 1}) * (1 - fx) + warpCache.sourcePoint({x + 1, y + 1}) * fx;
+    visibleCorner = top * (1 - fy) + bottom * fy;
+    return warpCache.overlap().contains(cv::Point(x, y));
+}
+
+bool calibrateHomography(std::vector<CalibrationPair> &pairs, int threads, int offsetX, int offsetY, cv::Mat &homography)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    int threadCount = threads > 0 ? threads : (int)std::max(1u, std::thread::hardware_concurrency());
+    threadCount = std::min(threadCount, (int)pairs.size());
+    std::cout << "Detecting a " << CHESSBOARD_COLUMNS << "x" << CHESSBOARD_ROWS << " chessboard in " << pairs.size()
+              << " pairs on " << threadCount << " threads" << std::endl;
+
+    // Pair level parallelism like --batch, so keep OpenCV's own thread pool out of the way
+    int previousOpenCVThreads = cv::getNumThreads();
+    cv::setNumThreads(1);
+
+    std::atomic<size_t> nextPair(0);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threadCount; i++)
+    {
+        workers.emplace_back([&]()
+                             {
+                                 traceSetThreadName("calibration worker");
+                                 for (size_t index = nextPair++; index < pairs.size(); index = nextPair++)
+                                     detectPair(pairs[index]);
+                             });
+    }
+    for (std::thread &worker : workers)
+        worker.join();
+
+    cv::setNumThreads(previousOpenCVThreads);
+    double detectSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Every corner of every usable pair goes into one fit, more views spread over the frame give a better homography
+    std::vector<cv::Point2f> visiblePoints, irPoints;
+    cv::Size irSize, visibleSize;
+    int usablePairs = 0;
+    for (size_t i = 0; i < pairs.size(); i++)
+    {
+        const CalibrationPair &pair = pairs[i];
+        if (!pair.found)
+        {
+            std::cout << "Pair " << i << " : no board found"
+                      << (pair.irPath.empty() ? "" : " (" + pair.irPath + ", " + pair.visiblePath + ")") << std::endl;
+            continue;
+        }
+        visiblePoints.insert(visiblePoints.end(), pair.visibleCorners.begin(), pair.visibleCorners.end());
+        irPoints.insert(irPoints.end(), pair.irCorners.begin(), pair.irCorners.end());
+        irSize = pair.irSize;
+        visibleSize = pair.visibleSize;
+        usablePairs++;
+    }
+
+    if (usablePairs == 0)
+    {
+        std::cerr << "The chessboard wasn't found in both views of any pair" << std::endl;
+        return false;
+    }
+
+    // The loop shifts the warped visible frame back by the offsets, so the homography has to land on IR + offset
+    std::vector<cv::Point2f> targets(irPoints.size());
+    for (size_t i = 0; i < irPoints.size(); i++)
+        targets[i] = irPoints[i] + cv::Point2f((float)offsetX, (float)offsetY);
+
+    std::vector<uchar> inliers;
+    cv::Mat fitted = cv::findHomography(visiblePoints, targets, cv::RANSAC, CALIBRATION_RANSAC_THRESHOLD, inliers, 2000, 0.995);
+    if (fitted.empty())
+    {
+        std::cerr << "Could not fit a homography to the detected corners" << std::endl;
+        return false;
+    }
+
+    // RMS reprojection error over the inliers, in IR pixels
+    std::vector<cv::Point2f> projected;
+    cv::perspectiveTransform(visiblePoints, projected, fitted);
+    double squaredError = 0;
+    int inlierCount = 0;
+    for (size_t i = 0; i < projected.size(); i++)
+    {
+        if (!inliers[i])
+            continue;
+        cv::Point2f d = projected[i] - targets[i];
+        squaredError += d.dot(d);
+        inlierCount++;
+    }
+
+    // Round trip : the inlier IR corners through the same fixed point maps the loop warps with, back to the visible corners
+    WarpMapCache warpCache;
+    warpCache.update(fitted, offsetX, offsetY, visibleSize, irSize);
+    double squaredRoundTrip = 0, worstRoundTrip = 0;
+    int roundTripCount = 0;
+    for (size_t i = 0; i < irPoints.size(); i++)
+    {
+        cv::Point2f mapped;
+        if (!inliers[i] || !mapCorner(warpCache, irSize, irPoints[i], mapped))
+            continue;
+        cv::Point2f d = mapped - visiblePoints[i];
+        squaredRoundTrip += d.dot(d);
+        worstRoundTrip = std::max(worstRoundTrip, std::sqrt((double)d.dot(d)));
+        roundTripCount++;
+    }
+    double roundTripError = std::sqrt(squaredRoundTrip / std::max(1, roundTripCount));
+
+    double totalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Board found in " << usablePairs << "/" << pairs.size() << " pairs | " << inlierCount << "/" << projected.size()
+              << " corners inliers | RMS error " << std::sqrt(squaredError / std::max(1, inlierCount)) << " px" << std::endl;
+    std::cout << "Offsets (" << offsetX << ", " << offsetY << ") | warp map round trip RMS " << roundTripError
+              << " px, worst " << worstRoundTrip << " px over " << roundTripCount << " corners" << std::endl;
+    std::cout << "Detection " << detectSeconds << " s, total " << totalSeconds << " s" << std::endl;
+
+    if (roundTripCount == 0 || roundTripError > CALIBRATION_ROUND_TRIP_TOLERANCE)
+    {
+        std::cerr << "The warp maps don't take the IR corners back to the visible ones (tolerance "
+                  << CALIBRATION_ROUND_TRIP_TOLERANCE << " px), not using this homography" << std::endl;
+        return false;
+    }
+
+    homography = fitted;
+    return true;
+}
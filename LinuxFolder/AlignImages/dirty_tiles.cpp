@@ -0,0 +1,133 @@
+#include "dirty_tiles.h"
+#include "trace.h"
+
+#include <opencv2/core/utility.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+void DirtyTiles::reset(cv::Size frameSize)
+{
+    size = frameSize;
+    tilesX = (frameSize.width + DIRTY_TILE_SIZE - 1) / DIRTY_TILE_SIZE;
+    tilesY = (frameSize.height + DIRTY_TILE_SIZE - 1) / DIRTY_TILE_SIZE;
+    tiles.resize((size_t)tilesX * tilesY);
+    markAll();
+}
+
+void DirtyTiles::clear()
+{
+    std::fill(tiles.begin(), tiles.end(), 0);
+}
+
+void DirtyTiles::markAll()
+{
+    std::fill(tiles.begin(), tiles.end(), 1);
+}
+
+void DirtyTiles::merge(const DirtyTiles &other)
+{
+    CV_Assert(other.tilesX == tilesX && other.tilesY == tilesY);
+    for (size_t i = 0; i < tiles.size(); i++)
+        tiles[i] |= other.tiles[i];
+}
+
+int DirtyTiles::count() const
+{
+    int dirtyTiles = 0;
+    for (uint8_t tile : tiles)
+        dirtyTiles += tile;
+    return dirtyTiles;
+}
+
+cv::Rect DirtyTiles::tileRect(int tx, int ty) const
+{
+    return cv::Rect(tx * DIRTY_TILE_SIZE, ty * DIRTY_TILE_SIZE, DIRTY_TILE_SIZE, DIRTY_TILE_SIZE) &
+           cv::Rect(0, 0, size.width, size.height);
+}
+
+// Everything a tile row needs, passed by one reference so the parallel_for_ lambda doesn't allocate
+struct TileCompareJob
+{
+    const cv::Mat &current;
+    cv::Mat &previous;
+    cv::Rect view; // current / previous in frame coordinates
+    DirtyTiles &tiles;
+    int64_t limit; // A tile is dirty when its sum of absolute differences is above limit per sample
+    std::atomic<int> marked{0};
+};
+
+// Sum of absolute differences of one row of a tile, branch free so it vectorizes (psadbw / vabal)
+template <typename T>
+static int rowDifference(const T *a, const T *b, int samples)
+{
+    int sum = 0;
+    for (int x = 0; x < samples; x++)
+        sum += std::abs((int)a[x] - (int)b[x]);
+    return sum;
+}
+
+template <typename T>
+static void compareTileRows(TileCompareJob &job, const cv::Range &range)
+{
+    const int channels = job.current.channels();
+    const int firstColumn = job.view.x / DIRTY_TILE_SIZE;
+    const int lastColumn = (job.view.x + job.view.width - 1) / DIRTY_TILE_SIZE;
+    int marked = 0;
+
+    for (int ty = range.start; ty < range.end; ty++)
+    {
+        for (int tx = firstColumn; tx <= lastColumn; tx++)
+        {
+            // The part of the tile this view covers, in the view's coordinates
+            cv::Rect tile = (job.tiles.tileRect(tx, ty) & job.view) - job.view.tl();
+            const int samples = tile.width * channels;
+
+            // Stops at the first row that takes the tile over the limit, unchanged tiles are read to the end
+            const int64_t tileLimit = job.limit * samples * tile.height;
+            int64_t sum = 0;
+            for (int y = tile.y; sum <= tileLimit && y < tile.y + tile.height; y++)
+                sum += rowDifference(job.current.ptr<T>(y) + tile.x * channels, job.previous.ptr<T>(y) + tile.x * channels, samples);
+            if (sum <= tileLimit)
+                continue;
+
+            job.tiles.mark(tx, ty);
+            marked++;
+            for (int y = tile.y; y < tile.y + tile.height; y++)
+                std::memcpy(job.previous.ptr<T>(y) + tile.x * channels, job.current.ptr<T>(y) + tile.x * channels, samples * sizeof(T));
+        }
+    }
+    job.marked.fetch_add(marked, std::memory_order_relaxed);
+}
+
+static int compareTiles(const cv::Mat &current, cv::Mat &previous, cv::Point origin, int64_t limit, DirtyTiles &tiles)
+{
+    CV_Assert(current.size() == previous.size() && current.type() == previous.type());
+    CV_Assert(current.depth() == CV_8U || current.depth() == CV_16U);
+
+    TileCompareJob job{current, previous, cv::Rect(origin, current.size()), tiles, limit};
+    CV_Assert((job.view & cv::Rect(cv::Point(), tiles.frameSize())) == job.view);
+    if (job.view.empty())
+        return 0;
+
+    const cv::Range tileRows(job.view.y / DIRTY_TILE_SIZE, (job.view.y + job.view.height - 1) / DIRTY_TILE_SIZE + 1);
+    if (current.depth() == CV_8U)
+        cv::parallel_for_(tileRows, [&job](const cv::Range &range)
+                          { compareTileRows<uchar>(job, range); });
+    else
+        cv::parallel_for_(tileRows, [&job](const cv::Range &range)
+                          { compareTileRows<ushort>(job, range); });
+    return job.marked.load(std::memory_order_relaxed);
+}
+
+int updateReferenceTiles(const cv::Mat &frame, cv::Mat &reference, cv::Point origin, int tolerance, DirtyTiles &tiles)
+{
+    TRACE_SCOPE("dirty tiles");
+    return compareTiles(frame, reference, origin, tolerance, tiles);
+}
+
+int updateChangedTiles(const cv::Mat &current, cv::Mat &previous, cv::Point origin, DirtyTiles &tiles)
+{
+    return compareTiles(current, previous, origin, 0, tiles);
+}
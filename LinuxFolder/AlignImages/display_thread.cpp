@@ -0,0 +1,169 @@
+#include "display_thread.h"
+#include "alloc_counter.h"
+#include "trace.h"
+
+#ifndef HEADLESS_BUILD
+#include <opencv2/highgui.hpp>
+#endif
+#include <fstream>
+#include <iostream>
+
+#define ESC_KEY 27
+
+// The offsets are folded into the visible warp (see WarpMapCache), so on screen the IR frame stays put and the visible
+// frame moves the opposite way. Relative to the visible frame the IR overlay still goes the way the key says
+bool handleOffsetKey(int key, int &offsetX, int &offsetY)
+{
+    if (key == 'w') offsetY -= 1;      // Move the visible frame down (IR up relative to it)
+    else if (key == 's') offsetY += 1; // Move the visible frame up (IR down relative to it)
+    else if (key == 'a') offsetX -= 1; // Move the visible frame right (IR left relative to it)
+    else if (key == 'd') offsetX += 1; // Move the visible frame left (IR right relative to it)
+    else
+    {
+        if (key == 'x')
+        {
+            std::ofstream out("offset.txt");
+            if (out.is_open())
+            {
+                out << offsetX << " " << offsetY << "\n";
+                std::cout << "Saved offset: (" << offsetX << ", " << offsetY << ")\n";
+                out.close();
+            }
+            else
+            {
+                std::cerr << "Failed to write to offset.txt\n";
+            }
+        }
+        return false;
+    }
+    return true;
+}
+
+DisplayThread::~DisplayThread()
+{
+    stop();
+}
+
+bool DisplayThread::start(const std::string &windowName, int offsetX, int offsetY)
+{
+#ifdef HEADLESS_BUILD
+    (void)windowName;
+    (void)offsetX;
+    (void)offsetY;
+    std::cerr << "Built with HEADLESS=1, there's no window to show the frames in" << std::endl;
+    return false;
+#else
+    stop();
+
+    this->windowName = windowName;
+    setOffsets(offsetX, offsetY);
+    seenOffsetVersion = offsetVersion.load(std::memory_order_relaxed);
+    quit = false;
+    traceRequest = false;
+    handedOver = 0;
+    shown = 0;
+
+    running = true;
+    displayThread = std::thread(&DisplayThread::displayLoop, this);
+    return true;
+#endif
+}
+
+void DisplayThread::stop()
+{
+    if (!displayThread.joinable())
+        return;
+
+    running = false;
+    displayThread.join();
+}
+
+void DisplayThread::show(const cv::Mat &frame)
+{
+    if (!isRunning())
+        return;
+
+    // Same size every frame, so after the first three frames this is a plain copy into memory the buffer already has
+    {
+        TRACE_SCOPE("display copy");
+        frame.copyTo(frames.writeBuffer());
+    }
+    frames.publish();
+    handedOver++;
+}
+
+bool DisplayThread::pollOffsets(int &offsetX, int &offsetY)
+{
+    uint32_t version = offsetVersion.load(std::memory_order_acquire);
+    if (version == seenOffsetVersion)
+        return false;
+
+    seenOffsetVersion = version;
+    offsetX = this->offsetX.load(std::memory_order_relaxed);
+    offsetY = this->offsetY.load(std::memory_order_relaxed);
+    return true;
+}
+
+void DisplayThread::setOffsets(int offsetX, int offsetY)
+{
+    this->offsetX.store(offsetX, std::memory_order_relaxed);
+    this->offsetY.store(offsetY, std::memory_order_relaxed);
+}
+
+void DisplayThread::displayLoop()
+{
+#ifndef HEADLESS_BUILD
+    traceSetThreadName("display");
+
+    // The GUI backend's event loop inside waitKey() allocates, none of that is the frame loop's
+    ignoreThreadAllocations();
+    cv::namedWindow(windowName, cv::WINDOW_AUTOSIZE);
+
+    while (running.load(std::memory_order_relaxed))
+    {
+        if (frames.update())
+        {
+            TRACE_SCOPE("imshow");
+            cv::imshow(windowName, frames.readBuffer());
+            shown.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Also what lets the window redraw, so it's called whether or not there was a new frame
+        int key;
+        {
+            TRACE_SCOPE("waitKey");
+            key = cv::waitKey(DISPLAY_KEY_WAIT_MS);
+        }
+        if (key < 0)
+            continue;
+
+        if (key == ESC_KEY)
+            quit.store(true, std::memory_order_relaxed);
+        else if (key == 't')
+            traceRequest.store(true, std::memory_order_relaxed);
+        else
+        {
+            int x = offsetX.load(std::memory_order_relaxed);
+            int y = offsetY.load(std::memory_order_relaxed);
+            if (handleOffsetKey(key, x, y))
+            {
+                setOffsets(x, y);
+                offsetVersion.fetch_add(1, std::memory_order_release);
+            }
+        }
+    }
+
+    cv::destroyWindow(windowName);
+    // destroyWindow() only takes effect once the event loop runs again
+    cv::waitKey(1);
+#endif
+}
+
+void DisplayThread::printStats(std::ostream &out) const
+{
+    uint64_t shownFrames = shown.load(std::memory_order_relaxed);
+    out << "Display : " << handedOver << " frames handed over, " << shownFrames << " shown";
+    if (handedOver > 0)
+        out << " (" << 100.0 * shownFrames / handedOver << "%)";
+    out << std::endl;
+}
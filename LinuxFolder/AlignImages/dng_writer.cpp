@@ -0,0 +1,187 @@
+#include "dng_writer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+// TIFF field types
+#define TIFF_BYTE 1
+#define TIFF_ASCII 2
+#define TIFF_SHORT 3
+#define TIFF_LONG 4
+#define TIFF_RATIONAL 5
+#define TIFF_SRATIONAL 10
+
+// Builds one little endian IFD : entries are added in ascending tag order, values that don't fit in the entry go
+// to a data area after the IFD, and the image strip goes last
+class TiffBuilder
+{
+public:
+    void add(uint16_t tag, uint16_t type, uint32_t count, const void *values)
+    {
+        Entry entry{tag, type, count, {}};
+        const uint8_t *bytes = (const uint8_t *)values;
+        entry.data.assign(bytes, bytes + count * typeSize(type));
+        entries.push_back(entry);
+    }
+
+    void addShort(uint16_t tag, uint16_t value) { add(tag, TIFF_SHORT, 1, &value); }
+    void addLong(uint16_t tag, uint32_t value) { add(tag, TIFF_LONG, 1, &value); }
+    void addAscii(uint16_t tag, const std::string &text) { add(tag, TIFF_ASCII, (uint32_t)text.size() + 1, text.c_str()); }
+
+    // Header, IFD and data area, with StripOffsets pointing right after them. The caller appends the strip
+    void write(std::vector<unsigned char> &out, uint32_t stripBytes)
+    {
+        // StripOffsets / StripByteCounts get their real values below, once the layout is known
+        addLong(273, 0);
+        addLong(279, stripBytes);
+        std::stable_sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b)
+                         { return a.tag < b.tag; });
+
+        const uint32_t ifdOffset = 8;
+        const uint32_t ifdSize = 2 + 12 * (uint32_t)entries.size() + 4;
+        uint32_t dataOffset = ifdOffset + ifdSize;
+        uint32_t dataSize = 0;
+        for (const Entry &entry : entries)
+            if (entry.data.size() > 4)
+                dataSize += (uint32_t)(entry.data.size() + 1) & ~1u; // Word aligned
+        uint32_t stripOffset = (dataOffset + dataSize + 15) & ~15u;
+
+        for (Entry &entry : entries)
+            if (entry.tag == 273)
+                std::memcpy(entry.data.data(), &stripOffset, 4);
+
+        out.resize(stripOffset + stripBytes);
+        uint8_t *base = out.data();
+        std::memset(base, 0, stripOffset);
+
+        std::memcpy(base, "II\x2a\x00", 4);
+        std::memcpy(base + 4, &ifdOffset, 4);
+
+        uint8_t *ifd = base + ifdOffset;
+        uint16_t count = (uint16_t)entries.size();
+        std::memcpy(ifd, &count, 2);
+        uint8_t *field = ifd + 2;
+        for (const Entry &entry : entries)
+        {
+            std::memcpy(field, &entry.tag, 2);
+            std::memcpy(field + 2, &entry.type, 2);
+            std::memcpy(field + 4, &entry.count, 4);
+            if (entry.data.size() <= 4)
+            {
+                std::memcpy(field + 8, entry.data.data(), entry.data.size());
+            }
+            else
+            {
+                std::memcpy(field + 8, &dataOffset, 4);
+                std::memcpy(base + dataOffset, entry.data.data(), entry.data.size());
+                dataOffset += (uint32_t)(entry.data.size() + 1) & ~1u;
+            }
+            field += 12;
+        }
+        // Next IFD offset stays 0, there's only one image
+    }
+
+private:
+    struct Entry
+    {
+        uint16_t tag;
+        uint16_t type;
+        uint32_t count;
+        std::vector<uint8_t> data;
+    };
+
+    static size_t typeSize(uint16_t type)
+    {
+        switch (type)
+        {
+        case TIFF_SHORT:
+            return 2;
+        case TIFF_LONG:
+            return 4;
+        case TIFF_RATIONAL:
+        case TIFF_SRATIONAL:
+            return 8;
+        default:
+            return 1;
+        }
+    }
+
+    std::vector<Entry> entries;
+};
+
+static void addImageTags(TiffBuilder &tiff, const cv::Mat &raw, const RawImageInfo &info, uint16_t photometric)
+{
+    tiff.addLong(254, 0); // NewSubfileType : the main image
+    tiff.addLong(256, (uint32_t)raw.cols);
+    tiff.addLong(257, (uint32_t)raw.rows);
+    tiff.addShort(258, 16);          // BitsPerSample
+    tiff.addShort(259, 1);           // Compression : none
+    tiff.addShort(262, photometric); // PhotometricInterpretation
+    if (!info.description.empty())
+        tiff.addAscii(270, info.description);
+    tiff.addShort(277, 1); // SamplesPerPixel
+    tiff.addLong(278, (uint32_t)raw.rows);
+    tiff.addShort(284, 1); // PlanarConfiguration : chunky
+    tiff.addAscii(305, "rawExport");
+}
+
+// Rows go in back to back, the mapping's row stride (if any) is dropped
+static void copyStrip(const cv::Mat &raw, unsigned char *strip)
+{
+    const size_t rowBytes = (size_t)raw.cols * 2;
+    if (raw.isContinuous())
+    {
+        std::memcpy(strip, raw.data, rowBytes * raw.rows);
+        return;
+    }
+    for (int y = 0; y < raw.rows; y++)
+        std::memcpy(strip + rowBytes * y, raw.ptr(y), rowBytes);
+}
+
+void encodeRawTiff(const cv::Mat &raw, const RawImageInfo &info, std::vector<unsigned char> &out)
+{
+    CV_Assert(raw.type() == CV_16UC1);
+
+    TiffBuilder tiff;
+    addImageTags(tiff, raw, info, 1); // BlackIsZero
+
+    const uint32_t stripBytes = (uint32_t)raw.total() * 2;
+    tiff.write(out, stripBytes);
+    copyStrip(raw, out.data() + out.size() - stripBytes);
+}
+
+void encodeRawDng(const cv::Mat &raw, const RawImageInfo &info, std::vector<unsigned char> &out)
+{
+    CV_Assert(raw.type() == CV_16UC1);
+
+    TiffBuilder tiff;
+    addImageTags(tiff, raw, info, 32803); // Color filter array
+
+    // 2x2 repeat of G B / R G (0 = red, 1 = green, 2 = blue)
+    const uint16_t repeat[2] = {2, 2};
+    const uint8_t pattern[4] = {1, 2, 0, 1};
+    tiff.add(33421, TIFF_SHORT, 2, repeat);
+    tiff.add(33422, TIFF_BYTE, 4, pattern);
+
+    const uint8_t version[4] = {1, 4, 0, 0};
+    const uint8_t backwardVersion[4] = {1, 1, 0, 0};
+    tiff.add(50706, TIFF_BYTE, 4, version);
+    tiff.add(50707, TIFF_BYTE, 4, backwardVersion);
+    tiff.addAscii(50708, info.cameraModel.empty() ? "Profusion camera" : info.cameraModel);
+    tiff.addLong(50714, (uint32_t)info.blackLevel);
+    tiff.addLong(50717, (uint32_t)((1u << info.bitDepth) - 1)); // WhiteLevel
+
+    // ColorMatrix1 (identity) and a neutral white balance, numerators / denominators
+    const int32_t colorMatrix[18] = {1, 1, 0, 1, 0, 1,
+                                     0, 1, 1, 1, 0, 1,
+                                     0, 1, 0, 1, 1, 1};
+    const uint32_t neutral[6] = {1, 1, 1, 1, 1, 1};
+    tiff.add(50721, TIFF_SRATIONAL, 9, colorMatrix);
+    tiff.add(50728, TIFF_RATIONAL, 3, neutral);
+    tiff.addShort(50778, 21); // CalibrationIlluminant1 : D65
+
+    const uint32_t stripBytes = (uint32_t)raw.total() * 2;
+    tiff.write(out, stripBytes);
+    copyStrip(raw, out.data() + out.size() - stripBytes);
+}
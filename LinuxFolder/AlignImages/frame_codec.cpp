@@ -0,0 +1,505 @@
+#include "frame_codec.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+// QOI, see https://qoiformat.org/qoi-specification.pdf
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK_2 0xc0
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING_SIZE 8
+
+#define DELTA_MAGIC "PFDT"
+#define DELTA_VERSION 1
+#define DELTA_HEADER_SIZE 16
+#define DELTA_FLAG_KEYFRAME 1
+
+union QoiPixel
+{
+    struct
+    {
+        uchar r, g, b, a;
+    } rgba;
+    uint32_t value;
+};
+
+static inline int qoiHash(const QoiPixel &px)
+{
+    return (px.rgba.r * 3 + px.rgba.g * 5 + px.rgba.b * 7 + px.rgba.a * 11) % 64;
+}
+
+// One QOI chunk stream, pixels are pushed in whatever order the caller walks the frame (rows, or tiles for delta)
+struct QoiWriter
+{
+    uchar *out;
+    QoiPixel index[64];
+    QoiPixel prev;
+    int run = 0;
+
+    explicit QoiWriter(uchar *out) : out(out)
+    {
+        std::memset(index, 0, sizeof(index));
+        prev.value = 0;
+        prev.rgba.a = 255;
+    }
+
+    inline void push(QoiPixel px)
+    {
+        if (px.value == prev.value)
+        {
+            if (++run == 62)
+            {
+                *out++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+            return;
+        }
+
+        if (run > 0)
+        {
+            *out++ = QOI_OP_RUN | (run - 1);
+            run = 0;
+        }
+
+        int hash = qoiHash(px);
+        if (index[hash].value == px.value)
+        {
+            *out++ = QOI_OP_INDEX | hash;
+        }
+        else
+        {
+            index[hash] = px;
+
+            if (px.rgba.a == prev.rgba.a)
+            {
+                signed char vr = px.rgba.r - prev.rgba.r;
+                signed char vg = px.rgba.g - prev.rgba.g;
+                signed char vb = px.rgba.b - prev.rgba.b;
+                signed char vgr = vr - vg;
+                signed char vgb = vb - vg;
+
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+                {
+                    *out++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                }
+                else if (vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8)
+                {
+                    *out++ = QOI_OP_LUMA | (vg + 32);
+                    *out++ = (vgr + 8) << 4 | (vgb + 8);
+                }
+                else
+                {
+                    *out++ = QOI_OP_RGB;
+                    *out++ = px.rgba.r;
+                    *out++ = px.rgba.g;
+                    *out++ = px.rgba.b;
+                }
+            }
+            else
+            {
+                *out++ = QOI_OP_RGBA;
+                *out++ = px.rgba.r;
+                *out++ = px.rgba.g;
+                *out++ = px.rgba.b;
+                *out++ = px.rgba.a;
+            }
+        }
+        prev = px;
+    }
+
+    // Pending run plus the end marker
+    uchar *finish()
+    {
+        if (run > 0)
+            *out++ = QOI_OP_RUN | (run - 1);
+        run = 0;
+
+        static const uchar padding[QOI_PADDING_SIZE] = {0, 0, 0, 0, 0, 0, 0, 1};
+        std::memcpy(out, padding, QOI_PADDING_SIZE);
+        return out + QOI_PADDING_SIZE;
+    }
+};
+
+struct QoiReader
+{
+    const uchar *in;
+    const uchar *end;
+    QoiPixel index[64];
+    QoiPixel px;
+    int run = 0;
+
+    QoiReader(const uchar *in, const uchar *end) : in(in), end(end)
+    {
+        std::memset(index, 0, sizeof(index));
+        px.value = 0;
+        px.rgba.a = 255;
+    }
+
+    // Returns false if the stream ran out (corrupt input), px then just repeats
+    inline bool next(QoiPixel &out)
+    {
+        if (run > 0)
+        {
+            run--;
+        }
+        else if (in < end)
+        {
+            int b1 = *in++;
+            if (b1 == QOI_OP_RGB)
+            {
+                if (end - in < 3)
+                    return false;
+                px.rgba.r = *in++;
+                px.rgba.g = *in++;
+                px.rgba.b = *in++;
+            }
+            else if (b1 == QOI_OP_RGBA)
+            {
+                if (end - in < 4)
+                    return false;
+                px.rgba.r = *in++;
+                px.rgba.g = *in++;
+                px.rgba.b = *in++;
+                px.rgba.a = *in++;
+            }
+            else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX)
+            {
+                px = index[b1];
+            }
+            else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF)
+            {
+                px.rgba.r += ((b1 >> 4) & 0x03) - 2;
+                px.rgba.g += ((b1 >> 2) & 0x03) - 2;
+                px.rgba.b += (b1 & 0x03) - 2;
+            }
+            else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA)
+            {
+                if (in >= end)
+                    return false;
+                int b2 = *in++;
+                int vg = (b1 & 0x3f) - 32;
+                px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);
+                px.rgba.g += vg;
+                px.rgba.b += vg - 8 + (b2 & 0x0f);
+            }
+            else
+            {
+                run = b1 & 0x3f;
+            }
+            index[qoiHash(px)] = px;
+        }
+        else
+        {
+            return false;
+        }
+
+        out = px;
+        return true;
+    }
+};
+
+// OpenCV frames are BGR(A), QOI pixels are RGB(A)
+static inline QoiPixel loadPixel(const uchar *p, int channels)
+{
+    QoiPixel px;
+    px.rgba.r = p[2];
+    px.rgba.g = p[1];
+    px.rgba.b = p[0];
+    px.rgba.a = channels == 4 ? p[3] : 255;
+    return px;
+}
+
+static inline void storePixel(uchar *p, int channels, const QoiPixel &px)
+{
+    p[0] = px.rgba.b;
+    p[1] = px.rgba.g;
+    p[2] = px.rgba.r;
+    if (channels == 4)
+        p[3] = px.rgba.a;
+}
+
+static inline void writeBigEndian32(uchar *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline uint32_t readBigEndian32(const uchar *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+bool parseFrameCodec(const std::string &name, FrameCodec &codec)
+{
+    if (name == "raw")
+        codec = FRAME_CODEC_RAW;
+    else if (name == "qoi")
+        codec = FRAME_CODEC_QOI;
+    else if (name == "delta")
+        codec = FRAME_CODEC_DELTA;
+    else
+        return false;
+    return true;
+}
+
+const char *frameCodecName(FrameCodec codec)
+{
+    switch (codec)
+    {
+    case FRAME_CODEC_RAW:
+        return "raw";
+    case FRAME_CODEC_QOI:
+        return "qoi";
+    case FRAME_CODEC_DELTA:
+        return "delta";
+    }
+    return "unknown";
+}
+
+size_t frameCodecMaxEncodedSize(int width, int height, int channels)
+{
+    // Worst case QOI is a full RGBA op per pixel, plus the headers, the tile mask and the end marker
+    int tiles = ((width + FRAME_CODEC_TILE - 1) / FRAME_CODEC_TILE) * ((height + FRAME_CODEC_TILE - 1) / FRAME_CODEC_TILE);
+    return (size_t)width * height * (channels + 1) + DELTA_HEADER_SIZE + QOI_HEADER_SIZE + (tiles + 7) / 8 + QOI_PADDING_SIZE;
+}
+
+// ------------------ [ ENCODER ] ------------------ //
+
+void FrameEncoder::setCodec(FrameCodec newCodec)
+{
+    codec = newCodec;
+    reset();
+}
+
+size_t FrameEncoder::encode(const cv::Mat &frame, std::vector<uchar> &out)
+{
+    CV_Assert(frame.type() == CV_8UC3 || frame.type() == CV_8UC4);
+
+    // Only ever grows, resizing down and back up every frame would zero fill megabytes each time
+    const int channels = frame.channels();
+    size_t maxSize = frameCodecMaxEncodedSize(frame.cols, frame.rows, channels);
+    if (out.size() < maxSize)
+        out.resize(maxSize);
+
+    if (codec == FRAME_CODEC_RAW)
+    {
+        uchar *dst = out.data();
+        for (int y = 0; y < frame.rows; y++, dst += frame.cols * channels)
+            std::memcpy(dst, frame.ptr(y), frame.cols * channels);
+        return dst - out.data();
+    }
+
+    if (codec == FRAME_CODEC_DELTA)
+        return encodeDelta(frame, out.data());
+
+    uchar *header = out.data();
+    std::memcpy(header, "qoif", 4);
+    writeBigEndian32(header + 4, frame.cols);
+    writeBigEndian32(header + 8, frame.rows);
+    header[12] = channels;
+    header[13] = 0; // sRGB with linear alpha
+
+    QoiWriter writer(header + QOI_HEADER_SIZE);
+    for (int y = 0; y < frame.rows; y++)
+    {
+        const uchar *row = frame.ptr(y);
+        for (int x = 0; x < frame.cols; x++)
+            writer.push(loadPixel(row + x * channels, channels));
+    }
+    return writer.finish() - out.data();
+}
+
+size_t FrameEncoder::encodeDelta(const cv::Mat &frame, uchar *out)
+{
+    const int channels = frame.channels();
+    const int tilesX = (frame.cols + FRAME_CODEC_TILE - 1) / FRAME_CODEC_TILE;
+    const int tilesY = (frame.rows + FRAME_CODEC_TILE - 1) / FRAME_CODEC_TILE;
+    totalTiles = tilesX * tilesY;
+
+    bool keyframe = framesSinceKeyframe < 0 || framesSinceKeyframe + 1 >= FRAME_CODEC_KEYFRAME_INTERVAL ||
+                    previous.size() != frame.size() || previous.type() != frame.type();
+    framesSinceKeyframe = keyframe ? 0 : framesSinceKeyframe + 1;
+
+    // previous keeps its buffer, create() is a no-op after the first frame
+    previous.create(frame.size(), frame.type());
+
+    uchar *header = out;
+    std::memcpy(header, DELTA_MAGIC, 4);
+    header[4] = DELTA_VERSION;
+    header[5] = channels;
+    header[6] = keyframe ? DELTA_FLAG_KEYFRAME : 0;
+    header[7] = FRAME_CODEC_TILE;
+    std::memcpy(header + 8, &frame.cols, 4);
+    std::memcpy(header + 12, &frame.rows, 4);
+
+    uchar *mask = header + DELTA_HEADER_SIZE;
+    const int maskBytes = (totalTiles + 7) / 8;
+    std::memset(mask, 0, maskBytes);
+
+    QoiWriter writer(mask + maskBytes);
+    changedTiles = 0;
+
+    for (int ty = 0; ty < tilesY; ty++)
+    {
+        const int y0 = ty * FRAME_CODEC_TILE;
+        const int y1 = std::min(y0 + FRAME_CODEC_TILE, frame.rows);
+
+        for (int tx = 0; tx < tilesX; tx++)
+        {
+            const int x0 = tx * FRAME_CODEC_TILE;
+            const int rowBytes = (std::min(x0 + FRAME_CODEC_TILE, frame.cols) - x0) * channels;
+
+            // Row by row compare, stops at the first difference
+            bool changed = keyframe;
+            for (int y = y0; !changed && y < y1; y++)
+                changed = std::memcmp(frame.ptr(y) + x0 * channels, previous.ptr(y) + x0 * channels, rowBytes) != 0;
+
+            if (!changed)
+                continue;
+
+            const int tile = ty * tilesX + tx;
+            mask[tile / 8] |= 1 << (tile % 8);
+            changedTiles++;
+
+            for (int y = y0; y < y1; y++)
+            {
+                const uchar *src = frame.ptr(y) + x0 * channels;
+                std::memcpy(previous.ptr(y) + x0 * channels, src, rowBytes);
+                for (int x = 0; x < rowBytes; x += channels)
+                    writer.push(loadPixel(src + x, channels));
+            }
+        }
+    }
+
+    return writer.finish() - out;
+}
+
+// ------------------ [ DECODER ] ------------------ //
+
+bool FrameDecoder::decode(const uchar *data, size_t size, cv::Mat &frame)
+{
+    if (size >= QOI_HEADER_SIZE + QOI_PADDING_SIZE && std::memcmp(data, "qoif", 4) == 0)
+    {
+        const uint32_t width = readBigEndian32(data + 4);
+        const uint32_t height = readBigEndian32(data + 8);
+        const int channels = data[12];
+        if (width == 0 || height == 0 || width > 16384 || height > 16384 || (channels != 3 && channels != 4))
+            return false;
+
+        frame.create(height, width, CV_8UC(channels));
+        QoiReader reader(data + QOI_HEADER_SIZE, data + size - QOI_PADDING_SIZE);
+        QoiPixel px;
+        for (int y = 0; y < frame.rows; y++)
+        {
+            uchar *row = frame.ptr(y);
+            for (int x = 0; x < frame.cols; x++)
+            {
+                if (!reader.next(px))
+                    return false;
+                storePixel(row + x * channels, channels, px);
+            }
+        }
+        return true;
+    }
+
+    if (size >= DELTA_HEADER_SIZE + QOI_PADDING_SIZE && std::memcmp(data, DELTA_MAGIC, 4) == 0 && data[4] == DELTA_VERSION)
+    {
+        const int channels = data[5];
+        const bool keyframe = data[6] & DELTA_FLAG_KEYFRAME;
+        const int tileSize = data[7];
+        int width, height;
+        std::memcpy(&width, data + 8, 4);
+        std::memcpy(&height, data + 12, 4);
+        if (width <= 0 || height <= 0 || width > 16384 || height > 16384 || (channels != 3 && channels != 4) || tileSize == 0)
+            return false;
+
+        // A delta only makes sense on top of the frame it was made against
+        if (!keyframe && (!haveKeyframe || frame.cols != width || frame.rows != height || frame.channels() != channels))
+            return false;
+
+        const int tilesX = (width + tileSize - 1) / tileSize;
+        const int tilesY = (height + tileSize - 1) / tileSize;
+        const int maskBytes = (tilesX * tilesY + 7) / 8;
+        if (size < (size_t)DELTA_HEADER_SIZE + maskBytes + QOI_PADDING_SIZE)
+            return false;
+
+        frame.create(height, width, CV_8UC(channels));
+        const uchar *mask = data + DELTA_HEADER_SIZE;
+        QoiReader reader(mask + maskBytes, data + size - QOI_PADDING_SIZE);
+        QoiPixel px;
+
+        haveKeyframe = false; // Until this frame decoded cleanly
+        for (int ty = 0; ty < tilesY; ty++)
+        {
+            const int y0 = ty * tileSize;
+            const int y1 = std::min(y0 + tileSize, height);
+            for (int tx = 0; tx < tilesX; tx++)
+            {
+                const int tile = ty * tilesX + tx;
+                if (!(mask[tile / 8] & (1 << (tile % 8))))
+                    continue;
+
+                const int x0 = tx * tileSize;
+                const int x1 = std::min(x0 + tileSize, width);
+                for (int y = y0; y < y1; y++)
+                {
+                    uchar *row = frame.ptr(y);
+                    for (int x = x0; x < x1; x++)
+                    {
+                        if (!reader.next(px))
+                            return false;
+                        storePixel(row + x * channels, channels, px);
+                    }
+                }
+            }
+        }
+        haveKeyframe = true;
+        return true;
+    }
+
+    return false;
+}
+
+// ------------------ [ FILES ] ------------------ //
+
+bool writeQoiFile(const std::string &path, const cv::Mat &frame)
+{
+    std::vector<uchar> encoded;
+    size_t size = FrameEncoder(FRAME_CODEC_QOI).encode(frame, encoded);
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open " << path << std::endl;
+        return false;
+    }
+    file.write((const char *)encoded.data(), size);
+    return (bool)file;
+}
+
+cv::Mat readQoiFile(const std::string &path)
+{
+    cv::Mat frame;
+
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+        return frame;
+
+    std::vector<uchar> data((size_t)file.tellg());
+    file.seekg(0);
+    if (!file.read((char *)data.data(), data.size()))
+        return frame;
+
+    FrameDecoder decoder;
+    if (!decoder.decode(data.data(), data.size(), frame))
+        frame.release();
+    return frame;
+}
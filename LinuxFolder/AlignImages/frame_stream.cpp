@@ -0,0 +1,590 @@
+#include "frame_stream.h"
+#include "alloc_counter.h"
+#include "spsc_queue.h"
+#include "trace.h"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define FRAME_STREAM_SOCKET_BUFFER (4 * 1024 * 1024) // A few 640x480 BGRA frames in flight
+#define FRAME_STREAM_MAX_DIMENSION 16384
+
+struct Endpoint
+{
+    bool unixSocket = false;
+    std::string path; // UNIX socket path
+    std::string host; // Empty = any interface when listening
+    std::string port;
+};
+
+static bool parseEndpoint(const std::string &text, Endpoint &endpoint)
+{
+    if (text.compare(0, 5, "unix:") == 0)
+    {
+        endpoint.unixSocket = true;
+        endpoint.path = text.substr(5);
+        return !endpoint.path.empty() && endpoint.path.size() < sizeof(sockaddr_un::sun_path);
+    }
+
+    std::string address = text.compare(0, 4, "tcp:") == 0 ? text.substr(4) : text;
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos)
+    {
+        endpoint.port = address.empty() ? std::to_string(FRAME_STREAM_DEFAULT_PORT) : address;
+    }
+    else
+    {
+        endpoint.host = address.substr(0, colon);
+        endpoint.port = address.substr(colon + 1);
+    }
+    return !endpoint.port.empty();
+}
+
+static void setTimeouts(int fd)
+{
+    struct timeval timeout = {FRAME_STREAM_IO_TIMEOUT_MS / 1000, (FRAME_STREAM_IO_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+static void tuneSocket(int fd, bool tcp)
+{
+    int bufferSize = FRAME_STREAM_SOCKET_BUFFER;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+    // Every frame is a single writev(), there's never a small tail worth waiting to coalesce
+    if (tcp)
+    {
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    }
+    setTimeouts(fd);
+}
+
+// connect() without blocking for the kernel's SYN retries : a filtered host would otherwise hold the caller for minutes
+// Returns the connected, blocking socket (send() relies on SO_SNDTIMEO) or -1 with errno set
+static int connectWithTimeout(int family, const struct sockaddr *address, socklen_t length, int timeoutMs)
+{
+    int fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return -1;
+
+    if (::connect(fd, address, length) != 0)
+    {
+        if (errno != EINPROGRESS)
+        {
+            int error = errno;
+            ::close(fd);
+            errno = error;
+            return -1;
+        }
+
+        struct pollfd pending = {fd, POLLOUT, 0};
+        int ready;
+        do
+            ready = poll(&pending, 1, timeoutMs);
+        while (ready < 0 && errno == EINTR);
+
+        int error = ready == 0 ? ETIMEDOUT : errno;
+        socklen_t errorLength = sizeof(error);
+        if (ready > 0 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) != 0)
+            error = errno;
+        if (ready <= 0 || error != 0)
+        {
+            ::close(fd);
+            errno = error;
+            return -1;
+        }
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return fd;
+}
+
+// Keeps calling sendmsg() until every iovec is out, partial writes are normal for multi megabyte frames
+static bool sendAll(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        struct msghdr message = {};
+        message.msg_iov = iov;
+        message.msg_iovlen = count;
+
+        // MSG_NOSIGNAL : a closed display shouldn't kill alignImages with SIGPIPE
+        ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        while (count > 0 && (size_t)sent >= iov->iov_len)
+        {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return true;
+}
+
+static bool receiveAll(int fd, void *buffer, size_t length)
+{
+    char *ptr = (char *)buffer;
+    while (length > 0)
+    {
+        ssize_t received = recv(fd, ptr, length, MSG_WAITALL);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return false;
+        ptr += received;
+        length -= received;
+    }
+    return true;
+}
+
+uint64_t frameStreamNowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// ------------------ [ SENDER ] ------------------ //
+
+FrameSender::~FrameSender()
+{
+    close();
+}
+
+bool FrameSender::resolve(const std::string &endpointText)
+{
+    if (endpointText == resolvedEndpoint && !addresses.empty())
+        return true;
+
+    resolvedEndpoint.clear();
+    addresses.clear();
+
+    Endpoint endpoint;
+    if (!parseEndpoint(endpointText, endpoint))
+    {
+        std::cerr << "Invalid stream endpoint " << endpointText << std::endl;
+        return false;
+    }
+
+    if (endpoint.unixSocket)
+    {
+        ResolvedAddress resolved = {};
+        struct sockaddr_un *address = (struct sockaddr_un *)&resolved.address;
+        address->sun_family = AF_UNIX;
+        std::strncpy(address->sun_path, endpoint.path.c_str(), sizeof(address->sun_path) - 1);
+        resolved.length = sizeof(struct sockaddr_un);
+        resolved.family = AF_UNIX;
+        addresses.push_back(resolved);
+    }
+    else
+    {
+        struct addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo *found = nullptr;
+        if (getaddrinfo(endpoint.host.empty() ? "127.0.0.1" : endpoint.host.c_str(), endpoint.port.c_str(), &hints, &found) != 0)
+        {
+            std::cerr << "Failed to resolve " << endpointText << std::endl;
+            return false;
+        }
+
+        for (struct addrinfo *a = found; a; a = a->ai_next)
+        {
+            ResolvedAddress resolved = {};
+            std::memcpy(&resolved.address, a->ai_addr, a->ai_addrlen);
+            resolved.length = a->ai_addrlen;
+            resolved.family = a->ai_family;
+            addresses.push_back(resolved);
+        }
+        freeaddrinfo(found);
+    }
+
+    resolvedEndpoint = endpointText;
+    return !addresses.empty();
+}
+
+bool FrameSender::connect(const std::string &endpointText)
+{
+    close();
+
+    if (!resolve(endpointText))
+        return false;
+
+    for (const ResolvedAddress &resolved : addresses)
+    {
+        fd = connectWithTimeout(resolved.family, (const struct sockaddr *)&resolved.address, resolved.length,
+                                FRAME_STREAM_IO_TIMEOUT_MS);
+        if (fd >= 0)
+            break;
+    }
+
+    if (fd < 0)
+    {
+        std::cerr << "Failed to connect to " << endpointText << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    tuneSocket(fd, addresses.front().family != AF_UNIX);
+
+    // A new receiver has nothing to apply deltas to
+    encoder.reset();
+    return true;
+}
+
+void FrameSender::close()
+{
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+}
+
+bool FrameSender::send(const cv::Mat &frame, uint64_t frameSequence)
+{
+    if (fd < 0)
+        return false;
+
+    CV_Assert(frame.depth() == CV_8U && (frame.channels() == 4 || frame.channels() == 3 || frame.channels() == 1));
+
+    FrameHeader header = {};
+    header.magic = FRAME_STREAM_MAGIC;
+    header.version = FRAME_STREAM_VERSION;
+    header.format = frame.channels() == 4 ? FRAME_FORMAT_BGRA : frame.channels() == 3 ? FRAME_FORMAT_BGR : FRAME_FORMAT_GRAY;
+    header.width = frame.cols;
+    header.height = frame.rows;
+    header.sequence = frameSequence;
+    header.timestampNs = frameStreamNowNs();
+    header.codec = frame.channels() == 1 ? FRAME_CODEC_RAW : encoder.type();
+
+    bool ok;
+    if (header.codec != FRAME_CODEC_RAW)
+    {
+        header.payloadBytes = (uint32_t)encoder.encode(frame, encoded);
+        struct iovec iov[2] = {{&header, sizeof(header)}, {encoded.data(), header.payloadBytes}};
+        ok = sendAll(fd, iov, 2);
+    }
+    else if (frame.isContinuous())
+    {
+        header.payloadBytes = (uint32_t)(frame.total() * frame.elemSize());
+        struct iovec iov[2] = {{&header, sizeof(header)}, {frame.data, header.payloadBytes}};
+        ok = sendAll(fd, iov, 2);
+    }
+    else
+    {
+        // ROI views, send the rows one by one rather than copying into a packed buffer
+        header.payloadBytes = (uint32_t)(frame.total() * frame.elemSize());
+        struct iovec iov[1] = {{&header, sizeof(header)}};
+        ok = sendAll(fd, iov, 1);
+        for (int y = 0; ok && y < frame.rows; y++)
+        {
+            iov[0] = {(void *)frame.ptr(y), frame.cols * frame.elemSize()};
+            ok = sendAll(fd, iov, 1);
+        }
+    }
+
+    if (!ok)
+    {
+        std::cerr << "Frame stream disconnected: " << std::strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    payloadBytes = header.payloadBytes;
+    sequence = frameSequence + 1;
+    sent++;
+    return true;
+}
+
+// ------------------ [ SENDER THREAD ] ------------------ //
+
+FrameStreamThread::~FrameStreamThread()
+{
+    stop();
+}
+
+void FrameStreamThread::start(const std::string &endpoint, FrameCodec codec)
+{
+    stop();
+
+    this->endpoint = endpoint;
+    sender.setCodec(codec);
+    handedOver = 0;
+
+    running = true;
+    streamThread = std::thread(&FrameStreamThread::streamLoop, this);
+}
+
+void FrameStreamThread::stop()
+{
+    if (!streamThread.joinable())
+        return;
+
+    running = false;
+    streamThread.join();
+    sender.close();
+    connected = false;
+}
+
+void FrameStreamThread::send(const cv::Mat &frame)
+{
+    if (!isRunning())
+        return;
+
+    StreamFrame &slot = frames.writeBuffer();
+    {
+        TRACE_SCOPE("stream copy");
+        frame.copyTo(slot.image);
+    }
+    slot.sequence = handedOver++;
+    frames.publish();
+}
+
+void FrameStreamThread::streamLoop()
+{
+    traceSetThreadName("stream");
+    // Resolving, connecting and encoding allocate, none of it is the frame loop's
+    ignoreThreadAllocations();
+
+    Backoff backoff;
+    auto nextAttempt = std::chrono::steady_clock::now();
+    while (running.load(std::memory_order_relaxed))
+    {
+        if (!sender.isConnected())
+        {
+            // Short sleeps rather than one long one, so stop() doesn't wait out the whole retry interval
+            if (std::chrono::steady_clock::now() < nextAttempt)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                continue;
+            }
+            nextAttempt = std::chrono::steady_clock::now() + std::chrono::milliseconds(FRAME_STREAM_RECONNECT_MS);
+            if (!sender.connect(endpoint))
+                continue;
+            connected.store(true, std::memory_order_relaxed);
+
+            // The newest frame goes out straight away even if it was handed over before the connection was up,
+            // a static image is only handed over once
+            frames.update();
+            const StreamFrame &frame = frames.readBuffer();
+            if (!frame.image.empty() && !sender.send(frame.image, frame.sequence))
+                connected.store(false, std::memory_order_relaxed);
+            continue;
+        }
+
+        if (!frames.update())
+        {
+            backoff.pause();
+            continue;
+        }
+        backoff.reset();
+
+        const StreamFrame &frame = frames.readBuffer();
+        TRACE_SCOPE("stream send");
+        if (!sender.send(frame.image, frame.sequence))
+            connected.store(false, std::memory_order_relaxed);
+    }
+}
+
+// ------------------ [ RECEIVER ] ------------------ //
+
+FrameReceiver::~FrameReceiver()
+{
+    close();
+}
+
+bool FrameReceiver::listen(const std::string &endpointText)
+{
+    close();
+
+    Endpoint endpoint;
+    if (!parseEndpoint(endpointText, endpoint))
+    {
+        std::cerr << "Invalid stream endpoint " << endpointText << std::endl;
+        return false;
+    }
+
+    if (endpoint.unixSocket)
+    {
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, endpoint.path.c_str(), sizeof(address.sun_path) - 1);
+
+        // A stale socket file from a previous run would make bind() fail
+        unlink(endpoint.path.c_str());
+        if (listenFd < 0 || bind(listenFd, (struct sockaddr *)&address, sizeof(address)) != 0 || ::listen(listenFd, 1) != 0)
+        {
+            std::cerr << "Failed to listen on " << endpointText << ": " << std::strerror(errno) << std::endl;
+            close();
+            return false;
+        }
+        unixPath = endpoint.path;
+        return true;
+    }
+
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo *addresses = nullptr;
+    if (getaddrinfo(endpoint.host.empty() ? nullptr : endpoint.host.c_str(), endpoint.port.c_str(), &hints, &addresses) != 0)
+    {
+        std::cerr << "Failed to resolve " << endpointText << std::endl;
+        return false;
+    }
+
+    for (struct addrinfo *a = addresses; a; a = a->ai_next)
+    {
+        listenFd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (listenFd < 0)
+            continue;
+
+        int reuse = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(listenFd, a->ai_addr, a->ai_addrlen) == 0 && ::listen(listenFd, 1) == 0)
+            break;
+
+        ::close(listenFd);
+        listenFd = -1;
+    }
+    freeaddrinfo(addresses);
+
+    if (listenFd < 0)
+    {
+        std::cerr << "Failed to listen on " << endpointText << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void FrameReceiver::close()
+{
+    dropClient();
+    if (listenFd >= 0)
+        ::close(listenFd);
+    listenFd = -1;
+
+    if (!unixPath.empty())
+        unlink(unixPath.c_str());
+    unixPath.clear();
+}
+
+void FrameReceiver::dropClient()
+{
+    if (clientFd >= 0)
+        ::close(clientFd);
+    clientFd = -1;
+    haveSequence = false;
+    decoder = FrameDecoder();
+}
+
+bool FrameReceiver::acceptClient(int timeoutMs)
+{
+    struct pollfd pfd = {listenFd, POLLIN, 0};
+    if (poll(&pfd, 1, timeoutMs) <= 0)
+        return false;
+
+    clientFd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (clientFd < 0)
+        return false;
+
+    tuneSocket(clientFd, unixPath.empty());
+    std::cout << "Frame stream connected" << std::endl;
+    return true;
+}
+
+bool FrameReceiver::receive(cv::Mat &frame, FrameHeader &header, int timeoutMs)
+{
+    if (listenFd < 0)
+        return false;
+
+    if (clientFd < 0 && !acceptClient(timeoutMs))
+        return false;
+
+    struct pollfd pfd = {clientFd, POLLIN, 0};
+    if (poll(&pfd, 1, timeoutMs) <= 0)
+        return false;
+
+    // Once a frame has started the rest of it follows right away, the socket timeout catches a stalled sender
+    if (!receiveAll(clientFd, &header, sizeof(header)))
+    {
+        std::cout << "Frame stream disconnected" << std::endl;
+        dropClient();
+        return false;
+    }
+
+    int channels = header.format == FRAME_FORMAT_BGRA ? 4 : header.format == FRAME_FORMAT_BGR ? 3 : header.format == FRAME_FORMAT_GRAY ? 1 : 0;
+    uint64_t rawBytes = (uint64_t)header.width * header.height * channels;
+    bool payloadValid = header.codec == FRAME_CODEC_RAW ? header.payloadBytes == rawBytes
+                                                        : header.payloadBytes <= frameCodecMaxEncodedSize(header.width, header.height, channels);
+    if (header.magic != FRAME_STREAM_MAGIC || header.version != FRAME_STREAM_VERSION || channels == 0 ||
+        header.width == 0 || header.height == 0 || header.width > FRAME_STREAM_MAX_DIMENSION || header.height > FRAME_STREAM_MAX_DIMENSION ||
+        header.codec > FRAME_CODEC_DELTA || !payloadValid)
+    {
+        // Nothing after a bad header can be trusted to be aligned on a frame boundary
+        std::cerr << "Bad frame header, dropping the connection" << std::endl;
+        dropClient();
+        return false;
+    }
+
+    bool decoded = true;
+    if (header.codec != FRAME_CODEC_RAW)
+    {
+        // The receive buffer only grows, decoding writes into frame (and delta frames patch what's already there)
+        if (encoded.size() < header.payloadBytes)
+            encoded.resize(header.payloadBytes);
+        if (!receiveAll(clientFd, encoded.data(), header.payloadBytes))
+        {
+            std::cout << "Frame stream disconnected mid frame" << std::endl;
+            dropClient();
+            return false;
+        }
+
+        // A delta that doesn't apply (a frame was lost) is skipped until the next keyframe, the connection stays up
+        decoded = decoder.decode(encoded.data(), header.payloadBytes, frame);
+    }
+    else
+    {
+        // Same size and format as last time (the normal case) reuses the buffer
+        frame.create(header.height, header.width, CV_8UC(channels));
+        if (!receiveAll(clientFd, frame.data, header.payloadBytes))
+        {
+            std::cout << "Frame stream disconnected mid frame" << std::endl;
+            dropClient();
+            return false;
+        }
+    }
+
+    if (haveSequence && header.sequence > lastSequence + 1)
+        dropped += header.sequence - lastSequence - 1;
+    lastSequence = header.sequence;
+    haveSequence = true;
+
+    return decoded;
+}
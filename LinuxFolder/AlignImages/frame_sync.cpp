@@ -0,0 +1,85 @@
+#include "frame_sync.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+std::vector<double> loadTimestamps(const std::string &path)
+{
+    std::vector<double> timestamps;
+
+    std::ifstream in(path);
+    if (!in.is_open())
+    {
+        // Whether a missing file matters is up to the caller, RawRecording looks for one next to every .raw file
+        if (std::filesystem::exists(path))
+            std::cerr << "Failed to open timestamp file " << path << std::endl;
+        return timestamps;
+    }
+
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        try
+        {
+            timestamps.push_back(std::stod(line));
+        }
+        catch (const std::exception &)
+        {
+            std::cerr << "Skipping bad timestamp line in " << path << " : " << line << std::endl;
+        }
+    }
+
+    return timestamps;
+}
+
+std::vector<FramePair> pairRecordedFrames(const std::vector<double> &irTimestamps, const std::vector<double> &visibleTimestamps,
+                                          double toleranceMs, SyncPolicy policy, SyncStats &stats)
+{
+    std::vector<FramePair> pairs;
+    pairs.reserve(std::min(irTimestamps.size(), visibleTimestamps.size()));
+
+    FrameSynchronizer<int> synchronizer(toleranceMs, policy);
+    FrameSynchronizer<int>::Pair pair;
+
+    // Feed frames in the order the cameras would have delivered them
+    size_t ir = 0, visible = 0;
+    while (ir < irTimestamps.size() || visible < visibleTimestamps.size())
+    {
+        if (visible >= visibleTimestamps.size() || (ir < irTimestamps.size() && irTimestamps[ir] <= visibleTimestamps[visible]))
+        {
+            synchronizer.pushIR(irTimestamps[ir], (int)ir);
+            ir++;
+        }
+        else
+        {
+            synchronizer.pushVisible(visibleTimestamps[visible], (int)visible);
+            visible++;
+        }
+
+        while (synchronizer.pop(pair))
+            pairs.push_back({pair.ir.payload, pair.visible.payload, pair.skewMs});
+    }
+
+    synchronizer.flush();
+    while (synchronizer.pop(pair))
+        pairs.push_back({pair.ir.payload, pair.visible.payload, pair.skewMs});
+
+    stats = synchronizer.stats();
+    return pairs;
+}
+
+void printSyncStats(const SyncStats &stats)
+{
+    std::cout << "\nFrame synchronization :" << std::endl
+              << "Pairs : " << stats.pairs << " (" << stats.duplicated << " duplicated)" << std::endl
+              << "Dropped IR frames : " << stats.irDropped << std::endl
+              << "Dropped visible frames : " << stats.visibleDropped << std::endl
+              << "Dropped on queue overflow : " << stats.overflowDropped << std::endl
+              << "Mean skew : " << stats.meanSkewMs() << " ms" << std::endl
+              << "Max skew : " << stats.maxSkewMs << " ms" << std::endl;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+
+// Heap allocation counter for checking the steady state frame loop doesn't allocate
+//
+// Only active in debug builds (make DEBUG=1 defines ALLOC_COUNTER), where malloc and friends are wrapped for
+// the whole process, OpenCV's Mat buffers and operator new included. Otherwise the count is always 0.
+size_t allocationCount();
+
+// Leaves the calling thread's allocations out of the count, for background threads that are allowed to allocate
+// (the auto alignment estimator) and would otherwise show up as allocations in the frame loop
+void ignoreThreadAllocations();
+
+inline bool allocationCounterEnabled()
+{
+#ifdef ALLOC_COUNTER
+    return true;
+#else
+    return false;
+#endif
+}
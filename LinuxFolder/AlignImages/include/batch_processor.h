@@ -0,0 +1,53 @@
+#pragma once
+
+#include "bayer.h"
+#include "frame_codec.h"
+#include "frame_sync.h"
+#include "ir_processing.h"
+
+#include <opencv2/core.hpp>
+#include <string>
+
+// Frames a worker may run ahead of the writer before it waits, caps the memory held by the reorder buffer
+#define BATCH_REORDER_WINDOW 64
+
+struct BatchOptions
+{
+    // Either an irCamera_N.raw / visibleCamera_N.raw pair, or two directories / glob patterns of images
+    std::string irInput;
+    std::string visibleInput;
+
+    // A directory for numbered PNGs, or a .avi file for an MJPG video
+    std::string output;
+
+    // FRAME_CODEC_QOI (or delta, which is QOI per file here) writes numbered .qoi files instead of PNGs.
+    // Workers encode frames out of order, so there's no previous frame to take a delta against
+    FrameCodec imageCodec = FRAME_CODEC_RAW;
+
+    // IRProcessingContext::setAnalysisScale() for every worker
+    int irAnalysisScale = 1;
+    IRAnalysisOutput irAnalysisOutput = IRAnalysisOutput::FullResolution;
+
+    int threads = 0; // 0 = one worker per core
+    int offsetX = 0;
+    int offsetY = 0;
+    double fps = 30.0;
+
+    // How raw recordings are decoded from the Bayer mosaic, Half processes (and writes) 1/2 size frames
+    RawDecode rawDecode = RawDecode::Full;
+
+    // Valid bits in 16 bit IR images (a 10 bit sensor saved to TIFF), 0 = all 16. Raw recordings know their own
+    int irBitDepth = 0;
+
+    // Only used for raw recordings that come with timestamp files
+    double syncToleranceMs = SYNC_TOLERANCE_MS;
+    SyncPolicy syncPolicy = SyncPolicy::Drop;
+};
+
+// Runs threshold -> LUT remap -> colorize -> warp -> blend on every frame of a recording
+//
+// Frames are handed out to a pool of worker threads one at a time (frame level parallelism, the per frame
+// OpenCV calls run single threaded so the workers don't fight over cores), and the results go through an
+// in-order writer so the output sequence matches the input no matter which worker finishes first.
+// Prints frames/sec at the end. Returns 0 on success.
+int runBatch(const BatchOptions &options, const cv::Mat &homography);
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <string>
+
+// RecordRawVideo's SGBRG10 frames : 10 bit samples in 16 bit words, every 2x2 quad of the sensor is
+//   G B
+//   R G
+// The kernels below go straight from that mosaic to the frames the aligner works on, unpacking and normalizing
+// the samples in the same pass. Samples may have up to BAYER_MAX_BIT_DEPTH valid bits, anything above them must be 0.
+#define BAYER_MAX_BIT_DEPTH 12 // Keeps the full resolution 3x3 sums inside 16 bits
+
+// What bayerHalf() makes out of each 2x2 quad
+enum class BayerChannel
+{
+    Luminance, // (R + 2G + B) / 4, the plain sum of the quad
+    Red,
+    Green,     // Average of the two greens
+    Blue,
+};
+
+// How raw recordings are turned into grayscale frames
+enum class RawDecode
+{
+    Full, // bayerLuminance(), same size and geometry as the recording
+    Half, // bayerHalf() luminance, 1/2 size, a quarter of the pixels for everything downstream
+};
+
+// "full" or "half", returns false for anything else
+bool parseRawDecode(const std::string &name, RawDecode &decode);
+
+// Half resolution : one output pixel per 2x2 quad, so the colors are never interpolated
+// dstDepth CV_8U scales the result to 0-255, CV_16U keeps the sum as it is : bitDepth + 2 valid bits for Luminance,
+// + 1 for Green, bitDepth for Red and Blue. Summing the quad adds precision over a single sample, which CV_16U keeps
+void bayerHalf(const cv::Mat &raw, int bitDepth, BayerChannel channel, int dstDepth, cv::Mat &dst);
+
+// Full resolution luminance without demosaicing : a 3x3 [1 2 1] x [1 2 1] filter over the mosaic weighs the
+// channels (R + 2G + B) / 4 at every pixel whatever its position in the quad, so it's one filter pass instead of
+// a demosaic followed by a color conversion. Borders are mirrored, which keeps the Bayer phase
+// dstDepth CV_8U scales the result to 0-255, CV_16U keeps the weighted sum, bitDepth + 4 valid bits
+void bayerLuminance(const cv::Mat &raw, int bitDepth, int dstDepth, cv::Mat &dst);
+
+// 8 bit BGR for viewing / exporting the visible stream
+// half : one pixel per quad (B, average G, R), full : OpenCV's bilinear demosaic on the mosaic normalized to 8 bit
+void bayerDemosaic(const cv::Mat &raw, int bitDepth, bool half, cv::Mat &dst);
+
+// Valid bits in a CV_16U decodeRawFrame() result, the bitDepth to colorize() it with
+int decodedBitDepth(int bitDepth, RawDecode decode);
+
+// bayerLuminance() or bayerHalf(Luminance)
+void decodeRawFrame(const cv::Mat &raw, int bitDepth, RawDecode decode, int dstDepth, cv::Mat &dst);
+
+// The visible to IR homography for frames that were both scaled by scale (0.5 for RawDecode::Half)
+cv::Mat scaleHomography(const cv::Mat &homography, double scale);
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+#include <string>
+#include <vector>
+
+#define CHESSBOARD_COLUMNS 9 // Inner corners
+#define CHESSBOARD_ROWS 6
+#define NUMBER_OF_CALIBRATION_IMAGES 20 // Pairs grabbed by --calibrate-live, move the board between them
+#define CALIBRATION_DELAY 1000          // In milliseconds, between live captures
+#define CALIBRATION_DETECTION_WIDTH 640 // Corners are searched for at this width, then refined at full resolution
+#define CALIBRATION_SUBPIX_WINDOW 5     // Half size of the cornerSubPix() search window at full resolution
+#define CALIBRATION_RANSAC_THRESHOLD 3.0 // Reprojection error in IR pixels above which a corner is an outlier
+#define CALIBRATION_ROUND_TRIP_TOLERANCE 1.0 // RMS error in visible pixels of the corners taken back through the warp maps
+
+// One IR / visible chessboard view, either loaded from a pair of files or grabbed from the cameras
+struct CalibrationPair
+{
+    std::string irPath;
+    std::string visiblePath;
+    cv::Mat ir;      // Loaded lazily from irPath when empty
+    cv::Mat visible;
+
+    // Filled in by calibrateHomography()
+    bool found = false;
+    cv::Size irSize;
+    cv::Size visibleSize;
+    std::vector<cv::Point2f> irCorners;
+    std::vector<cv::Point2f> visibleCorners;
+};
+
+// Pairs up two directories / glob patterns of chessboard images by sorted file name (like --batch does)
+bool listCalibrationPairs(const std::string &irInput, const std::string &visibleInput, std::vector<CalibrationPair> &pairs);
+
+// Grabs count pairs CALIBRATION_DELAY apart, the IR frame is flipped the same way the live loop flips it
+// ESC stops early, returns false if no pair was captured. Without preview (--headless) there's no window and no ESC
+bool captureCalibrationPairs(cv::VideoCapture &irCap, cv::VideoCapture &visibleCap, int count, std::vector<CalibrationPair> &pairs,
+                             bool preview = true);
+
+// Finds the board in every pair on threads worker threads (0 = one per core) and fits the visible to IR homography
+// over the corners of every pair where both views found it, RANSAC + Levenberg-Marquardt refinement on the inliers
+//
+// Detection runs on a copy downscaled to CALIBRATION_DETECTION_WIDTH, which is where nearly all of the time goes
+// at full resolution, and the corners are then refined with cornerSubPix() on the full resolution image.
+// Prints per pair results and the reprojection error. Returns false if no pair is usable.
+//
+// The loop warps the visible frame with the homography followed by a shift of (-offsetX, -offsetY) (see WarpMapCache),
+// so the fit is against the IR corners shifted by the offsets the loop will run with. The result is checked by taking
+// every inlier IR corner back through WarpMapCache's maps, which have to land within CALIBRATION_ROUND_TRIP_TOLERANCE
+// of the visible corner, otherwise it returns false.
+bool calibrateHomography(std::vector<CalibrationPair> &pairs, int threads, int offsetX, int offsetY, cv::Mat &homography);
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <cstdint>
+#include <vector>
+
+#define DIRTY_TILE_SIZE 32     // Same as FRAME_CODEC_TILE, a 640x480 frame is 20x15 tiles
+#define DIRTY_TILE_TOLERANCE 2 // Mean absolute difference per sample (8 bit levels) a tile needs to count as changed
+
+// Which DIRTY_TILE_SIZE x DIRTY_TILE_SIZE tiles of a frame need to be processed again, for --incremental
+//
+// The grid always starts at the frame's top left corner, so the masks of the IR side (colorize) and the visible side
+// (warp) line up and can be merged for the blend. Functions that take a view of the frame also take the view's origin
+// in frame coordinates and only look at the tiles (or parts of tiles) it covers.
+class DirtyTiles
+{
+public:
+    // Sizes the grid for frameSize (only reallocates when the tile count grows) and marks every tile dirty
+    void reset(cv::Size frameSize);
+
+    void clear();
+    void markAll();
+    void mark(int tx, int ty) { tiles[ty * tilesX + tx] = 1; }
+    bool dirty(int tx, int ty) const { return tiles[ty * tilesX + tx] != 0; }
+
+    // Marks every tile that's dirty in other, both grids must be the same size
+    void merge(const DirtyTiles &other);
+
+    int count() const;
+    int total() const { return tilesX * tilesY; }
+    int columns() const { return tilesX; }
+    int rows() const { return tilesY; }
+    cv::Size frameSize() const { return size; }
+
+    // In frame coordinates, clipped to the frame
+    cv::Rect tileRect(int tx, int ty) const;
+
+    // Calls f(rect) once per horizontal run of dirty tiles, clipped to area (frame coordinates, empty = the whole frame)
+    // Consecutive dirty tiles go out as one rectangle, so the per call overhead of remap() & co is paid once per run
+    template <typename F>
+    void forEachRun(F f, const cv::Rect &area = cv::Rect()) const
+    {
+        const cv::Rect frame(0, 0, size.width, size.height);
+        const cv::Rect clip = area.empty() ? frame : area & frame;
+        for (int ty = 0; ty < tilesY; ty++)
+        {
+            for (int tx = 0; tx < tilesX; tx++)
+            {
+                if (!dirty(tx, ty))
+                    continue;
+                int end = tx + 1;
+                while (end < tilesX && dirty(end, ty))
+                    end++;
+
+                cv::Rect run = (tileRect(tx, ty) | tileRect(end - 1, ty)) & clip;
+                if (!run.empty())
+                    f(run);
+                tx = end;
+            }
+        }
+    }
+
+private:
+    cv::Size size;
+    int tilesX = 0;
+    int tilesY = 0;
+    std::vector<uint8_t> tiles;
+};
+
+// Marks the tiles where frame and reference differ by more than tolerance on average (in sample values, so 16 bit frames
+// need it scaled up), then copies those tiles of frame into reference. Tiles that stay under the tolerance keep their
+// old reference, so sensor noise never accumulates into a change and a slow drift still shows up once it adds up.
+// frame and reference are views of the frame starting at origin, same size and type. Returns the number of tiles marked
+int updateReferenceTiles(const cv::Mat &frame, cv::Mat &reference, cv::Point origin, int tolerance, DirtyTiles &tiles);
+
+// Exact version for processed frames : marks the tiles where current differs from previous at all, and copies them
+int updateChangedTiles(const cv::Mat &current, cv::Mat &previous, cv::Point origin, DirtyTiles &tiles);
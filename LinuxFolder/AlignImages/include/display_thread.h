@@ -0,0 +1,85 @@
+#pragma once
+
+#include "triple_buffer.h"
+
+#include <opencv2/core.hpp>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <thread>
+
+#define DISPLAY_WINDOW_NAME "visibleToIRProjectedFrame"
+#define DISPLAY_KEY_WAIT_MS 5 // waitKey() on the display thread, only paces the window, never the processing
+
+// w/a/s/d nudge the IR offsets, x saves them to offset.txt. Returns true if the offsets changed
+bool handleOffsetKey(int key, int &offsetX, int &offsetY);
+
+// The window and the keyboard on their own thread, so imshow() and waitKey() are off the processing loop
+//
+// The loop hands each blended frame over with show(), which copies it into the free side of a TripleBuffer and
+// returns. The display thread only ever shows the newest frame it finds there, frames that come faster than the
+// window can take are simply overwritten, and the loop never waits on the GUI backend.
+//
+// Keys are handled on the display thread : w/a/s/d go to the offsets, which are atomics the loop reads with
+// pollOffsets(), x saves them to offset.txt, t and ESC set flags the loop polls. setOffsets() is how the loop
+// publishes offsets it got from elsewhere (--auto-align), a key pressed at the same moment can get lost to it.
+//
+// All of HighGUI is used from this one thread. That's fine for the GTK backend the Pi builds use, the Qt backend
+// wants its windows on the main thread.
+class DisplayThread
+{
+public:
+    DisplayThread() = default;
+    ~DisplayThread();
+
+    DisplayThread(const DisplayThread &) = delete;
+    DisplayThread &operator=(const DisplayThread &) = delete;
+
+    // Opens the window and starts the thread, false in a make HEADLESS=1 build (there's no HighGUI to show it with)
+    bool start(const std::string &windowName, int offsetX, int offsetY);
+
+    // Joins the thread and closes the window
+    void stop();
+    bool isRunning() const { return running.load(std::memory_order_relaxed); }
+
+    // Never blocks : copies frame into the mailbox, the display thread picks the newest one up
+    void show(const cv::Mat &frame);
+
+    // Returns true and the new offsets if a key moved them since the last call
+    bool pollOffsets(int &offsetX, int &offsetY);
+    void setOffsets(int offsetX, int offsetY);
+
+    // ESC was pressed
+    bool quitRequested() const { return quit.load(std::memory_order_relaxed); }
+
+    // t was pressed since the last call
+    bool traceRequested() { return traceRequest.exchange(false, std::memory_order_relaxed); }
+
+    // Frames handed over / actually shown (the rest were overwritten before the window got to them)
+    void printStats(std::ostream &out) const;
+
+private:
+    void displayLoop();
+
+    std::string windowName;
+    std::thread displayThread;
+    std::atomic<bool> running{false};
+
+    // Loop -> display thread, the newest blended frame
+    TripleBuffer<cv::Mat> frames;
+
+    // Display thread -> loop
+    std::atomic<int> offsetX{0};
+    std::atomic<int> offsetY{0};
+    std::atomic<uint32_t> offsetVersion{0}; // Bumped after every key that moved the offsets
+    std::atomic<bool> quit{false};
+    std::atomic<bool> traceRequest{false};
+
+    // Loop only
+    uint32_t seenOffsetVersion = 0;
+    uint64_t handedOver = 0;
+
+    // Written by the display thread
+    std::atomic<uint64_t> shown{0};
+};
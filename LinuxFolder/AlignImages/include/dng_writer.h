@@ -0,0 +1,27 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+// What goes into the tags of an exported raw frame
+struct RawImageInfo
+{
+    int bitDepth = 10;          // Valid bits per sample, becomes the DNG white level
+    int blackLevel = 0;
+    std::string cameraModel;    // DNG UniqueCameraModel
+    std::string description;    // ImageDescription, frame index / PTS
+};
+
+// Uncompressed, single strip, little endian 16 bit files, written straight from the sample rows
+//
+// There's no compression and no conversion, so encoding is one copy of the frame and the exporter is limited by
+// the disks rather than the encoder. Samples are stored as they were recorded (10 bit values in 16 bit words).
+// out is resized to the file size, reusing its capacity.
+
+// Grayscale TIFF of the mosaic, readable by OpenCV (IMREAD_UNCHANGED), tifffile, ImageJ ...
+void encodeRawTiff(const cv::Mat &raw, const RawImageInfo &info, std::vector<unsigned char> &out);
+
+// DNG 1.4 with a GBRG CFA pattern, so raw converters (darktable, RawTherapee, rawpy) demosaic it themselves
+// The color matrix is identity, these cameras have no calibration, so colors are only roughly right
+void encodeRawDng(const cv::Mat &raw, const RawImageInfo &info, std::vector<unsigned char> &out);
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Lossless frame codecs for handing processed frames around without paying for PNG
+//
+//  - raw   : no encoding, the pixels as they are
+//  - qoi   : a standard QOI image ("qoif" header, readable by any QOI tool), a single pass of run / index /
+//            small difference codes, typically 10-20x faster than PNG at a similar size for overlay frames
+//  - delta : the frame is cut into FRAME_CODEC_TILE x FRAME_CODEC_TILE tiles and only the tiles that differ from
+//            the previous frame are QOI coded, with a full keyframe every FRAME_CODEC_KEYFRAME_INTERVAL frames.
+//            For streaming, where most of the visible background doesn't change from one frame to the next.
+//
+// Every encoded buffer starts with its own magic, so FrameDecoder::decode() takes any of them.
+// Frames are CV_8UC3 (BGR) or CV_8UC4 (BGRA), QOI stores RGB(A) so the channels are swapped on the way in and out.
+
+#define FRAME_CODEC_TILE 32
+#define FRAME_CODEC_KEYFRAME_INTERVAL 60 // Also bounds how long a receiver that missed a frame shows garbage tiles
+
+enum FrameCodec : uint16_t
+{
+    FRAME_CODEC_RAW = 0,
+    FRAME_CODEC_QOI = 1,
+    FRAME_CODEC_DELTA = 2,
+};
+
+// "raw", "qoi" or "delta"
+bool parseFrameCodec(const std::string &name, FrameCodec &codec);
+const char *frameCodecName(FrameCodec codec);
+
+// Largest buffer encoding a frame of this size can produce
+size_t frameCodecMaxEncodedSize(int width, int height, int channels);
+
+class FrameEncoder
+{
+public:
+    explicit FrameEncoder(FrameCodec codec = FRAME_CODEC_QOI) : codec(codec) {}
+
+    FrameCodec type() const { return codec; }
+    void setCodec(FrameCodec newCodec);
+
+    // Encodes frame into the start of out and returns the encoded size. out only grows (to
+    // frameCodecMaxEncodedSize()), so encoding frames of the same size doesn't allocate after the first one.
+    // Raw frames are just copied, use the frame directly instead where that matters
+    size_t encode(const cv::Mat &frame, std::vector<uchar> &out);
+
+    // Delta mode : makes the next frame a keyframe, e.g. when a new receiver connected
+    void reset() { framesSinceKeyframe = -1; }
+
+    // Delta mode : tiles that were sent in the last frame, out of how many
+    int lastChangedTiles() const { return changedTiles; }
+    int lastTotalTiles() const { return totalTiles; }
+
+private:
+    size_t encodeDelta(const cv::Mat &frame, uchar *out);
+
+    FrameCodec codec;
+
+    // Delta mode state, the last frame as the receiver has it
+    cv::Mat previous;
+    int framesSinceKeyframe = -1;
+    int changedTiles = 0;
+    int totalTiles = 0;
+};
+
+class FrameDecoder
+{
+public:
+    // Decodes a buffer produced by FrameEncoder (or any QOI image) into frame, which is only reallocated if the
+    // size / channels change. Delta frames are applied on top of frame, which must hold the previous decoded frame,
+    // a delta frame that doesn't match what's in frame is rejected until the next keyframe.
+    // Returns false for a corrupt or unusable buffer.
+    bool decode(const uchar *data, size_t size, cv::Mat &frame);
+
+private:
+    bool haveKeyframe = false;
+};
+
+// QOI files, for archiving (batch output) and the .qoi files DisplayProcessedImage picks up
+bool writeQoiFile(const std::string &path, const cv::Mat &frame);
+cv::Mat readQoiFile(const std::string &path);
@@ -0,0 +1,190 @@
+#pragma once
+
+#include "frame_codec.h"
+#include "triple_buffer.h"
+
+#include <opencv2/core.hpp>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+// Streams processed frames from alignImages to RPIFolder/DisplayProcessedImage over a socket,
+// replacing PNG encode -> scp -> poll -> PNG decode
+//
+// Every frame is a fixed size FrameHeader followed by the pixel rows, tightly packed, or by the frame encoded with
+// one of the frame_codec.h codecs (QOI, or QOI coded tiles that changed since the last frame). The display side listens,
+// alignImages connects. Endpoints are "tcp:host:port", "host:port" or "unix:/path/to.sock", so the same
+// pair of programs can be tested over loopback (tcp:127.0.0.1:5600 or a UNIX socket) before going over the network.
+// Both ends are little endian (x86 laptop, ARM Pi), the header is sent as is.
+
+#define FRAME_STREAM_MAGIC 0x4D524650u // "PFRM"
+#define FRAME_STREAM_VERSION 2
+#define FRAME_STREAM_DEFAULT_PORT 5600
+#define FRAME_STREAM_IO_TIMEOUT_MS 1000 // A peer that stops reading / writing mid frame (or doesn't answer a connect) for this long is dropped
+#define FRAME_STREAM_RECONNECT_MS 2000  // How often FrameStreamThread retries a lost connection
+
+enum FrameFormat : uint16_t
+{
+    FRAME_FORMAT_BGRA = 1,
+    FRAME_FORMAT_BGR = 2,
+    FRAME_FORMAT_GRAY = 3,
+};
+
+#pragma pack(push, 1)
+struct FrameHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t format;       // FrameFormat
+    uint32_t width;
+    uint32_t height;
+    uint64_t sequence;     // Increments by one per frame sent, gaps mean the sender dropped frames
+    uint64_t timestampNs;  // CLOCK_REALTIME when the frame was sent, for end to end latency with NTP synced clocks
+    uint32_t payloadBytes;
+    uint32_t codec;        // FrameCodec the payload is encoded with
+};
+#pragma pack(pop)
+
+static_assert(sizeof(FrameHeader) == 40, "FrameHeader is part of the wire format");
+
+// CLOCK_REALTIME in ns, what timestampNs is stamped with
+uint64_t frameStreamNowNs();
+
+// Connecting end, used by alignImages through FrameStreamThread
+class FrameSender
+{
+public:
+    FrameSender() = default;
+    ~FrameSender();
+
+    FrameSender(const FrameSender &) = delete;
+    FrameSender &operator=(const FrameSender &) = delete;
+
+    // Gives up after FRAME_STREAM_IO_TIMEOUT_MS per address instead of the kernel's SYN timeout (minutes), the host
+    // is only resolved again when the endpoint changes or the last lookup failed
+    bool connect(const std::string &endpoint);
+    void close();
+    bool isConnected() const { return fd >= 0; }
+
+    // FRAME_CODEC_RAW by default, grayscale frames are always sent raw
+    void setCodec(FrameCodec codec) { encoder.setCodec(codec); }
+
+    // Sends a CV_8UC4 / CV_8UC3 / CV_8UC1 frame, header and payload go out in one sendmsg()
+    // Closes the connection and returns false if the peer went away
+    bool send(const cv::Mat &frame) { return send(frame, sequence); }
+
+    // Same, with the sequence number the frame goes out with (the next one continues from there)
+    bool send(const cv::Mat &frame, uint64_t frameSequence);
+
+    uint64_t framesSent() const { return sent; }
+    uint64_t lastPayloadBytes() const { return payloadBytes; }
+
+private:
+    struct ResolvedAddress
+    {
+        sockaddr_storage address;
+        socklen_t length;
+        int family;
+    };
+
+    bool resolve(const std::string &endpoint);
+
+    int fd = -1;
+    uint64_t sent = 0;
+    uint64_t sequence = 0;
+    uint64_t payloadBytes = 0;
+
+    FrameEncoder encoder{FRAME_CODEC_RAW};
+    std::vector<uchar> encoded;
+
+    // What the last connect() resolved, reused for the retries
+    std::string resolvedEndpoint;
+    std::vector<ResolvedAddress> addresses;
+};
+
+// --stream : connecting, encoding and sending on their own thread, so a slow or unreachable display never holds up
+// the frame loop
+//
+// send() copies the frame into the free side of a TripleBuffer and returns, the stream thread sends the newest frame
+// it finds there. Frames handed over faster than the connection takes them are overwritten, their sequence numbers
+// still count so the receiver sees the gap. While there's no connection the thread retries every
+// FRAME_STREAM_RECONNECT_MS, and once it's back it starts with the newest frame it was handed.
+class FrameStreamThread
+{
+public:
+    FrameStreamThread() = default;
+    ~FrameStreamThread();
+
+    FrameStreamThread(const FrameStreamThread &) = delete;
+    FrameStreamThread &operator=(const FrameStreamThread &) = delete;
+
+    // Starts the thread, which makes the first connection attempt straight away
+    void start(const std::string &endpoint, FrameCodec codec);
+    void stop();
+    bool isRunning() const { return streamThread.joinable(); }
+
+    bool isConnected() const { return connected.load(std::memory_order_relaxed); }
+
+    // Never blocks, a no-op if the thread isn't running
+    void send(const cv::Mat &frame);
+
+private:
+    struct StreamFrame
+    {
+        cv::Mat image;
+        uint64_t sequence = 0;
+    };
+
+    void streamLoop();
+
+    std::string endpoint;
+    std::thread streamThread;
+    std::atomic<bool> running{false};
+    std::atomic<bool> connected{false};
+
+    // Frame loop -> stream thread
+    TripleBuffer<StreamFrame> frames;
+    uint64_t handedOver = 0; // Frame loop only
+
+    // Stream thread only
+    FrameSender sender;
+};
+
+// Listening end, used by DisplayProcessedImage
+class FrameReceiver
+{
+public:
+    FrameReceiver() = default;
+    ~FrameReceiver();
+
+    FrameReceiver(const FrameReceiver &) = delete;
+    FrameReceiver &operator=(const FrameReceiver &) = delete;
+
+    bool listen(const std::string &endpoint);
+    void close();
+    bool isConnected() const { return clientFd >= 0; }
+
+    // Waits up to timeoutMs for the next frame (accepting a sender first if none is connected)
+    // frame is only reallocated when the size or format changes, the pixels are received straight into it
+    // Returns false on timeout or when the sender disconnected
+    bool receive(cv::Mat &frame, FrameHeader &header, int timeoutMs);
+
+    // Frames missing between consecutive sequence numbers since the sender connected
+    uint64_t framesDropped() const { return dropped; }
+
+private:
+    bool acceptClient(int timeoutMs);
+    void dropClient();
+
+    int listenFd = -1;
+    int clientFd = -1;
+    FrameDecoder decoder;
+    std::vector<uchar> encoded;
+    std::string unixPath;
+    bool haveSequence = false;
+    uint64_t lastSequence = 0;
+    uint64_t dropped = 0;
+};
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#define SYNC_TOLERANCE_MS 16.0 // Half a frame at 30 fps
+#define SYNC_QUEUE_CAPACITY 8
+
+// Reads a Picamera2 "timecode format v2" file (visibleTimeStamps_N.txt / irTimeStamps_N.txt)
+// One presentation timestamp in milliseconds per frame, lines starting with '#' are skipped
+// Returns an empty list without complaining if the file doesn't exist, that's for the caller to report
+std::vector<double> loadTimestamps(const std::string &path);
+
+// What to do with a frame that has no partner from the other camera within the tolerance
+enum class SyncPolicy
+{
+    Drop,      // Throw it away
+    Duplicate, // Pair it with the other camera's previous frame again
+};
+
+struct SyncStats
+{
+    long pairs = 0;
+    long duplicated = 0;
+    long irDropped = 0;
+    long visibleDropped = 0;
+    long overflowDropped = 0; // Frames pushed out because a queue was full
+    double maxSkewMs = 0;
+    double totalSkewMs = 0;
+
+    double meanSkewMs() const { return pairs ? totalSkewMs / pairs : 0.0; }
+};
+
+// One synchronized pair of recorded frames, indices are frame numbers in the .raw / timestamp files
+struct FramePair
+{
+    int irIndex;
+    int visibleIndex;
+    double skewMs;
+};
+
+// Replays both timestamp lists in arrival order through a FrameSynchronizer and returns the matched frames
+std::vector<FramePair> pairRecordedFrames(const std::vector<double> &irTimestamps, const std::vector<double> &visibleTimestamps,
+                                          double toleranceMs, SyncPolicy policy, SyncStats &stats);
+
+void printSyncStats(const SyncStats &stats);
+
+// Fixed capacity FIFO, the oldest entry is overwritten when it's full
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : items(capacity) {}
+
+    // Returns false if the oldest entry had to be dropped to make room
+    bool push(const T &item)
+    {
+        bool fits = count < items.size();
+        if (!fits)
+            pop();
+        items[(head + count) % items.size()] = item;
+        count++;
+        return fits;
+    }
+
+    void pop()
+    {
+        head = (head + 1) % items.size();
+        count--;
+    }
+
+    T &at(size_t i) { return items[(head + i) % items.size()]; }
+    T &front() { return at(0); }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+private:
+    std::vector<T> items;
+    size_t head = 0;
+    size_t count = 0;
+};
+
+// Pairs IR and visible frames by nearest presentation timestamp
+//
+// Both streams arrive in PTS order, so only the front of each queue ever needs to be compared, plus one frame
+// of lookahead to make sure the next frame isn't an even closer match. Every comparison retires at least one
+// frame, so pairing is O(1) amortized per frame.
+// T is whatever identifies a frame for the caller (frame index, buffer slot, ...)
+template <typename T>
+class FrameSynchronizer
+{
+public:
+    struct Frame
+    {
+        double pts = 0;
+        T payload{};
+    };
+
+    struct Pair
+    {
+        Frame ir;
+        Frame visible;
+        double skewMs = 0; // ir.pts - visible.pts
+        bool duplicated = false;
+    };
+
+    FrameSynchronizer(double toleranceMs = SYNC_TOLERANCE_MS, SyncPolicy policy = SyncPolicy::Drop, size_t capacity = SYNC_QUEUE_CAPACITY)
+        : toleranceMs(toleranceMs), policy(policy), irQueue(capacity), visibleQueue(capacity) {}
+
+    void pushIR(double pts, const T &payload)
+    {
+        if (!irQueue.push({pts, payload}))
+            syncStats.overflowDropped++;
+    }
+
+    void pushVisible(double pts, const T &payload)
+    {
+        if (!visibleQueue.push({pts, payload}))
+            syncStats.overflowDropped++;
+    }
+
+    // Call once both streams have ended so the last frames are paired without waiting for lookahead
+    void flush() { flushing = true; }
+
+    // Returns true and fills pair when the next pair is ready
+    bool pop(Pair &pair)
+    {
+        while (!irQueue.empty() && !visibleQueue.empty())
+        {
+            Frame &ir = irQueue.front();
+            Frame &visible = visibleQueue.front();
+            double skew = ir.pts - visible.pts;
+
+            // Every later visible frame is even newer, so nothing can match this IR frame any more
+            if (skew < -toleranceMs)
+            {
+                if (unmatched(irQueue, lastVisible, true, pair))
+                    return true;
+                continue;
+            }
+            if (skew > toleranceMs)
+            {
+                if (unmatched(visibleQueue, lastIR, false, pair))
+                    return true;
+                continue;
+            }
+
+            // Inside the tolerance, but the next frame of the older stream might still be closer
+            if (skew < 0)
+            {
+                if (irQueue.size() < 2 && !flushing)
+                    return false;
+                if (irQueue.size() >= 2 && std::fabs(irQueue.at(1).pts - visible.pts) < -skew)
+                {
+                    if (unmatched(irQueue, lastVisible, true, pair))
+                        return true;
+                    continue;
+                }
+            }
+            else if (skew > 0)
+            {
+                if (visibleQueue.size() < 2 && !flushing)
+                    return false;
+                if (visibleQueue.size() >= 2 && std::fabs(ir.pts - visibleQueue.at(1).pts) < skew)
+                {
+                    if (unmatched(visibleQueue, lastIR, false, pair))
+                        return true;
+                    continue;
+                }
+            }
+
+            pair.ir = ir;
+            pair.visible = visible;
+            pair.duplicated = false;
+            emit(pair);
+            irQueue.pop();
+            visibleQueue.pop();
+            return true;
+        }
+        return false;
+    }
+
+    const SyncStats &stats() const { return syncStats; }
+
+private:
+    // Retires the front frame of queue, either dropping it or pairing it with the other camera's last frame
+    bool unmatched(BoundedQueue<Frame> &queue, const Frame &lastOther, bool isIR, Pair &pair)
+    {
+        Frame frame = queue.front();
+        queue.pop();
+
+        if (policy == SyncPolicy::Duplicate && havePrevious)
+        {
+            pair.ir = isIR ? frame : lastOther;
+            pair.visible = isIR ? lastOther : frame;
+            pair.duplicated = true;
+            emit(pair);
+            return true;
+        }
+
+        if (isIR)
+            syncStats.irDropped++;
+        else
+            syncStats.visibleDropped++;
+        return false;
+    }
+
+    void emit(Pair &pair)
+    {
+        pair.skewMs = pair.ir.pts - pair.visible.pts;
+        lastIR = pair.ir;
+        lastVisible = pair.visible;
+        havePrevious = true;
+
+        syncStats.pairs++;
+        if (pair.duplicated)
+            syncStats.duplicated++;
+        syncStats.totalSkewMs += std::fabs(pair.skewMs);
+        if (std::fabs(pair.skewMs) > syncStats.maxSkewMs)
+            syncStats.maxSkewMs = std::fabs(pair.skewMs);
+    }
+
+    double toleranceMs;
+    SyncPolicy policy;
+    BoundedQueue<Frame> irQueue;
+    BoundedQueue<Frame> visibleQueue;
+    Frame lastIR;
+    Frame lastVisible;
+    bool havePrevious = false;
+    bool flushing = false;
+    SyncStats syncStats;
+};
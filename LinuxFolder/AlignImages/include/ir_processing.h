@@ -0,0 +1,160 @@
+#pragma once
+
+#include "dirty_tiles.h"
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <vector>
+
+#define CLAHE_CLIP_LIMIT 2.7
+#define TOPK_FRACTION 0.1 // Fraction of the above threshold pixels that saturate the colormap
+#define IR_HISTOGRAM_MAX_BITS 12 // Histogram / palette resolution for 10, 12 and 16 bit frames
+#define IR_PALETTE_TOLERANCE 0.02 // --incremental : how far the CLAHE histogram moves (KS distance) before a new palette
+
+// What colorize() does at full resolution when the analysis runs on a reduced copy (setAnalysisScale())
+enum class IRAnalysisOutput
+{
+    FullResolution, // Equalization upsampled + full resolution detail, threshold and palette per full resolution pixel
+    Reduced,        // Palette at the analysis level too, the colored frame is upsampled (cheapest, softer edges)
+};
+
+// Everything the IR threshold / colorize steps need from one frame to the next
+//
+// The CLAHE instance, histogram, LUTs and all intermediate and output frames are owned here and reused,
+// so after the first frame (or allocate()) processing a frame of the same size does no heap allocations.
+// One context per thread, the returned Mats are only valid until the next call.
+class IRProcessingContext
+{
+public:
+    IRProcessingContext();
+
+    // Optional, sizes the colorize() buffers up front so even the first frame doesn't allocate
+    // depth is the depth of the IR frames that will be passed in (CV_8U or CV_16U)
+    void allocate(cv::Size frameSize, int depth = CV_8U);
+
+    // CLAHE + Yen threshold, everything below the threshold is set to 0 (or the frame is binarized if compressed)
+    const cv::Mat &yenThreshold(const cv::Mat &src, bool compressed, double &foundThresh);
+
+    // Stretches everything above the Yen threshold over 0-255, the top k fraction of the bright pixels saturates
+    const cv::Mat &remapLutThreshold(const cv::Mat &src, float k, int threshold, int &topkvalue);
+
+    // CLAHE + Yen threshold, then a single lookup into the per frame palette built by buildPalette()
+    // Returns a premultiplied BGRA frame : color * alpha / 255, alpha = thresholded intensity, 0 for cold pixels
+    //
+    // CV_16UC1 frames are processed at their native depth, bitDepth is the number of valid bits in each sample
+    // (10 for the raw SGBRG10 recordings, 0 = all 16). Nothing is quantized to 8 bit before the threshold,
+    // the quantization is folded into the palette
+    //
+    // With an overlap (WarpMapCache::overlap()) only that part of the frame is equalized, thresholded and colorized,
+    // so the Yen threshold only sees pixels that end up blended. The rest stays transparent. Empty = the whole frame
+    const cv::Mat &colorize(const cv::Mat &irImage, int bitDepth = 0, const cv::Rect &overlap = cv::Rect());
+
+    // Runs colorize()'s CLAHE, histogram and Yen threshold on a 1/downscale copy of the frame (1, 2 or 4)
+    // The threshold is a statistic of the whole frame and barely moves, while CLAHE is most of colorize()'s time
+    // on 1080p frames. alignBench reports the speed and the difference from full resolution per level.
+    void setAnalysisScale(int downscale, IRAnalysisOutput output = IRAnalysisOutput::FullResolution);
+
+    // --incremental : colorize() compares the frame with the one it last processed tile by tile (dirty_tiles.h) and
+    // returns the previous colors straight away if no tile moved by more than tolerance. Otherwise it works on that
+    // reference frame with the changed tiles copied in, so the tiles under the tolerance keep exactly their colors :
+    //  - CLAHE and the histogram still cover the whole overlap, a CLAHE tile spreads a change to its neighbours
+    //  - the Yen threshold and palette are only rebuilt once the histogram moved by more than histogramTolerance
+    //    (largest difference between the two cumulative distributions), so noise doesn't recolor the whole frame
+    //  - the palette lookup only runs over the tiles whose equalized values changed
+    // changedTiles() tells the caller which parts of the colored frame have to be blended again.
+    void setIncremental(bool enabled, int tolerance = DIRTY_TILE_TOLERANCE, double histogramTolerance = IR_PALETTE_TOLERANCE);
+
+    // Tiles of the colored frame the last colorize() changed, in frame coordinates. All of them without --incremental
+    const DirtyTiles &changedTiles() const { return outputTiles; }
+
+    // Times the Yen threshold and palette were computed
+    int paletteBuilds() const { return paletteBuildCount; }
+
+    // In histogram bins, 0-255 for 8 bit frames, up to 2^IR_HISTOGRAM_MAX_BITS - 1 for wider ones
+    int lastThreshold() const { return paletteThreshold; }
+    int lastTopk() const { return paletteTopk; }
+
+private:
+    // 256 bin histogram of an 8 bit frame into hist (CV_32F, same layout cv::calcHist() produces)
+    void histogram(const cv::Mat &src);
+
+    // Histogram of a 16 bit frame with 2^(16 - shift) bins into wideHist
+    void wideHistogram(const cv::Mat &src, int shift);
+
+    // Everything after CLAHE only depends on the intensity, so THRESH_TOZERO, the top k LUT remap,
+    // the JET colormap, the alpha channel and the old "drop blue pixels" rule all collapse into one BGRA entry per bin
+    // threshold is in bins, alpha is the thresholded bin scaled to 0-255
+    void buildPalette(const float *h, int bins, int threshold, cv::Vec4b *out);
+
+    // Yen threshold + buildPalette(), or with --incremental nothing while h stays close to the palette's histogram
+    void updatePalette(const float *h, int bins, cv::Vec4b *out);
+
+    // Largest difference between the cumulative distributions of h and paletteHist, 0 (same) to 1
+    double histogramShift(const float *h, int bins) const;
+
+    // CLAHE into cl / cl16, then the Yen threshold and palette from its histogram
+    void analyze8(const cv::Mat &greyFrame);
+    void analyze16(const cv::Mat &irImage, int bitDepth);
+
+    // Palette gather from an equalized CV_8UC1 / CV_16UC1 frame into a BGRA frame of the same size
+    void lookup(const cv::Mat &intensity, cv::Mat &out) const;
+
+    // lookup() into coloredOverlap, with --incremental only over the tiles where intensity changed since the last call
+    // area is where intensity and coloredOverlap are in the frame
+    void lookupChanged(const cv::Mat &intensity, const cv::Rect &area);
+
+    cv::Ptr<cv::CLAHE> clahe;
+    cv::Mat grey;
+    cv::Mat cl;
+    cv::Mat hist;
+    cv::Mat thresholded;
+
+    // 16 bit path, the CLAHE clip limit depends on the bit depth so it gets its own instance
+    cv::Ptr<cv::CLAHE> clahe16;
+    int clahe16Depth = 0;
+    cv::Mat cl16;
+    std::vector<int> wideCounts;
+    std::vector<float> wideHist;
+    std::vector<cv::Vec4b> widePalette;
+    int wideShift = 0;
+
+    std::vector<float> thresholdedHist;
+    std::vector<float> histCumulative;
+    cv::Mat lut;
+    cv::Mat processed;
+
+    cv::Vec3b jetPalette[256];
+    cv::Vec4b palette[256];
+    int paletteThreshold = 0;
+    int paletteTopk = 0;
+    cv::Mat colored;
+    cv::Mat coloredOverlap; // View of colored the palette lookup writes into
+
+    // Reduced resolution analysis
+    int analysisScale = 1;
+    IRAnalysisOutput analysisOutput = IRAnalysisOutput::FullResolution;
+    cv::Mat reduced;
+    cv::Mat equalizedUp;
+    cv::Mat reducedUp;
+    cv::Mat restored;
+    cv::Mat coloredReduced;
+
+    // --incremental
+    bool incremental = false;
+    int tileTolerance = DIRTY_TILE_TOLERANCE;
+    double histogramTolerance = IR_PALETTE_TOLERANCE;
+    bool incrementalValid = false; // reference / previousIntensity match the current settings
+    cv::Rect incrementalArea;
+    int incrementalBitDepth = 0;
+    bool fullUpdate = false;       // This call recolors everything (first frame, new area, new palette)
+    cv::Mat reference;             // The IR frame as it was last processed, CV_8U / CV_16U like the input
+    cv::Mat previousIntensity;     // The equalized frame the current colors were looked up from
+    DirtyTiles inputTiles;
+    DirtyTiles outputTiles;
+    std::vector<float> paletteHist; // The histogram the current palette was built from
+    int paletteBins = 0;
+    int paletteBuildCount = 0;
+};
+
+// Min/max stretch of 16 bit TIFF / raw data down to 8 bit, 8 bit frames are just copied
+void normalizeTo8Bit(const cv::Mat &src, cv::Mat &dst);
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "ir_processing.h"
+#include "offset_estimator.h"
+#include "spsc_queue.h"
+#include "triple_buffer.h"
+#include "warp_cache.h"
+
+#include <opencv2/core.hpp>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <thread>
+
+#define PIPELINE_QUEUE_CAPACITY 2 // Frames waiting between two stages, more only adds latency
+
+struct PipelineOptions
+{
+    int queueCapacity = PIPELINE_QUEUE_CAPACITY;
+
+    // colorize -> blend, warp -> blend and blend -> display
+    // Dropping the oldest keeps every stage working on the newest frames and the display's latency bounded,
+    // block keeps every frame but lets the slowest stage (usually --stream) hold everything up
+    OverflowPolicy coloredPolicy = OverflowPolicy::DropOldest;
+    OverflowPolicy warpedPolicy = OverflowPolicy::DropOldest;
+    OverflowPolicy displayPolicy = OverflowPolicy::DropOldest;
+
+    int irAnalysisScale = 1;
+    IRAnalysisOutput irAnalysisOutput = IRAnalysisOutput::FullResolution;
+};
+
+// "<colored | warped | display | all>=<policy>" as given to --queue-policy, returns false if it doesn't parse
+bool parseQueuePolicy(const std::string &spec, PipelineOptions &options);
+
+// Blended frame on its way to the display
+struct PipelineFrame
+{
+    cv::Mat blended;       // CV_8UC4
+    uint64_t startNs = 0;  // traceNowNs() when the newer of its two camera frames entered the pipeline
+    uint64_t index = 0;
+};
+
+// --pipeline : the live loop's stages on their own threads instead of one after the other on the main thread
+//
+//   IR capture      -> [triple buffer] -> colorize ----> [colored queue] -+
+//                                                                         +-> blend -> [display queue] -> main thread
+//   visible capture -> [triple buffer] -> gray + warp -> [warped queue] --+            (display thread, --stream, --shm)
+//
+// Each queue is an SpscQueue of preallocated frames with its own OverflowPolicy, so a frame moves between stages
+// without being allocated or locked. Throughput is set by the slowest stage instead of the sum of all of them.
+//
+// The main thread keeps the keys (polled from the DisplayThread), homography.yml reloads and the offset estimator.
+// Offsets go to the warp stage through atomics and the homography through a TripleBuffer, the warp stage tells the
+// colorize stage about a new overlap the same way. A colored and a warped frame are blended with the warped frame's overlap, so for the frame
+// or two after the overlap moves the IR overlay can be missing along the edge that moved.
+class LivePipeline
+{
+public:
+    LivePipeline(const PipelineOptions &options, cv::Size frameSize);
+    ~LivePipeline();
+
+    LivePipeline(const LivePipeline &) = delete;
+    LivePipeline &operator=(const LivePipeline &) = delete;
+
+    // The pipeline's stages become the consumers of the capture threads' triple buffers (BGR, IR already flipped)
+    // The stages stop on their own once capturing goes false. estimator may be null, or a started OffsetEstimator
+    // that the blend stage then submits frames to
+    void start(TripleBuffer<cv::Mat> &irFrames, TripleBuffer<cv::Mat> &visibleFrames, const std::atomic<bool> &capturing,
+               const cv::Mat &homography, int offsetX, int offsetY, OffsetEstimator *estimator);
+    void stop();
+
+    // Main thread : picked up by the warp stage on its next frame
+    void setOffsets(int x, int y);
+    void setHomography(const cv::Mat &homography);
+
+    // Main thread : moves frame() on to the next blended frame, false if there isn't one yet
+    bool update();
+    const PipelineFrame &frame() const { return displayQueue.readBuffer(); }
+
+    // Frames per stage, drops per queue and the capture to display latency
+    void printStats(std::ostream &out) const;
+
+private:
+    struct ColorizedFrame
+    {
+        cv::Mat colored; // CV_8UC4 premultiplied, see IRProcessingContext::colorize()
+        uint64_t startNs = 0;
+    };
+
+    struct WarpedFrame
+    {
+        cv::Mat warped; // CV_8UC1, in IR coordinates
+        cv::Rect overlap;
+        cv::Matx33d homography; // What the frame was warped with, for the offset estimator
+        int offsetX = 0;
+        int offsetY = 0;
+        uint64_t startNs = 0;
+    };
+
+    void colorizeStage();
+    void warpStage();
+    void blendStage();
+
+    const PipelineOptions options;
+    const cv::Size frameSize;
+    SpscQueue<ColorizedFrame> coloredQueue;
+    SpscQueue<WarpedFrame> warpedQueue;
+    SpscQueue<PipelineFrame> displayQueue;
+
+    TripleBuffer<cv::Mat> *irFrames = nullptr;
+    TripleBuffer<cv::Mat> *visibleFrames = nullptr;
+    const std::atomic<bool> *capturing = nullptr;
+    OffsetEstimator *estimator = nullptr;
+
+    std::atomic<bool> running{false};
+    std::thread colorizeThread, warpThread, blendThread;
+
+    // Main thread -> warp stage
+    std::atomic<int> offsetX{0};
+    std::atomic<int> offsetY{0};
+    TripleBuffer<cv::Matx33d> homographies;
+
+    // Warp stage -> colorize stage
+    TripleBuffer<cv::Rect> overlaps;
+
+    // Stage counters, written by one stage each
+    std::atomic<uint64_t> colorizedFrames{0};
+    std::atomic<uint64_t> warpedFrames{0};
+    std::atomic<uint64_t> blendedFrames{0};
+
+    // Main thread only
+    uint64_t displayedFrames = 0;
+    uint64_t latencySumNs = 0;
+    uint64_t latencyMaxNs = 0;
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "triple_buffer.h"
+
+#include <opencv2/core.hpp>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+#define AUTO_ALIGN_INTERVAL_MS 500     // How often the estimator asks for a new frame pair
+#define AUTO_ALIGN_PYRAMID_LEVELS 3    // Full, 1/2 and 1/4 resolution
+#define AUTO_ALIGN_MIN_RESPONSE 0.03   // Phase correlation peaks below this are noise (IR vs visible peaks are low)
+#define AUTO_ALIGN_MAX_STEP 48         // Pixels, a bigger jump between two estimates is treated as a bad match
+#define AUTO_ALIGN_STABLE_PIXELS 1.0   // Two estimates in a row must agree this closely before they're published
+#define AUTO_ALIGN_ECC_ITERATIONS 50
+#define AUTO_ALIGN_ECC_EPSILON 1e-4
+#define AUTO_ALIGN_ECC_MIN_CORRELATION 0.2
+#define AUTO_ALIGN_NICE 19             // Lowest priority, frame processing always wins
+
+// Registration result, published as a whole so the offsets and the homography always belong together
+struct AlignmentEstimate
+{
+    int offsetX = 0;
+    int offsetY = 0;
+    bool homographyValid = false;
+    cv::Matx33d homography;  // Refined visible to IR homography, only with estimateHomography
+    double response = 0;     // Phase correlation peak, higher is more confident
+    double correlation = 0;  // ECC correlation coefficient
+    uint64_t count = 0;      // Estimates published so far
+};
+
+// Replaces nudging the IR offsets with w/a/s/d : keeps estimating the translation (and optionally the full homography)
+// between the thresholded IR frame and the warped visible frame on a low priority background thread
+//
+// Both frames are turned into gradient magnitude images first, IR brightness and visible brightness don't correlate
+// but their edges do. The translation comes from phase correlation run coarse to fine down a Gaussian pyramid
+// (the coarse level catches shifts of tens of pixels cheaply, the finer levels only correct what's left), and
+// with estimateHomography ECC refines a full homography starting from that translation at 1/2 resolution.
+//
+// The frame loop offers frames with submit(), which only copies them when the estimator is idle and its interval
+// has elapsed, and picks up new estimates with poll(). Both directions go through a TripleBuffer, so neither side
+// ever waits on the other and frame processing isn't slowed down by the estimation.
+class OffsetEstimator
+{
+public:
+    OffsetEstimator() = default;
+    ~OffsetEstimator();
+
+    OffsetEstimator(const OffsetEstimator &) = delete;
+    OffsetEstimator &operator=(const OffsetEstimator &) = delete;
+
+    void start(bool estimateHomography);
+    void stop();
+    bool running() const { return worker.joinable(); }
+
+    // irColored is the CV_8UC4 colorized IR frame, visibleWarped the visible frame already warped into IR coordinates
+    // with homography and (offsetX, offsetY). Cheap no-op unless the estimator is waiting for a frame pair.
+    void submit(const cv::Mat &irColored, const cv::Mat &visibleWarped, const cv::Mat &homography, int offsetX, int offsetY);
+
+    // Returns true and fills estimate when a newer estimate was published since the last call
+    bool poll(AlignmentEstimate &estimate);
+
+private:
+    struct Job
+    {
+        cv::Mat ir;      // CV_8UC1
+        cv::Mat visible; // CV_8UC1
+        cv::Matx33d homography;
+        int offsetX = 0;
+        int offsetY = 0;
+    };
+
+    void run();
+    bool estimate(const Job &job, AlignmentEstimate &result);
+
+    bool withHomography = false;
+    std::thread worker;
+    std::atomic<bool> stopRequested{false};
+    std::atomic<bool> wantFrame{false};
+
+    TripleBuffer<Job> jobs;
+    TripleBuffer<AlignmentEstimate> estimates;
+
+    // Estimator thread only
+    bool havePrevious = false;
+    cv::Point2d previousTarget;
+    uint64_t published = 0;
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#define THRESHOLD_WEIGHT 0.4   // Increase to see more of the Yen Threshold Image
+#define WARPEDFRAME_WEIGHT 0.6
+
+// Blends the colorized IR frame on top of the grayscale visible frame in a single pass
+//  - irPremultiplied : CV_8UC4, premultiplied BGRA from IRProcessingContext::colorize(), alpha 0 where there's no IR
+//  - visibleGray     : CV_8UC1, visible frame already warped into the IR frame
+//  - dst             : CV_8UC4, opaque blended output (allocated only if size/type changed)
+//
+//  - overlap         : only this part is blended (WarpMapCache::overlap()), the rest of dst is filled with opaque black.
+//                      Empty = the whole frame
+//
+// The IR weight is irWeight scaled by the pixel's alpha, the visible frame gets the rest
+void blendIROverlay(const cv::Mat &irPremultiplied, const cv::Mat &visibleGray, cv::Mat &dst,
+                    double irWeight = THRESHOLD_WEIGHT, double visibleWeight = WARPEDFRAME_WEIGHT,
+                    const cv::Rect &overlap = cv::Rect());
+
+// The same blend over region only (frame coordinates), the rest of dst is left as it is. dst must already be allocated
+// (a previous blendIROverlay()), for --incremental where only the tiles that changed since the last frame are blended
+void blendIROverlayRegion(const cv::Mat &irPremultiplied, const cv::Mat &visibleGray, cv::Mat &dst,
+                          double irWeight, double visibleWeight, const cv::Rect &region);
+
+// Sets everything in frame outside inside to value, a few strip fills rather than a pass over the frame
+// An empty inside fills the whole frame
+void fillOutside(cv::Mat &frame, const cv::Rect &inside, const cv::Scalar &value);
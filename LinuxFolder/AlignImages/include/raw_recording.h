@@ -0,0 +1,67 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Size RecordRawVideo configures both cameras with (SGBRG10, 2 bytes per sample)
+#define RAW_FRAME_WIDTH 1920
+#define RAW_FRAME_HEIGHT 1080
+#define RAW_BIT_DEPTH 10 // SGBRG10, 10 valid bits in every 16 bit sample
+
+// irCamera_N.raw -> irTimeStamps_N.txt, visibleCamera_N.raw -> visibleTimeStamps_N.txt
+std::string timestampPathForRaw(const std::string &rawPath);
+
+// Read only, memory mapped view of a visibleCamera_N.raw / irCamera_N.raw recording
+//
+// The file is never read into memory, frame(i) just returns a CV_16UC1 header pointing into the mapping,
+// so any frame of a multi gigabyte recording is available in O(1) and the kernel pages it in on demand.
+// The Mats are read only (writing to them segfaults) and are only valid while the recording is open.
+class RawRecording
+{
+public:
+    RawRecording() = default;
+    ~RawRecording();
+
+    RawRecording(const RawRecording &) = delete;
+    RawRecording &operator=(const RawRecording &) = delete;
+
+    // stride = bytes per row, 0 means width * 2 (no padding)
+    // timestampPath defaults to the file RecordRawVideo wrote next to the .raw file, missing timestamps are not an error
+    bool open(const std::string &rawPath, const std::string &timestampPath = "",
+              int width = RAW_FRAME_WIDTH, int height = RAW_FRAME_HEIGHT, size_t stride = 0);
+    void close();
+
+    bool isOpened() const { return mapping != nullptr; }
+    int frameCount() const { return numFrames; }
+    cv::Size frameSize() const { return size; }
+    bool hasTimestamps() const { return !timestamps.empty(); }
+    const std::vector<double> &timestampList() const { return timestamps; }
+
+    // Zero copy CV_16UC1 view of a frame (10 bit samples in 16 bit words)
+    cv::Mat frame(int index) const;
+
+    // Presentation time in milliseconds, or a negative value if there's no timestamp for this frame
+    double pts(int index) const;
+
+    // Index of the frame closest to ptsMs (binary search over the timestamps), -1 if there are no timestamps
+    int frameAtPts(double ptsMs) const;
+
+    // Hint the kernel that frames [first, first + count) are about to be read so it reads ahead
+    void prefetch(int first, int count) const;
+
+    // Let the kernel drop frames [first, first + count) from the page cache once they've been processed
+    void release(int first, int count) const;
+
+private:
+    void advise(int first, int count, int advice) const;
+
+    unsigned char *mapping = nullptr;
+    size_t mappingSize = 0;
+    size_t frameBytes = 0;
+    size_t rowStride = 0;
+    int numFrames = 0;
+    cv::Size size;
+    std::vector<double> timestamps;
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Hands blended frames from alignImages to DisplayProcessedImage running on the same machine through
+// POSIX shared memory, so a separate display process costs no copies or syscalls per frame
+//
+// The segment holds a small header and SHARED_RING_SLOTS preallocated frame slots. The writer fills the slots
+// round robin, each slot is guarded by a seqlock (odd sequence = being written), and an atomic counter points
+// at the newest complete frame. The writer never waits for the reader; the reader maps the newest frame in place
+// and checks afterwards that the writer didn't lap it while it was being used.
+
+#define SHARED_RING_DEFAULT_NAME "/profusion_frames"
+#define SHARED_RING_SLOTS 4 // The writer has to lap the reader 4 frames deep before a read is torn
+#define SHARED_RING_MAGIC 0x474E4952u // "RING"
+#define SHARED_RING_VERSION 1
+
+// 32 bit atomics so the same layout works lock free on the 32 bit Pi OS as well
+struct SharedRingSlot
+{
+    std::atomic<uint32_t> seq; // Odd while the writer is inside the slot
+    uint32_t frameNumber;
+    uint64_t timestampNs;      // CLOCK_REALTIME when the frame was published
+    char padding[48];          // One cache line per slot
+};
+
+struct SharedRingHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t width;
+    uint32_t height;
+    uint32_t type;             // OpenCV type of the frames, CV_8UC4 for the blended output
+    uint64_t slotStride;       // Bytes between slots, page aligned
+    uint64_t dataOffset;       // Where slot 0's pixels start
+    std::atomic<uint32_t> stale;  // Set when the writer replaced the segment (frame size changed), readers reopen
+    std::atomic<uint32_t> latest; // frameNumber of the newest complete frame, 0 = none yet
+    char padding[16];
+    SharedRingSlot slots[SHARED_RING_SLOTS];
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "The ring is shared between processes and needs lock free atomics");
+static_assert(sizeof(SharedRingSlot) == 64, "SharedRingSlot is part of the shared memory layout");
+
+// Producer side, used in alignImages' output stage
+class SharedFrameWriter
+{
+public:
+    SharedFrameWriter() = default;
+    ~SharedFrameWriter();
+
+    SharedFrameWriter(const SharedFrameWriter &) = delete;
+    SharedFrameWriter &operator=(const SharedFrameWriter &) = delete;
+
+    // Only remembers the name, the segment is created by the first acquire() once the frame size is known
+    void open(const std::string &name);
+    void close();
+    bool isOpen() const { return !name.empty(); }
+
+    // Points slot at the next free slot's pixels so the frame can be rendered straight into shared memory,
+    // (re)creating the segment if the size or type changed. Call publish() once the frame is complete.
+    // On failure slot is released and false is returned.
+    bool acquire(cv::Size size, int type, cv::Mat &slot);
+    void publish();
+
+private:
+    bool create(cv::Size size, int type);
+    void unmap();
+
+    std::string name;
+    SharedRingHeader *header = nullptr;
+    size_t mappedBytes = 0;
+    uint32_t nextFrame = 0;
+    int writingSlot = -1;
+};
+
+// Consumer side, used in DisplayProcessedImage
+class SharedFrameReader
+{
+public:
+    SharedFrameReader() = default;
+    ~SharedFrameReader();
+
+    SharedFrameReader(const SharedFrameReader &) = delete;
+    SharedFrameReader &operator=(const SharedFrameReader &) = delete;
+
+    // Maps the segment read only, fails (and can simply be retried) if the writer hasn't created it yet
+    bool open(const std::string &name);
+    void close();
+    bool isOpen() const { return header != nullptr; }
+
+    // True if a frame newer than the last one returned is ready, view then points straight at it (no copy)
+    // Reopens the segment by itself if the writer replaced it
+    bool latest(cv::Mat &view, uint32_t &frameNumber, uint64_t &timestampNs);
+
+    // Call when done with view, false means the writer reused the slot meanwhile and what was read is torn
+    bool stillValid() const;
+
+private:
+    std::string name;
+    const SharedRingHeader *header = nullptr;
+    size_t mappedBytes = 0;
+    uint32_t lastFrame = 0;
+    int readingSlot = -1;
+    uint32_t readingSeq = 0;
+};
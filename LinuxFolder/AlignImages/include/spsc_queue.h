@@ -0,0 +1,205 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// What push() does when the queue is full
+enum class OverflowPolicy
+{
+    Block,      // Wait for the consumer, nothing is lost but the producer runs at the consumer's pace
+    DropOldest, // Throw away the oldest queued item, the consumer always gets the newest frames (bounded latency)
+    DropNewest, // Throw away the item being pushed, the consumer gets the frames that were queued first
+};
+
+// "block", "drop-oldest" or "drop-newest", returns false for anything else
+inline bool parseOverflowPolicy(const std::string &name, OverflowPolicy &policy)
+{
+    if (name == "block")
+        policy = OverflowPolicy::Block;
+    else if (name == "drop-oldest")
+        policy = OverflowPolicy::DropOldest;
+    else if (name == "drop-newest")
+        policy = OverflowPolicy::DropNewest;
+    else
+        return false;
+    return true;
+}
+
+inline const char *overflowPolicyName(OverflowPolicy policy)
+{
+    return policy == OverflowPolicy::Block ? "block" : policy == OverflowPolicy::DropOldest ? "drop-oldest" : "drop-newest";
+}
+
+// Spins for a few rounds, then yields, then sleeps, for the threads waiting on a queue
+class Backoff
+{
+public:
+    void pause()
+    {
+        if (++rounds < 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+
+    void reset() { rounds = 0; }
+
+private:
+    int rounds = 0;
+};
+
+// Lock free bounded single producer / single consumer queue of preallocated items
+//
+// Same idea as TripleBuffer, but with up to capacity items waiting in between instead of just the newest one.
+// The items themselves never move : the queue passes item indices around, through a ring of queued indices
+// (producer -> consumer) and a ring of free ones (consumer -> producer). The producer always owns writeBuffer(),
+// the consumer always owns readBuffer(), so frames are filled and read in place and reused forever.
+//
+// When the queue is full push() follows the queue's OverflowPolicy. For DropOldest the producer takes the oldest
+// index back itself, which is the one place both sides touch the same end of a ring (a compare and swap on head).
+//
+// capacity + 3 items : capacity queued, the producer's, the consumer's, and the one the consumer is swapping in.
+// Preallocate them all with forEach() before starting the producer.
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(int capacity = 2, OverflowPolicy policy = OverflowPolicy::DropOldest)
+        : capacity(capacity < 1 ? 1 : capacity), policy(policy),
+          items(this->capacity + 3),
+          queued(new std::atomic<int>[this->capacity]),
+          freeSlots(new std::atomic<int>[this->capacity + 3])
+    {
+        // Item 0 is the producer's, item 1 the consumer's, the rest start out free
+        for (int i = 2; i < (int)items.size(); i++)
+            freeSlots[freeTail++].store(i, std::memory_order_relaxed);
+    }
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    // Producer side : fill this item, then call push()
+    T &writeBuffer() { return items[writeIndex]; }
+
+    // Returns false if the item didn't go in : dropped (DropNewest, writeBuffer() is reused) or the queue was closed
+    bool push()
+    {
+        size_t tail = queuedTail.load(std::memory_order_relaxed);
+        Backoff backoff;
+        while (tail - queuedHead.load(std::memory_order_acquire) >= (size_t)capacity)
+        {
+            if (closed.load(std::memory_order_relaxed))
+                return false;
+
+            if (policy == OverflowPolicy::DropNewest)
+            {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            if (policy == OverflowPolicy::Block)
+            {
+                backoff.pause();
+                continue;
+            }
+
+            // DropOldest : the consumer may be taking the same item, whoever wins the compare and swap owns it
+            size_t head = queuedHead.load(std::memory_order_acquire);
+            int oldest = queued[head % capacity].load(std::memory_order_relaxed);
+            if (head != tail && queuedHead.compare_exchange_strong(head, head + 1, std::memory_order_acq_rel))
+            {
+                spareIndex = oldest;
+                dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        queued[tail % capacity].store(writeIndex, std::memory_order_relaxed);
+        queuedTail.store(tail + 1, std::memory_order_release);
+        pushed.fetch_add(1, std::memory_order_relaxed);
+        writeIndex = takeFree();
+        return true;
+    }
+
+    // Consumer side : moves readBuffer() on to the oldest queued item, returns false if nothing is queued
+    // (readBuffer() keeps the previous item then)
+    bool update()
+    {
+        size_t head = queuedHead.load(std::memory_order_relaxed);
+        while (head != queuedTail.load(std::memory_order_acquire))
+        {
+            int index = queued[head % capacity].load(std::memory_order_relaxed);
+            if (queuedHead.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel, std::memory_order_relaxed))
+            {
+                // Only the consumer adds free indices, and there's always room for all of them
+                size_t tail = freeTail.load(std::memory_order_relaxed);
+                freeSlots[tail % items.size()].store(readIndex, std::memory_order_relaxed);
+                freeTail.store(tail + 1, std::memory_order_release);
+                readIndex = index;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const T &readBuffer() const { return items[readIndex]; }
+
+    // Wakes a producer blocked in push(), which returns false from then on while the queue is full
+    void close() { closed = true; }
+
+    int size() const { return (int)(queuedTail.load(std::memory_order_acquire) - queuedHead.load(std::memory_order_acquire)); }
+    int maxSize() const { return capacity; }
+    OverflowPolicy overflowPolicy() const { return policy; }
+    uint64_t pushedCount() const { return pushed.load(std::memory_order_relaxed); }
+    uint64_t droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+
+    // Only safe before the producer starts
+    template <typename F>
+    void forEach(F f)
+    {
+        for (T &item : items)
+            f(item);
+    }
+
+private:
+    // Producer side, an item the producer took back with DropOldest comes first
+    int takeFree()
+    {
+        if (spareIndex >= 0)
+        {
+            int index = spareIndex;
+            spareIndex = -1;
+            return index;
+        }
+
+        // Never empty for long : at most the consumer is between taking a new item and returning the old one
+        Backoff backoff;
+        while (freeHead == freeTail.load(std::memory_order_acquire))
+            backoff.pause();
+        return freeSlots[freeHead++ % items.size()].load(std::memory_order_relaxed);
+    }
+
+    const int capacity;
+    const OverflowPolicy policy;
+    std::vector<T> items;
+
+    std::unique_ptr<std::atomic<int>[]> queued;
+    std::atomic<size_t> queuedHead{0};
+    std::atomic<size_t> queuedTail{0};
+
+    std::unique_ptr<std::atomic<int>[]> freeSlots;
+    size_t freeHead = 0; // Producer only
+    std::atomic<size_t> freeTail{0};
+
+    int writeIndex = 0; // Producer only
+    int spareIndex = -1;
+    int readIndex = 1; // Consumer only
+
+    std::atomic<bool> closed{false};
+    std::atomic<uint64_t> pushed{0};
+    std::atomic<uint64_t> dropped{0};
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#define TRACE_RING_CAPACITY 4096 // Spans kept per thread (a few seconds of frames), must be a power of two
+#define TRACE_MAX_THREADS 32     // Threads beyond this many just aren't traced
+
+// Per stage tracing for the alignment loop, capture threads and batch workers
+//
+// TRACE_SCOPE("name") times the rest of the enclosing block. Finished spans go into a fixed size ring owned by
+// the recording thread (no locks, no allocation, two clock reads and a few stores per span), the oldest spans
+// get overwritten. traceDumpReport() snapshots every ring into a Chrome / Perfetto trace JSON (chrome://tracing,
+// ui.perfetto.dev) and prints per stage percentiles over the spans still in the rings.
+//
+// Names must be string literals (or otherwise live for the whole run), only the pointer is stored.
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+
+// On by default, --no-trace turns it off
+extern std::atomic<bool> tracingEnabled;
+
+uint64_t traceNowNs();
+void traceRecord(const char *name, uint64_t startNs, uint64_t endNs);
+
+// Shown as the thread's row label in the trace viewer, call once from the thread itself
+void traceSetThreadName(const char *name);
+
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char *name)
+        : name(name), startNs(tracingEnabled.load(std::memory_order_relaxed) ? traceNowNs() : 0)
+    {
+    }
+
+    ~TraceSpan()
+    {
+        if (startNs != 0)
+            traceRecord(name, startNs, traceNowNs());
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+    const char *name;
+    uint64_t startNs;
+};
+
+// Writes the Chrome trace JSON to path and prints the per stage percentiles to out
+// Safe to call while other threads keep recording, spans overwritten during the copy are skipped
+bool traceDumpReport(const std::string &path, std::ostream &out);
+
+// Per stage count / mean / p50 / p99 / max over the spans currently in the rings
+void tracePrintPercentiles(std::ostream &out);
+
+// kill -USR1 <pid> (or whichever signal) asks for a dump, the frame loop polls traceDumpRequested()
+// The handler only sets a flag, writing the file from a signal handler isn't safe
+void traceInstallSignalHandler(int signal);
+
+// True once per request, clears the flag
+bool traceDumpRequested();
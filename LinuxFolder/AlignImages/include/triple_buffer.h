@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+
+// Lock free single producer / single consumer triple buffer
+//
+// The producer always has a private back buffer to write into, the consumer always has a private front buffer
+// to read from, and the third buffer sits in the middle holding the newest completed frame.
+// publish() and update() just swap an index with the middle slot, so neither side ever waits on the other
+// and the consumer always gets the most recent frame (older unread frames are simply overwritten).
+//
+// The buffers are reused forever, so preallocate them once with forEach() before starting the producer.
+template <typename T>
+class TripleBuffer
+{
+public:
+    // Producer side : fill this buffer, then call publish()
+    T &writeBuffer() { return buffers[backIndex]; }
+
+    void publish()
+    {
+        backIndex = middle.exchange(backIndex | FRESH_BIT, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    // Consumer side : returns true if a newer frame was swapped into readBuffer()
+    bool update()
+    {
+        if (!(middle.load(std::memory_order_relaxed) & FRESH_BIT))
+            return false;
+
+        frontIndex = middle.exchange(frontIndex, std::memory_order_acq_rel) & INDEX_MASK;
+        return true;
+    }
+
+    const T &readBuffer() const { return buffers[frontIndex]; }
+
+    // Only safe before the producer starts
+    template <typename F>
+    void forEach(F f)
+    {
+        for (T &buffer : buffers)
+            f(buffer);
+    }
+
+private:
+    static constexpr int FRESH_BIT = 4;
+    static constexpr int INDEX_MASK = 3;
+
+    std::array<T, 3> buffers;
+    int backIndex = 0;
+    std::atomic<int> middle{1};
+    int frontIndex = 2;
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "spsc_queue.h"
+
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+
+#define RECORD_QUEUE_CAPACITY 8 // Frames waiting for the encoder, about a third of a second of disk stall at 30 fps
+#define RECORD_DEFAULT_FPS 30.0
+
+// What --record writes
+enum class RecordFormat
+{
+    Mjpg, // cv::VideoWriter MJPG, small files, cheap enough to keep up on the Pi
+    Ffv1, // cv::VideoWriter FFV1, lossless but several times the CPU and disk of MJPG (use a .mkv or .avi path)
+    Raw,  // Every frame as a frame_stream.h FrameHeader + the BGRA rows, no encoding at all, the largest files
+};
+
+// "mjpg", "ffv1" or "raw", returns false for anything else
+bool parseRecordFormat(const std::string &name, RecordFormat &format);
+const char *recordFormatName(RecordFormat format);
+
+// Records the blended frames of a whole session without the processing loop ever waiting on the encoder or the disk
+//
+// record() copies the frame into one of the queue's preallocated frames and returns, the encoder thread converts
+// and writes it. When the encoder falls behind (slow disk, FFV1 on the Pi) and the queue is full, record() drops the
+// frame without copying it, so the recording gets a gap instead of the display getting a stall. Dropped frames are
+// counted and printed by printStats(). The frames are reused for the whole session, nothing is allocated per frame.
+//
+// Raw recordings have the same layout as a --stream session with --codec raw, each header carries the frame's
+// sequence number (gaps = dropped frames) and CLOCK_REALTIME when it was recorded. The video formats have no per
+// frame timestamps and play back at the fps given to open(), dropped frames simply aren't in them.
+class VideoRecorder
+{
+public:
+    VideoRecorder() = default;
+    ~VideoRecorder();
+
+    VideoRecorder(const VideoRecorder &) = delete;
+    VideoRecorder &operator=(const VideoRecorder &) = delete;
+
+    // Opens the output and starts the encoder thread, every frame given to record() must be frameSize and type
+    bool open(const std::string &path, RecordFormat format, double fps, cv::Size frameSize, int type,
+              int queueCapacity = RECORD_QUEUE_CAPACITY);
+
+    // Writes out whatever is still queued, then closes the file. The stats stay until the next open()
+    void close();
+    bool isOpen() const { return queue != nullptr; }
+
+    // Never blocks, returns false if the frame was dropped
+    bool record(const cv::Mat &frame);
+
+    uint64_t recordedCount() const { return recorded; }
+    uint64_t droppedCount() const { return dropped; }
+    uint64_t writtenCount() const { return written.load(std::memory_order_relaxed); }
+
+    // Frames recorded / dropped / written, the encoder's time per frame and how full the queue got
+    void printStats(std::ostream &out) const;
+
+private:
+    struct RecordedFrame
+    {
+        cv::Mat image;
+        uint64_t sequence = 0;
+        uint64_t timestampNs = 0; // frameStreamNowNs() when record() got it
+    };
+
+    void encodeLoop();
+    bool writeFrame(const RecordedFrame &frame);
+
+    std::string path;
+    RecordFormat format = RecordFormat::Mjpg;
+    cv::Size frameSize;
+    int type = 0;
+    int queueCapacity = 0;
+
+    std::unique_ptr<SpscQueue<RecordedFrame>> queue;
+    std::thread encoderThread;
+    std::atomic<bool> running{false};
+
+    // Encoder thread only
+    cv::VideoWriter videoWriter;
+    cv::Mat bgr; // VideoWriter wants 3 channels
+    int rawFd = -1;
+
+    // Producer only
+    uint64_t recorded = 0;
+    uint64_t dropped = 0;
+    int maxQueued = 0;
+
+    // Written by the encoder thread
+    std::atomic<uint64_t> written{0};
+    std::atomic<uint64_t> failed{0};
+    std::atomic<uint64_t> encodeSumNs{0};
+    std::atomic<uint64_t> encodeMaxNs{0};
+};
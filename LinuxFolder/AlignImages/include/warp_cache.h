@@ -0,0 +1,70 @@
+#pragma once
+
+#include "dirty_tiles.h"
+
+#include <opencv2/core.hpp>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Reads the "homography" matrix out of a homography.yml file
+// Returns an empty Mat if the file can't be opened or doesn't contain the matrix
+cv::Mat loadHomography(const std::string &filename);
+
+// Writes homography as the "homography" matrix of a homography.yml file
+// Goes through a temporary file and a rename, so a running alignImages never reloads a half written file
+bool saveHomography(const std::string &filename, const cv::Mat &homography);
+
+// Reloads the homography only if homography.yml was rewritten since lastWriteTime
+// Returns true if homography was updated
+bool reloadHomographyIfChanged(const std::string &filename, std::filesystem::file_time_type &lastWriteTime, cv::Mat &homography);
+
+// Caches fixed point remap() tables for the visible frame
+//
+// The visible frame is warped by the homography and then shifted by (-offsetX, -offsetY) so it lands
+// directly in the IR frame's coordinates. This is the same relative alignment as translating the IR frame
+// by (offsetX, offsetY), but the IR frame no longer needs to be interpolated at all.
+// The maps are only rebuilt when the homography, the offsets or the frame sizes change.
+//
+// Rebuilding also finds the overlap : the bounding rectangle of the IR frame pixels the visible frame actually covers.
+// Everything outside it is border that only the IR camera sees, so apply() and the rest of the frame
+// (colorize(), blendIROverlay()) only process the overlap and fill the border.
+class WarpMapCache
+{
+public:
+    // Returns true if the maps were rebuilt (the previously warped frame is stale)
+    bool update(const cv::Mat &homography, int offsetX, int offsetY, cv::Size srcSize, cv::Size dstSize);
+
+    // Single remap() lookup using the CV_16SC2 map and the interpolation table, over the overlap only
+    // The rest of dst is set to 0, what remap() would have written there
+    void apply(const cv::Mat &src, cv::Mat &dst) const;
+
+    // --incremental : only remaps the destination tiles whose source footprint (the visible frame pixels their bilinear
+    // samples read, found when the maps are built) touches a tile marked in srcTiles. Those tiles are marked in
+    // dstTiles, then every dirty tile of dstTiles inside the overlap is remapped. dst must hold a previous apply() of
+    // the same maps, everything else in it is left as it is. Returns the number of dirty tiles in dstTiles
+    int applyTiles(const cv::Mat &src, cv::Mat &dst, const DirtyTiles &srcTiles, DirtyTiles &dstTiles) const;
+
+    bool empty() const { return map1.empty(); }
+
+    // The visible frame position apply() samples for the IR pixel dst, decoded from the fixed point maps
+    cv::Point2f sourcePoint(cv::Point dst) const;
+
+    // In IR frame coordinates, empty before the first update()
+    // The whole frame if the two cameras don't overlap at all, so nothing downstream ends up with an empty frame
+    const cv::Rect &overlap() const { return overlapRect; }
+
+private:
+    cv::Matx33d cachedHomography;
+    int cachedOffsetX = 0;
+    int cachedOffsetY = 0;
+    cv::Size cachedSrcSize;
+    cv::Size cachedDstSize;
+    cv::Rect overlapRect;
+
+    cv::Mat map1; // CV_16SC2 integer source coordinates
+    cv::Mat map2; // CV_16UC1 index into the bilinear interpolation table
+
+    // Per destination tile (DirtyTiles grid of the IR frame), the range of source tiles it reads, empty if none
+    std::vector<cv::Rect> footprints;
+};
@@ -8,3 +8,9 @@
 // https://github.com/aivakov/OpenCV-hacks-C-/blob/master/Yen.cpp
 // licensed under GNU General Public License v3.0
 int Yen(cv::Mat data);
+
+// Largest histogram Yen() accepts, enough for 12 bit data
+#define YEN_MAX_BINS 4096
+
+// Same method on a plain histogram with any number of bins
+int Yen(const float *histogram, int bins);
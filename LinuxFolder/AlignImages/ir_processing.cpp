@@ -0,0 +1,544 @@
+#include "ir_processing.h"
+#include "overlay.h"
+#include "trace.h"
+#include "yen_threshold.h"
+
+#include <opencv2/core/utility.hpp>
+#include <algorithm>
+
+IRProcessingContext::IRProcessingContext()
+{
+    clahe = cv::createCLAHE();
+    clahe->setClipLimit(CLAHE_CLIP_LIMIT);
+
+    clahe16 = cv::createCLAHE();
+
+    hist.create(256, 1, CV_32F);
+    lut.create(1, 256, CV_8U);
+
+    // Sized for the widest histogram once, so switching bit depth never reallocates
+    const int maxBins = 1 << IR_HISTOGRAM_MAX_BITS;
+    wideCounts.resize(maxBins);
+    wideHist.resize(maxBins);
+    widePalette.resize(maxBins);
+    thresholdedHist.resize(maxBins);
+    paletteHist.resize(maxBins);
+    histCumulative.resize(maxBins);
+
+    // applyColorMap() builds a new colormap object and its LUT on every call, so run it once on a 0-255 ramp
+    // and keep the result as a plain palette
+    cv::Mat ramp(1, 256, CV_8UC1), jet;
+    for (int i = 0; i < 256; i++)
+        ramp.at<uchar>(0, i) = (uchar)i;
+    cv::applyColorMap(ramp, jet, cv::COLORMAP_JET);
+    for (int i = 0; i < 256; i++)
+        jetPalette[i] = jet.at<cv::Vec3b>(0, i);
+}
+
+void IRProcessingContext::allocate(cv::Size frameSize, int depth)
+{
+    // Only what colorize() touches, the stage by stage yenThreshold() / remapLutThreshold() size theirs on first use
+    if (depth == CV_16U)
+    {
+        cl16.create(frameSize, CV_16UC1);
+    }
+    else
+    {
+        grey.create(frameSize, CV_8UC1);
+        cl.create(frameSize, CV_8UC1);
+    }
+    colored.create(frameSize, CV_8UC4);
+}
+
+void IRProcessingContext::histogram(const cv::Mat &src)
+{
+    // cv::calcHist() allocates internally, and a plain counting loop is faster for 8 bit data anyway
+    int counts[256] = {0};
+    for (int y = 0; y < src.rows; y++)
+    {
+        const uchar *row = src.ptr<uchar>(y);
+        for (int x = 0; x < src.cols; x++)
+            counts[row[x]]++;
+    }
+
+    float *h = hist.ptr<float>();
+    for (int i = 0; i < 256; i++)
+        h[i] = (float)counts[i];
+}
+
+void IRProcessingContext::wideHistogram(const cv::Mat &src, int shift)
+{
+    const int bins = 1 << (16 - shift);
+    std::fill(wideCounts.begin(), wideCounts.begin() + bins, 0);
+
+    int *counts = wideCounts.data();
+    for (int y = 0; y < src.rows; y++)
+    {
+        const ushort *row = src.ptr<ushort>(y);
+        for (int x = 0; x < src.cols; x++)
+            counts[row[x] >> shift]++;
+    }
+
+    for (int i = 0; i < bins; i++)
+        wideHist[i] = (float)counts[i];
+}
+
+const cv::Mat &IRProcessingContext::yenThreshold(const cv::Mat &src, bool compressed, double &foundThresh)
+{
+    // Convert frame to grayscale, single channel frames are used as they are
+    if (src.channels() != 1)
+        cv::cvtColor(src, grey, cv::COLOR_BGR2GRAY);
+    const cv::Mat &greyFrame = src.channels() != 1 ? grey : src;
+
+    // Equalize
+    clahe->apply(greyFrame, cl);
+
+    // Create histogram
+    histogram(cl);
+
+    // Yen thresholding
+    int yen_threshold = Yen(hist);
+    foundThresh = yen_threshold;
+
+    // Apply binary thresholding
+    if (compressed)
+    {
+        cv::threshold(cl, thresholded, double(yen_threshold), 255, cv::THRESH_BINARY);
+    }
+    else
+    {
+        cv::threshold(cl, thresholded, double(yen_threshold), 255, cv::THRESH_TOZERO);
+    }
+
+    return thresholded;
+}
+
+const cv::Mat &IRProcessingContext::remapLutThreshold(const cv::Mat &src, float k, int threshold, int &topkvalue)
+{
+    histogram(src);
+    const float *h = hist.ptr<float>();
+
+    int high = 0;
+    for (int i = 0; i < 256; i++)
+    {
+        if (h[i] != 0)
+            high = i;
+    }
+
+    histCumulative[0] = h[0];
+    for (int i = 1; i < 256; i++)
+    {
+        histCumulative[i] = histCumulative[i - 1] + h[i];
+    }
+    float abovePixels = histCumulative[255] - histCumulative[threshold];
+    float totalPixels = src.rows * src.cols;
+    topkvalue = 0;
+    for (int i = 0; i < 256; i++)
+    {
+        if (histCumulative[i] >= totalPixels - k * abovePixels)
+        {
+            topkvalue = i;
+            break;
+        }
+    }
+
+    uchar *l = lut.ptr<uchar>();
+    for (int i = 0; i <= 255; i++)
+    {
+        if (i > topkvalue)
+            l[i] = 255;
+        else if (i > threshold)
+            l[i] = 255.0 * (i - threshold) / (high - threshold);
+        else
+            l[i] = 0;
+    }
+    cv::LUT(src, lut, processed);
+
+    return processed;
+}
+
+void IRProcessingContext::buildPalette(const float *h, int bins, int threshold, cv::Vec4b *out)
+{
+    // Yen() returns -1 for a histogram it can't split, treat that as "everything is above the threshold"
+    threshold = std::max(threshold, 0);
+
+    // Histogram of the THRESH_TOZERO frame, straight from the CLAHE histogram instead of another pass
+    float *th = thresholdedHist.data();
+    th[0] = 0;
+    for (int i = 0; i < bins; i++)
+    {
+        if (i > threshold)
+            th[i] = h[i];
+        else
+        {
+            th[0] += h[i];
+            if (i > 0)
+                th[i] = 0;
+        }
+    }
+
+    // Same top k math as remapLutThreshold()
+    int high = 0;
+    for (int i = 0; i < bins; i++)
+    {
+        if (th[i] != 0)
+            high = i;
+    }
+
+    float *cumulative = histCumulative.data();
+    cumulative[0] = th[0];
+    for (int i = 1; i < bins; i++)
+    {
+        cumulative[i] = cumulative[i - 1] + th[i];
+    }
+    float abovePixels = cumulative[bins - 1] - cumulative[threshold];
+    float totalPixels = cumulative[bins - 1];
+    int topkvalue = 0;
+    for (int i = 0; i < bins; i++)
+    {
+        if (cumulative[i] >= totalPixels - TOPK_FRACTION * abovePixels)
+        {
+            topkvalue = i;
+            break;
+        }
+    }
+
+    for (int i = 0; i < bins; i++)
+    {
+        int thresholdedValue = i > threshold ? i : 0;
+
+        int remapped;
+        if (thresholdedValue > topkvalue)
+            remapped = 255;
+        else if (thresholdedValue > threshold)
+            remapped = (int)(255.0 * (thresholdedValue - threshold) / (high - threshold));
+        else
+            remapped = 0;
+
+        const cv::Vec3b &color = jetPalette[remapped];
+
+        // The only place a wide frame gets quantized to 8 bit, for 256 bins this is just the intensity
+        int alpha = (thresholdedValue * 255 + (bins - 1) / 2) / (bins - 1);
+
+        // Entries the colormap paints blue are the cold end of the scale, keep them transparent
+        // (the same B >= 100, G <= 100, R <= 100 range the per pixel cv::inRange() mask used to catch)
+        if (color[0] >= 100 && color[1] <= 100 && color[2] <= 100)
+            alpha = 0;
+
+        // Premultiply so the blend doesn't need to scale the color by alpha per pixel
+        out[i] = cv::Vec4b((uchar)((color[0] * alpha + 127) / 255),
+                           (uchar)((color[1] * alpha + 127) / 255),
+                           (uchar)((color[2] * alpha + 127) / 255),
+                           (uchar)alpha);
+    }
+
+    paletteThreshold = threshold;
+    paletteTopk = topkvalue;
+}
+
+void IRProcessingContext::updatePalette(const float *h, int bins, cv::Vec4b *out)
+{
+    if (incremental && !fullUpdate && bins == paletteBins && histogramShift(h, bins) <= histogramTolerance)
+        return;
+
+    buildPalette(h, bins, Yen(h, bins), out);
+    std::copy(h, h + bins, paletteHist.begin());
+    paletteBins = bins;
+    paletteBuildCount++;
+
+    // Every pixel may map to a new color now
+    fullUpdate = true;
+}
+
+double IRProcessingContext::histogramShift(const float *h, int bins) const
+{
+    double total = 0, paletteTotal = 0;
+    for (int i = 0; i < bins; i++)
+    {
+        total += h[i];
+        paletteTotal += paletteHist[i];
+    }
+    if (total <= 0 || paletteTotal <= 0)
+        return 1.0;
+
+    double cumulative = 0, paletteCumulative = 0, shift = 0;
+    for (int i = 0; i < bins; i++)
+    {
+        cumulative += h[i];
+        paletteCumulative += paletteHist[i];
+        shift = std::max(shift, std::abs(cumulative / total - paletteCumulative / paletteTotal));
+    }
+    return shift;
+}
+
+void IRProcessingContext::analyze8(const cv::Mat &greyFrame)
+{
+    // Equalize
+    {
+        TRACE_SCOPE("clahe");
+        clahe->apply(greyFrame, cl);
+    }
+
+    // Create histogram, pick the Yen threshold and fold everything else into the palette
+    {
+        TRACE_SCOPE("yen + palette");
+        histogram(cl);
+        updatePalette(hist.ptr<float>(), 256, palette);
+    }
+}
+
+void IRProcessingContext::analyze16(const cv::Mat &irImage, int bitDepth)
+{
+    // 16 bit CLAHE uses 65536 bins and clips at clipLimit * tile pixels / 65536, with only 2^bitDepth of them
+    // in use that would clip far harder than the 8 bit path, so scale the limit back up to match it
+    if (bitDepth != clahe16Depth)
+    {
+        clahe16->setClipLimit(CLAHE_CLIP_LIMIT * (1 << (16 - bitDepth)));
+        clahe16Depth = bitDepth;
+    }
+
+    // Equalize, the result spans the full 16 bit range whatever the input depth was
+    {
+        TRACE_SCOPE("clahe");
+        clahe16->apply(irImage, cl16);
+    }
+
+    // Threshold on up to 12 bits, finer than that only spreads the same counts over more empty bins
+    const int histBits = std::min(bitDepth, IR_HISTOGRAM_MAX_BITS);
+    const int bins = 1 << histBits;
+    wideShift = 16 - histBits;
+
+    {
+        TRACE_SCOPE("yen + palette");
+        wideHistogram(cl16, wideShift);
+        updatePalette(wideHist.data(), bins, widePalette.data());
+    }
+}
+
+void IRProcessingContext::lookup(const cv::Mat &intensity, cv::Mat &out) const
+{
+    // One gather pass from the equalized frame to the final premultiplied BGRA frame
+    // Only captures the job so the loop body fits std::function's small buffer and the call doesn't allocate
+    TRACE_SCOPE("palette lookup");
+    struct
+    {
+        const cv::Mat &intensity;
+        cv::Mat &out;
+        const cv::Vec4b *palette8;
+        const cv::Vec4b *palette16;
+        int shift;
+    } job{intensity, out, palette, widePalette.data(), wideShift};
+
+    cv::parallel_for_(cv::Range(0, intensity.rows), [&job](const cv::Range &range)
+    {
+        for (int y = range.start; y < range.end; y++)
+        {
+            cv::Vec4b *out = job.out.ptr<cv::Vec4b>(y);
+            if (job.intensity.depth() == CV_16U)
+            {
+                const ushort *value = job.intensity.ptr<ushort>(y);
+                for (int x = 0; x < job.intensity.cols; x++)
+                    out[x] = job.palette16[value[x] >> job.shift];
+            }
+            else
+            {
+                const uchar *value = job.intensity.ptr<uchar>(y);
+                for (int x = 0; x < job.intensity.cols; x++)
+                    out[x] = job.palette8[value[x]];
+            }
+        }
+    });
+}
+
+void IRProcessingContext::lookupChanged(const cv::Mat &intensity, const cv::Rect &area)
+{
+    if (!incremental || fullUpdate)
+    {
+        lookup(intensity, coloredOverlap);
+        if (incremental)
+            intensity.copyTo(previousIntensity);
+        return;
+    }
+
+    outputTiles.clear();
+    updateChangedTiles(intensity, previousIntensity, area.tl(), outputTiles);
+    outputTiles.forEachRun([&](const cv::Rect &run)
+                           {
+                               const cv::Rect local = run - area.tl();
+                               cv::Mat out = coloredOverlap(local);
+                               lookup(intensity(local), out);
+                           },
+                           area);
+}
+
+// equalized = upsampled equalized frame + gain * (frame - upsampled frame) : the analysis level's equalization
+// plus the full resolution detail it couldn't see, so edges (and the threshold boundary) stay sharp
+template <typename T>
+static void restoreDetail(const cv::Mat &equalizedUp, const cv::Mat &src, const cv::Mat &srcUp, int gain, cv::Mat &dst)
+{
+    struct
+    {
+        const cv::Mat &equalizedUp;
+        const cv::Mat &src;
+        const cv::Mat &srcUp;
+        cv::Mat &dst;
+        int gain;
+    } job{equalizedUp, src, srcUp, dst, gain};
+
+    cv::parallel_for_(cv::Range(0, src.rows), [&job](const cv::Range &range)
+    {
+        for (int y = range.start; y < range.end; y++)
+        {
+            const T *eq = job.equalizedUp.ptr<T>(y);
+            const T *s = job.src.ptr<T>(y);
+            const T *su = job.srcUp.ptr<T>(y);
+            T *out = job.dst.ptr<T>(y);
+            for (int x = 0; x < job.src.cols; x++)
+                out[x] = cv::saturate_cast<T>((int)eq[x] + job.gain * ((int)s[x] - (int)su[x]));
+        }
+    });
+}
+
+void IRProcessingContext::setAnalysisScale(int downscale, IRAnalysisOutput output)
+{
+    analysisScale = downscale == 2 || downscale == 4 ? downscale : 1;
+    analysisOutput = output;
+    incrementalValid = false;
+}
+
+void IRProcessingContext::setIncremental(bool enabled, int tolerance, double histogramTolerance)
+{
+    incremental = enabled;
+    tileTolerance = std::max(tolerance, 0);
+    this->histogramTolerance = histogramTolerance;
+    incrementalValid = false;
+}
+
+const cv::Mat &IRProcessingContext::colorize(const cv::Mat &irImage, int bitDepth, const cv::Rect &overlap)
+{
+    TRACE_SCOPE("colorize");
+
+    // Everything below works on the overlap's view of the frame, the border around it is transparent
+    // An overlap that doesn't fit the frame (computed for another frame size) means the whole frame
+    const cv::Rect frame(0, 0, irImage.cols, irImage.rows);
+    const cv::Rect clipped = overlap & frame;
+    const cv::Rect area = clipped.empty() ? frame : clipped;
+    cv::Mat src = irImage(area);
+
+    // Without --incremental (or when it starts over) every tile of the output is new
+    fullUpdate = true;
+    if (incremental)
+    {
+        if (!incrementalValid || reference.size() != irImage.size() || reference.type() != irImage.type() ||
+            area != incrementalArea || bitDepth != incrementalBitDepth)
+        {
+            irImage.copyTo(reference);
+            inputTiles.reset(irImage.size());
+            incrementalArea = area;
+            incrementalBitDepth = bitDepth;
+            incrementalValid = true;
+        }
+        else
+        {
+            // The tolerance is in 8 bit levels, one of them is 2^(bitDepth - 8) in a wide frame
+            const int wideBits = bitDepth > 8 && bitDepth <= 16 ? bitDepth : 16;
+            const int tolerance = irImage.depth() == CV_16U ? tileTolerance << (wideBits - 8) : tileTolerance;
+
+            // Nothing moved past the tolerance, the colors from last time still stand
+            cv::Mat referenceArea = reference(area);
+            inputTiles.clear();
+            if (updateReferenceTiles(src, referenceArea, area.tl(), tolerance, inputTiles) == 0)
+            {
+                outputTiles.clear();
+                return colored;
+            }
+            fullUpdate = false;
+        }
+
+        // Tiles under the tolerance are processed exactly as they were last time
+        src = reference(area);
+    }
+    outputTiles.reset(irImage.size());
+
+    colored.create(irImage.size(), CV_8UC4);
+    coloredOverlap = colored(area);
+    if (area != frame)
+        fillOutside(colored, area, cv::Scalar());
+
+    const bool wide = src.depth() == CV_16U;
+    if (wide)
+    {
+        CV_Assert(src.channels() == 1);
+        bitDepth = bitDepth > 0 && bitDepth <= 16 ? bitDepth : 16;
+    }
+    else if (src.channels() != 1)
+    {
+        // Convert frame to grayscale, single channel frames are used as they are
+        cv::cvtColor(src, grey, cv::COLOR_BGR2GRAY);
+        src = grey;
+    }
+
+    if (analysisScale == 1)
+    {
+        if (wide)
+            analyze16(src, bitDepth);
+        else
+            analyze8(src);
+        lookupChanged(wide ? cl16 : cl, area);
+        return colored;
+    }
+
+    // Reduced resolution : CLAHE, histogram and Yen only look at a 1/2 or 1/4 scale copy of the frame
+    {
+        TRACE_SCOPE("downscale");
+        cv::resize(src, reduced, cv::Size(std::max(1, src.cols / analysisScale), std::max(1, src.rows / analysisScale)), 0, 0, cv::INTER_AREA);
+    }
+    if (wide)
+        analyze16(reduced, bitDepth);
+    else
+        analyze8(reduced);
+    const cv::Mat &equalized = wide ? cl16 : cl;
+
+    if (analysisOutput == IRAnalysisOutput::Reduced)
+    {
+        // Palette lookup at the analysis level too, then the premultiplied colors are upsampled (premultiplied
+        // so the transparent pixels don't bleed dark fringes into the hot ones). With --incremental the whole overlap
+        // is redone whenever a tile changed
+        coloredReduced.create(equalized.size(), CV_8UC4);
+        lookup(equalized, coloredReduced);
+        TRACE_SCOPE("upsample");
+        cv::resize(coloredReduced, coloredOverlap, coloredOverlap.size(), 0, 0, cv::INTER_LINEAR);
+        return colored;
+    }
+
+    // Threshold and palette at full resolution, on the equalization rebuilt from the analysis level
+    {
+        TRACE_SCOPE("upsample");
+        cv::resize(equalized, equalizedUp, src.size(), 0, 0, cv::INTER_LINEAR);
+        cv::resize(reduced, reducedUp, src.size(), 0, 0, cv::INTER_LINEAR);
+        restored.create(src.size(), equalized.type());
+
+        // CLAHE stretches the 16 bit path's bitDepth bits over the whole 16 bit range, the detail has to be scaled the same way
+        if (wide)
+            restoreDetail<ushort>(equalizedUp, src, reducedUp, 1 << (16 - bitDepth), restored);
+        else
+            restoreDetail<uchar>(equalizedUp, src, reducedUp, 1, restored);
+    }
+    lookupChanged(restored, area);
+    return colored;
+}
+
+void normalizeTo8Bit(const cv::Mat &src, cv::Mat &dst)
+{
+    if (src.depth() == CV_8U)
+    {
+        if (dst.data != src.data)
+            src.copyTo(dst);
+        return;
+    }
+
+    double minVal, maxVal;
+    cv::minMaxLoc(src, &minVal, &maxVal); // Get min and max pixel values
+    double scale = maxVal > minVal ? 255.0 / (maxVal - minVal) : 1.0;
+    src.convertTo(dst, CV_8U, scale, -minVal * scale);
+}
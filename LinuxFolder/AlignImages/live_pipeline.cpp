@@ -0,0 +1,249 @@
+#include "live_pipeline.h"
+#include "overlay.h"
+#include "trace.h"
+
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <iomanip>
+
+bool parseQueuePolicy(const std::string &spec, PipelineOptions &options)
+{
+    size_t separator = spec.find('=');
+    OverflowPolicy policy;
+    if (separator == std::string::npos || !parseOverflowPolicy(spec.substr(separator + 1), policy))
+        return false;
+
+    std::string queue = spec.substr(0, separator);
+    if (queue == "colored" || queue == "all")
+        options.coloredPolicy = policy;
+    if (queue == "warped" || queue == "all")
+        options.warpedPolicy = policy;
+    if (queue == "display" || queue == "all")
+        options.displayPolicy = policy;
+    return queue == "colored" || queue == "warped" || queue == "display" || queue == "all";
+}
+
+LivePipeline::LivePipeline(const PipelineOptions &options, cv::Size frameSize)
+    : options(options), frameSize(frameSize),
+      coloredQueue(options.queueCapacity, options.coloredPolicy),
+      warpedQueue(options.queueCapacity, options.warpedPolicy),
+      displayQueue(options.queueCapacity, options.displayPolicy)
+{
+    // Every frame that will ever travel through a queue, allocated once here
+    coloredQueue.forEach([&](ColorizedFrame &frame)
+                         { frame.colored.create(frameSize, CV_8UC4); });
+    warpedQueue.forEach([&](WarpedFrame &frame)
+                        { frame.warped.create(frameSize, CV_8UC1); });
+    displayQueue.forEach([&](PipelineFrame &frame)
+                         { frame.blended.create(frameSize, CV_8UC4); });
+}
+
+LivePipeline::~LivePipeline()
+{
+    stop();
+}
+
+void LivePipeline::start(TripleBuffer<cv::Mat> &irFrames, TripleBuffer<cv::Mat> &visibleFrames, const std::atomic<bool> &capturing,
+                         const cv::Mat &homography, int offsetX, int offsetY, OffsetEstimator *estimator)
+{
+    this->irFrames = &irFrames;
+    this->visibleFrames = &visibleFrames;
+    this->capturing = &capturing;
+    this->estimator = estimator;
+    setOffsets(offsetX, offsetY);
+    setHomography(homography);
+
+    running = true;
+    colorizeThread = std::thread(&LivePipeline::colorizeStage, this);
+    warpThread = std::thread(&LivePipeline::warpStage, this);
+    blendThread = std::thread(&LivePipeline::blendStage, this);
+}
+
+void LivePipeline::stop()
+{
+    if (!running.exchange(false))
+        return;
+
+    // A stage blocked on a full queue (OverflowPolicy::Block) gives up once its queue is closed
+    coloredQueue.close();
+    warpedQueue.close();
+    displayQueue.close();
+
+    colorizeThread.join();
+    warpThread.join();
+    blendThread.join();
+}
+
+void LivePipeline::setOffsets(int x, int y)
+{
+    offsetX.store(x, std::memory_order_relaxed);
+    offsetY.store(y, std::memory_order_relaxed);
+}
+
+void LivePipeline::setHomography(const cv::Mat &homography)
+{
+    cv::Matx33d &next = homographies.writeBuffer();
+    for (int r = 0; r < 3; r++)
+        for (int c = 0; c < 3; c++)
+            next(r, c) = homography.depth() == CV_64F ? homography.at<double>(r, c) : homography.at<float>(r, c);
+    homographies.publish();
+}
+
+bool LivePipeline::update()
+{
+    if (!displayQueue.update())
+        return false;
+
+    uint64_t latencyNs = traceNowNs() - displayQueue.readBuffer().startNs;
+    latencySumNs += latencyNs;
+    latencyMaxNs = std::max(latencyMaxNs, latencyNs);
+    displayedFrames++;
+    return true;
+}
+
+void LivePipeline::colorizeStage()
+{
+    traceSetThreadName("colorize stage");
+
+    IRProcessingContext irContext;
+    irContext.setAnalysisScale(options.irAnalysisScale, options.irAnalysisOutput);
+    irContext.allocate(frameSize);
+    cv::Rect overlap; // Empty until the warp stage has built its maps = the whole frame
+
+    Backoff backoff;
+    while (running && *capturing)
+    {
+        if (!irFrames->update())
+        {
+            backoff.pause();
+            continue;
+        }
+        backoff.reset();
+
+        uint64_t startNs = traceNowNs();
+        if (overlaps.update())
+            overlap = overlaps.readBuffer();
+
+        // colorize() keeps its output in the context, so it's copied into the queue's preallocated frame
+        ColorizedFrame &out = coloredQueue.writeBuffer();
+        const cv::Mat &colored = irContext.colorize(irFrames->readBuffer(), 0, overlap);
+        {
+            TRACE_SCOPE("queue copy");
+            colored.copyTo(out.colored);
+        }
+        out.startNs = startNs;
+        coloredQueue.push();
+        colorizedFrames.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void LivePipeline::warpStage()
+{
+    traceSetThreadName("warp stage");
+
+    WarpMapCache warpCache;
+    cv::Mat gray(frameSize, CV_8UC1);
+    cv::Matx33d homography = cv::Matx33d::eye();
+
+    Backoff backoff;
+    while (running && *capturing)
+    {
+        if (!visibleFrames->update())
+        {
+            backoff.pause();
+            continue;
+        }
+        backoff.reset();
+
+        uint64_t startNs = traceNowNs();
+        if (homographies.update())
+            homography = homographies.readBuffer();
+        int x = offsetX.load(std::memory_order_relaxed);
+        int y = offsetY.load(std::memory_order_relaxed);
+
+        {
+            TRACE_SCOPE("visible gray");
+            cv::cvtColor(visibleFrames->readBuffer(), gray, cv::COLOR_BGR2GRAY);
+        }
+
+        // A header over the Matx, no copy
+        if (warpCache.update(cv::Mat(3, 3, CV_64F, homography.val), x, y, gray.size(), frameSize))
+        {
+            overlaps.writeBuffer() = warpCache.overlap();
+            overlaps.publish();
+        }
+
+        WarpedFrame &out = warpedQueue.writeBuffer();
+        {
+            TRACE_SCOPE("warp");
+            warpCache.apply(gray, out.warped);
+        }
+        out.overlap = warpCache.overlap();
+        out.homography = homography;
+        out.offsetX = x;
+        out.offsetY = y;
+        out.startNs = startNs;
+        warpedQueue.push();
+        warpedFrames.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void LivePipeline::blendStage()
+{
+    traceSetThreadName("blend stage");
+
+    bool haveColored = false, haveWarped = false;
+    Backoff backoff;
+    while (running && *capturing)
+    {
+        // Either side being new is a new blended frame, the other side's newest frame is reused
+        bool newColored = coloredQueue.update();
+        bool newWarped = warpedQueue.update();
+        haveColored |= newColored;
+        haveWarped |= newWarped;
+
+        if (!(newColored || newWarped) || !haveColored || !haveWarped)
+        {
+            backoff.pause();
+            continue;
+        }
+        backoff.reset();
+
+        const ColorizedFrame &ir = coloredQueue.readBuffer();
+        const WarpedFrame &visible = warpedQueue.readBuffer();
+        PipelineFrame &out = displayQueue.writeBuffer();
+        {
+            TRACE_SCOPE("blend");
+            blendIROverlay(ir.colored, visible.warped, out.blended, THRESHOLD_WEIGHT, WARPEDFRAME_WEIGHT, visible.overlap);
+        }
+        out.startNs = std::max(ir.startNs, visible.startNs);
+        out.index = blendedFrames.fetch_add(1, std::memory_order_relaxed) + 1;
+
+        // Cheap no-op unless the estimator is waiting for a pair, the frames are only valid until the next update()
+        if (estimator != nullptr)
+            estimator->submit(ir.colored, visible.warped, cv::Mat(3, 3, CV_64F, const_cast<double *>(visible.homography.val)),
+                              visible.offsetX, visible.offsetY);
+
+        displayQueue.push();
+    }
+}
+
+void LivePipeline::printStats(std::ostream &out) const
+{
+    auto queueStats = [&](const char *name, uint64_t pushed, uint64_t dropped, OverflowPolicy policy)
+    {
+        out << "  " << std::left << std::setw(8) << name << " queue : " << pushed << " queued, " << dropped << " dropped ("
+            << overflowPolicyName(policy) << ")" << std::endl;
+    };
+
+    out << "Pipeline : " << colorizedFrames << " colorized, " << warpedFrames << " warped, " << blendedFrames
+        << " blended, " << displayedFrames << " displayed" << std::endl;
+    queueStats("colored", coloredQueue.pushedCount(), coloredQueue.droppedCount(), coloredQueue.overflowPolicy());
+    queueStats("warped", warpedQueue.pushedCount(), warpedQueue.droppedCount(), warpedQueue.overflowPolicy());
+    queueStats("display", displayQueue.pushedCount(), displayQueue.droppedCount(), displayQueue.overflowPolicy());
+    if (displayedFrames > 0)
+    {
+        out << "  Latency to display : mean " << latencySumNs / displayedFrames / 1e6 << " ms, max "
+            << latencyMaxNs / 1e6 << " ms" << std::endl;
+    }
+}
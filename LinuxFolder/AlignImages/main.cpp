@@ -1,78 +1,46 @@
 #include <iostream>
 #include <opencv2/opencv.hpp>
 #include <vector>
-#include "yen_threshold.h"
+#include "ir_processing.h"
+#include "overlay.h"
+#include "warp_cache.h"
+#include "triple_buffer.h"
+#include "frame_sync.h"
+#include "raw_recording.h"
+#include "batch_processor.h"
+#include "bayer.h"
+#include "alloc_counter.h"
+#include "trace.h"
+#include "frame_stream.h"
+#include "shared_frame_ring.h"
+#include "offset_estimator.h"
+#include "calibration.h"
+#include "live_pipeline.h"
+#include "video_recorder.h"
+#include "dirty_tiles.h"
+#include "display_thread.h"
+#include "spsc_queue.h"
 #include <thread>
-#include <mutex>
 #include <atomic>
+#include <chrono>
+#include <stdexcept>
 #include <string>
 #include <fstream>
+#include <csignal>
+#include <cctype>
 
 #define NOIR_CAMERA 0
 #define VISIBLE_CAMERA 1
-#define CHESSBOARD_COLUMNS 9
-#define CHESSBOARD_ROWS 6
 #define LINE_THICKNESS 1
-#define NUMBER_OF_CALIBRATION_IMAGES 1
-#define CALIBRATION_DELAY 1000 // In milliseconds
-#define THRESHOLD_WEIGHT 0.4   // Increase to see more of the Yen Threshold Image
-#define WARPEDFRAME_WEIGHT 0.6
-#define ESC_KEY 27
 #define HORIZONTAL_RESOLUTION 640
 #define VERTICAL_RESOLUTION 480
+#define ALLOCATION_WARMUP_FRAMES 30 // Frames allowed to allocate before the allocation check kicks in
+#define STATIC_POLL_MS 10 // With ir.jpg / visible.jpg the loop only runs for homography.yml, the offsets and --auto-align
 
-std::mutex irMutex, visibleMutex;
 std::atomic<bool> captureFrames(true);
 
 using namespace cv;
 
-void remap_lut_threshold(cv::Mat &src, cv::Mat &dst, float k, int threshold, int &topkvalue)
-{
-    int histSize = 256;
-    float range[] = {0, 256};
-    const float *histRange = {range};
-    cv::Mat hist;
-    cv::calcHist(&src, 1, 0, cv::Mat(), hist, 1, &histSize, &histRange);
-
-    int high = 0;
-    int low = 0;
-    for (int i = 0; i < 256; i++)
-    {
-        if (hist.at<int>(i) != 0)
-        {
-            high = i;
-            if (low == 0)
-                low = i;
-        }
-    }
-    cv::Mat histCumulative = hist.clone();
-    for (int i = 1; i < histSize; i++)
-    {
-        histCumulative.at<float>(i) += histCumulative.at<float>(i - 1);
-    }
-    float abovePixels = histCumulative.at<float>(255) - histCumulative.at<float>(threshold);
-    float totalPixels = src.rows * src.cols;
-    topkvalue = 0;
-    for (int i = 0; i < histSize; i++)
-    {
-        if (histCumulative.at<float>(i) >= totalPixels - k * abovePixels)
-        {
-            topkvalue = i;
-            break;
-        }
-    }
-    cv::Mat lut(1, 256, CV_8U);
-    for (int i = 0; i <= 255; i++)
-    {
-        if (i > topkvalue)
-            lut.at<uchar>(0, i) = 255;
-        else if (i > threshold)
-            lut.at<uchar>(0, i) = 255.0 * (i - threshold) / (high - threshold);
-        else
-            lut.at<uchar>(0, i) = 0;
-    }
-    cv::LUT(src, lut, dst);
-}
 void frameInformation(std::string name, cv::Mat src)
 {
     // Extract depth and channels from the type
@@ -119,137 +87,360 @@ void frameInformation(std::string name, cv::Mat src)
               << std::endl;
 }
 
-cv::Mat ImgProc_YenThreshold(cv::Mat src, bool compressed, double &foundThresh)
-{
-    cv::Mat grey;
-
-    if (src.channels() != 1)
-    {
-        cv::cvtColor(src, grey, cv::COLOR_BGR2GRAY);
-    }
-    else
-        grey = src;
-    // Convert frame to grayscale
-    // cv::imshow("src", src);
-    // cv::waitKey(0);
-    // cv::imshow("grey", grey);
-
-    // Histogram constants
-    int bins = 256;
-    int histSize[] = {bins};
-    const float range[] = {0, 256};
-    const float *ranges[] = {range};
-    int channels[] = {0};
-
-    // Equalize
-    cv::Ptr<cv::CLAHE> clahe = cv::createCLAHE();
-    clahe->setClipLimit(2.7);
-    cv::Mat cl;
-    clahe->apply(grey, cl);
-
-    // Create histogram
-    cv::Mat hist;
-    cv::calcHist(&cl, 1, channels, cv::Mat(), hist, 1, histSize, ranges, true, false);
-
-    // Yen thresholding
-    int yen_threshold = Yen(hist);
-
-    // std::cout <<"yen_threshold : " << yen_threshold << std::endl;
-
-    // // Apply threshold and set transparency
-    // cv::Mat thresholded_(cl.size(), CV_8UC4); // Create 4-channel output
-    // for (int y = 0; y < cl.rows; y++) {
-    //     for (int x = 0; x < cl.cols; x++) {
-    //         uchar intensity = cl.at<uchar>(y, x);
-    //         cv::Vec4b &pixel = thresholded_.at<cv::Vec4b>(y, x);
-
-    //         if (intensity >= yen_threshold) {
-    //             pixel = cv::Vec4b(intensity, intensity, intensity, 255); // Fully opaque
-    //         } else {
-    //             pixel = cv::Vec4b(0, 0, 0, 0); // Fully transparent
-    //         }
-    //     }
-    // }
-
-    // Use yen_threshold set alpha to 0 or something like that
-    foundThresh = yen_threshold;
-
-    // Apply binary thresholding
-    cv::Mat thresholded;
-    if (compressed)
-    {
-        cv::threshold(cl, thresholded, double(yen_threshold), 255, cv::THRESH_BINARY);
-    }
-    else
-    {
-        cv::threshold(cl, thresholded, double(yen_threshold), 255, cv::THRESH_TOZERO);
-    }
 
-    return thresholded;
+// Preallocate every slot so cap.read() / cv::flip() reuse the same memory for the whole session
+void preallocateFrames(TripleBuffer<Mat> &frames)
+{
+    frames.forEach([](Mat &frame)
+                   { frame.create(VERTICAL_RESOLUTION, HORIZONTAL_RESOLUTION, CV_8UC3); });
 }
 
-void captureVisibleFrames(VideoCapture &cap, Mat &frame)
+void captureVisibleFrames(VideoCapture &cap, TripleBuffer<Mat> &frames)
 {
+    traceSetThreadName("visible capture");
+
     while (captureFrames)
     {
-        Mat tempFrame;
-        cap >> tempFrame;
+        TRACE_SCOPE("visible capture");
 
-        if (tempFrame.empty())
+        // Decode straight into the producer's private buffer, nothing is shared until publish()
+        Mat &frame = frames.writeBuffer();
+
+        if (!cap.read(frame) || frame.empty())
         {
             std::cerr << "Error: Couldn't read frame from visible camera" << std::endl;
             captureFrames = false;
             break;
         }
 
-        std::lock_guard<std::mutex> lock(visibleMutex);
-        frame = tempFrame;
+        frames.publish();
     }
 }
 
-void captureIRFrames(VideoCapture &cap, Mat &frame)
+void captureIRFrames(VideoCapture &cap, TripleBuffer<Mat> &frames)
 {
+    // Raw camera frame before flipping, reused every iteration
+    Mat tempFrame(VERTICAL_RESOLUTION, HORIZONTAL_RESOLUTION, CV_8UC3);
+
+    traceSetThreadName("ir capture");
+
     while (captureFrames)
     {
-        Mat tempFrame;
-        cap >> tempFrame;
+        TRACE_SCOPE("ir capture");
 
-        if (tempFrame.empty())
+        if (!cap.read(tempFrame) || tempFrame.empty())
         {
             std::cerr << "Error: Couldn't read frame from IR camera" << std::endl;
             captureFrames = false;
             break;
         }
 
-        cv::flip(tempFrame, tempFrame, 1);
+        cv::flip(tempFrame, frames.writeBuffer(), 1);
+        frames.publish();
+    }
+}
+
+bool openCamera(VideoCapture &cap, int cameraIndex)
+{
+    if (!cap.open(cameraIndex, cv::CAP_V4L2))
+    {
+        std::cerr << "Error: Couldn't open camera " << cameraIndex << std::endl;
+        return false;
+    }
+
+    cap.set(cv::CAP_PROP_FRAME_WIDTH, HORIZONTAL_RESOLUTION);
+    cap.set(cv::CAP_PROP_FRAME_HEIGHT, VERTICAL_RESOLUTION);
+    // Only the newest frame matters, don't let the driver queue up stale ones
+    cap.set(cv::CAP_PROP_BUFFERSIZE, 1);
+    return true;
+}
 
-        std::lock_guard<std::mutex> lock(irMutex);
-        frame = tempFrame;
+// Prints and applies an estimate picked up from the offset estimator
+void applyAlignment(const AlignmentEstimate &alignment, int &offsetX, int &offsetY, cv::Mat &homography)
+{
+    if (alignment.offsetX != offsetX || alignment.offsetY != offsetY || alignment.homographyValid)
+    {
+        std::cout << "Auto align : offset (" << alignment.offsetX << ", " << alignment.offsetY << ") response " << alignment.response;
+        if (alignment.homographyValid)
+            std::cout << " | homography refined, ECC " << alignment.correlation;
+        std::cout << std::endl;
     }
+    offsetX = alignment.offsetX;
+    offsetY = alignment.offsetY;
+    if (alignment.homographyValid)
+        cv::Mat(alignment.homography).copyTo(homography);
 }
 
-int main()
+// --headless : Ctrl-C / kill stop the loops the way ESC does, so the recorder and the stats still get to finish
+static void requestStop(int)
 {
+    captureFrames = false;
+}
+
+int main(int argc, char **argv)
+{
+    // --live : process the NOIR_CAMERA / VISIBLE_CAMERA streams instead of ir.jpg / visible.jpg
+    // --sync <irTimeStamps_N.txt> <visibleTimeStamps_N.txt> : pair a recording's frames by PTS and report the skew
+    // --raw <irCamera_N.raw> <visibleCamera_N.raw> [--frame K] : align frame K of a raw recording instead of ir.jpg / visible.jpg
+    // --batch <irInput> <visibleInput> <output> [--threads N] : overlay every frame of a recording (raw files or image folders)
+    // --raw-decode <full | half> : how --batch decodes raw recordings from the Bayer mosaic, half works on 1/2 size frames
+    // --ir-bits N : valid bits in 16 bit IR images (10 for a TIFF saved from the raw sensor), 0 = all 16. Raw recordings know their own
+    // --calibrate <irInput> <visibleInput> [--threads N] : fit homography.yml to chessboard image pairs (directories or glob patterns)
+    // --calibrate-live : same, with NUMBER_OF_CALIBRATION_IMAGES pairs grabbed from the cameras
+    // --offset X Y : start from these IR offsets instead of the hardcoded ones, --calibrate fits the homography for them
+    // --stream <tcp:host:port | unix:/path> : send every blended frame to DisplayProcessedImage --listen
+    // --shm [name] : publish every blended frame into a shared memory ring for DisplayProcessedImage --shm on this machine
+    // --codec <raw | qoi | delta> : how --stream frames are encoded, qoi / delta also make --batch write .qoi files instead of PNGs
+    // --auto-align : estimate the IR offsets in the background instead of tuning them with w/a/s/d
+    // --auto-align-homography : same, but also refine the homography itself (ECC) for cameras that tilt / rotate
+    // --ir-scale <1 | 2 | 4> : run CLAHE + the Yen threshold on a 1/2 or 1/4 size IR frame, the palette still applies at full resolution
+    // --ir-scale-output <full | reduced> : with reduced the palette applies at that size too and the colorized frame is upscaled (cheapest)
+    // --pipeline : with --live, run colorize, warp + blend and the display on their own threads (see live_pipeline.h)
+    // --queue-policy <colored | warped | display | all>=<block | drop-oldest | drop-newest> : what a full --pipeline queue does
+    // --queue-capacity N : frames each --pipeline queue holds
+    // --record <path> [--record-format mjpg|ffv1|raw] [--record-fps F] [--record-queue N] : record every blended frame
+    //   on a background thread (see video_recorder.h), frames are dropped rather than holding up the loop when it falls behind
+    // --incremental [tolerance] : with --live (without --pipeline), only redo the tiles that changed by more than tolerance
+    //   (mean 8 bit levels, DIRTY_TILE_TOLERANCE by default) and keep the Yen threshold until the histogram moves
+    // --headless : no window and no keyboard (nothing from HighGUI is called, make HEADLESS=1 doesn't even link it), for
+    //   servers and batch runs. The results go out through --stream / --shm / --record, the static images to FinalImage.PNG
+    // --no-trace : turn off the per stage tracing (t or kill -USR1 dumps trace_N.json + percentiles while it's on)
+    bool liveMode = false;
+    BatchOptions batchOptions;
+    bool offsetGiven = false;
+    int argOffsetX = 0, argOffsetY = 0;
+    std::string irRawPath, visibleRawPath;
+    int rawFrameIndex = 0;
+    std::string irTimestampPath, visibleTimestampPath;
+    double syncToleranceMs = SYNC_TOLERANCE_MS;
+    SyncPolicy syncPolicy = SyncPolicy::Drop;
+    std::string streamEndpoint;
+    std::string sharedRingName;
+    FrameCodec codec = FRAME_CODEC_RAW;
+    bool autoAlign = false, autoAlignHomography = false;
+    bool calibrate = false, calibrateLive = false;
+    std::string irCalibrationInput, visibleCalibrationInput;
+    int irAnalysisScale = 1;
+    IRAnalysisOutput irAnalysisOutput = IRAnalysisOutput::FullResolution;
+    bool usePipeline = false;
+    PipelineOptions pipelineOptions;
+    std::string recordPath;
+    RecordFormat recordFormat = RecordFormat::Mjpg;
+    double recordFps = RECORD_DEFAULT_FPS;
+    int recordQueueCapacity = RECORD_QUEUE_CAPACITY;
+    bool incremental = false;
+    int incrementalTolerance = DIRTY_TILE_TOLERANCE;
+#ifdef HEADLESS_BUILD
+    bool headless = true;
+#else
+    bool headless = false;
+#endif
+
+    auto printUsage = [&]()
+    {
+        std::cerr << "Usage : " << argv[0]
+                  << " [--live] [--raw <irCamera.raw> <visibleCamera.raw> [--frame K]]"
+                  << " [--batch <irInput> <visibleInput> <output> [--threads N] [--raw-decode full|half]] [--ir-bits N] [--offset X Y]"
+                  << " [--sync <irTimeStamps> <visibleTimeStamps>] [--sync-tolerance ms] [--sync-duplicate] [--stream endpoint] [--codec raw|qoi|delta] [--shm [name]]"
+                  << " [--calibrate <irInput> <visibleInput>] [--calibrate-live]"
+                  << " [--auto-align] [--auto-align-homography] [--ir-scale 1|2|4] [--ir-scale-output full|reduced]"
+                  << " [--pipeline [--queue-policy queue=block|drop-oldest|drop-newest] [--queue-capacity N]]"
+                  << " [--record <path> [--record-format mjpg|ffv1|raw] [--record-fps F] [--record-queue N]] [--incremental [tolerance]] [--headless] [--no-trace]" << std::endl;
+    };
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        try
+        {
+            if (arg == "--live")
+                liveMode = true;
+            else if (arg == "--sync" && i + 2 < argc)
+            {
+                irTimestampPath = argv[++i];
+                visibleTimestampPath = argv[++i];
+            }
+            else if (arg == "--raw" && i + 2 < argc)
+            {
+                irRawPath = argv[++i];
+                visibleRawPath = argv[++i];
+            }
+            else if (arg == "--batch" && i + 3 < argc)
+            {
+                batchOptions.irInput = argv[++i];
+                batchOptions.visibleInput = argv[++i];
+                batchOptions.output = argv[++i];
+            }
+            else if (arg == "--threads" && i + 1 < argc)
+                batchOptions.threads = std::stoi(argv[++i]);
+            else if (arg == "--offset" && i + 2 < argc)
+            {
+                offsetGiven = true;
+                argOffsetX = std::stoi(argv[++i]);
+                argOffsetY = std::stoi(argv[++i]);
+            }
+            else if (arg == "--frame" && i + 1 < argc)
+                rawFrameIndex = std::stoi(argv[++i]);
+            else if (arg == "--sync-tolerance" && i + 1 < argc)
+                syncToleranceMs = std::stod(argv[++i]);
+            else if (arg == "--sync-duplicate")
+                syncPolicy = SyncPolicy::Duplicate;
+            else if (arg == "--no-trace")
+                tracingEnabled = false;
+            else if (arg == "--stream" && i + 1 < argc)
+                streamEndpoint = argv[++i];
+            else if (arg == "--shm")
+                sharedRingName = i + 1 < argc && argv[i + 1][0] == '/' ? argv[++i] : SHARED_RING_DEFAULT_NAME;
+            else if (arg == "--codec" && i + 1 < argc && parseFrameCodec(argv[i + 1], codec))
+                i++;
+            else if (arg == "--calibrate" && i + 2 < argc)
+            {
+                calibrate = true;
+                irCalibrationInput = argv[++i];
+                visibleCalibrationInput = argv[++i];
+            }
+            else if (arg == "--calibrate-live")
+                calibrate = calibrateLive = true;
+            else if (arg == "--auto-align")
+                autoAlign = true;
+            else if (arg == "--auto-align-homography")
+                autoAlign = autoAlignHomography = true;
+            else if (arg == "--ir-scale" && i + 1 < argc)
+                irAnalysisScale = std::stoi(argv[++i]);
+            else if (arg == "--ir-scale-output" && i + 1 < argc && (std::string(argv[i + 1]) == "full" || std::string(argv[i + 1]) == "reduced"))
+                irAnalysisOutput = std::string(argv[++i]) == "reduced" ? IRAnalysisOutput::Reduced : IRAnalysisOutput::FullResolution;
+            else if (arg == "--raw-decode" && i + 1 < argc && parseRawDecode(argv[i + 1], batchOptions.rawDecode))
+                i++;
+            else if (arg == "--ir-bits" && i + 1 < argc)
+            {
+                batchOptions.irBitDepth = std::stoi(argv[++i]);
+                if (batchOptions.irBitDepth != 0 && (batchOptions.irBitDepth < 8 || batchOptions.irBitDepth > 16))
+                {
+                    std::cerr << "--ir-bits takes 8 to 16, or 0 for all 16" << std::endl;
+                    return -1;
+                }
+            }
+            else if (arg == "--pipeline")
+                usePipeline = true;
+            else if (arg == "--queue-capacity" && i + 1 < argc)
+                pipelineOptions.queueCapacity = std::stoi(argv[++i]);
+            else if (arg == "--queue-policy" && i + 1 < argc && parseQueuePolicy(argv[i + 1], pipelineOptions))
+                i++;
+            else if (arg == "--record" && i + 1 < argc)
+                recordPath = argv[++i];
+            else if (arg == "--record-format" && i + 1 < argc && parseRecordFormat(argv[i + 1], recordFormat))
+                i++;
+            else if (arg == "--record-fps" && i + 1 < argc)
+                recordFps = std::stod(argv[++i]);
+            else if (arg == "--record-queue" && i + 1 < argc)
+                recordQueueCapacity = std::stoi(argv[++i]);
+            else if (arg == "--headless")
+                headless = true;
+            else if (arg == "--incremental")
+            {
+                incremental = true;
+                if (i + 1 < argc && std::isdigit((unsigned char)argv[i + 1][0]))
+                    incrementalTolerance = std::stoi(argv[++i]);
+            }
+            else
+            {
+                std::cerr << "Unknown argument : " << arg << std::endl;
+                printUsage();
+                return -1;
+            }
+        }
+        catch (const std::logic_error &) // What std::stoi & co throw on a malformed value : invalid_argument / out_of_range
+        {
+            std::cerr << "Invalid value for " << arg << std::endl;
+            printUsage();
+            return -1;
+        }
+    }
+
+    traceSetThreadName("main");
+    traceInstallSignalHandler(SIGUSR1);
+    if (headless)
+    {
+        std::signal(SIGINT, requestStop);
+        std::signal(SIGTERM, requestStop);
+    }
+
+    // ------------------ [ FRAME SYNC REPORT ] ------------------ //
+    if (!irTimestampPath.empty())
+    {
+        std::vector<double> irTimestamps = loadTimestamps(irTimestampPath);
+        std::vector<double> visibleTimestamps = loadTimestamps(visibleTimestampPath);
+        if (irTimestamps.empty() || visibleTimestamps.empty())
+        {
+            const std::string &missing = irTimestamps.empty() ? irTimestampPath : visibleTimestampPath;
+            std::cerr << "No timestamps to pair, " << missing
+                      << (std::filesystem::exists(missing) ? " has none" : " doesn't exist") << std::endl;
+            return -1;
+        }
+
+        SyncStats syncStats;
+        std::vector<FramePair> pairs = pairRecordedFrames(irTimestamps, visibleTimestamps, syncToleranceMs, syncPolicy, syncStats);
+        std::cout << "IR frames : " << irTimestamps.size() << " | Visible frames : " << visibleTimestamps.size()
+                  << " | Tolerance : " << syncToleranceMs << " ms" << std::endl;
+        printSyncStats(syncStats);
+        return pairs.empty() ? -1 : 0;
+    }
+
     // ------------------ [ YAML STUFF ] ------------------ //
     std::string filename = "/root/CVG-Tietronix/ProfusionProject/LinuxFolder/AlignImages/homography.yml";
-    std::cout << "\nOpening YAML file at the following path : " << filename << std::endl;
 
-    // Open the file using FileStorage
-    cv::FileStorage fs(filename, cv::FileStorage::READ);
-    if (!fs.isOpened())
+    // Set translation values
+
+    // These offset values work on home laptop for Profusion study
+    // int offsetX = -45; // Negative values move the visible frame right | Positive values to the left
+    // int offsetY = 90;  // Negative values move the visible frame down | Positive values move it up
+
+    // Testing for streaming
+    // The visible frame is what moves (the offsets are part of its warp), the IR frame stays where the camera put it
+    int offsetX = 41; // Negative values move the visible frame right | Positive values to the left
+    int offsetY = -66;  // Negative values move the visible frame down | Positive values move it up
+
+    if (offsetGiven)
     {
-        std::cerr << "Failed to open " << filename << std::endl;
-        return -1;
+        offsetX = argOffsetX;
+        offsetY = argOffsetY;
     }
 
+    // ------------------ [ CHESSBOARD CALIBRATION ] ------------------ //
+    // The homography is fitted for the offsets above, so calibrate with the same --offset the loop runs with
+    // Writes homography.yml and exits, an alignImages that's already running picks the new file up on its own
+    if (calibrate)
+    {
+        std::vector<CalibrationPair> calibrationPairs;
+        if (calibrateLive)
+        {
+            VideoCapture irCalibrationCap, visibleCalibrationCap;
+            if (!openCamera(irCalibrationCap, NOIR_CAMERA) || !openCamera(visibleCalibrationCap, VISIBLE_CAMERA) ||
+                !captureCalibrationPairs(irCalibrationCap, visibleCalibrationCap, NUMBER_OF_CALIBRATION_IMAGES, calibrationPairs, !headless))
+                return -1;
+        }
+        else if (!listCalibrationPairs(irCalibrationInput, visibleCalibrationInput, calibrationPairs))
+        {
+            std::cerr << "No calibration images found" << std::endl;
+            return -1;
+        }
+
+        cv::Mat calibratedHomography;
+        if (!calibrateHomography(calibrationPairs, batchOptions.threads, offsetX, offsetY, calibratedHomography) ||
+            !saveHomography(filename, calibratedHomography))
+            return -1;
+
+        std::cout << "Wrote " << filename << std::endl;
+        return 0;
+    }
+
+    std::cout << "\nOpening YAML file at the following path : " << filename << std::endl;
+
     // Variables to store the matrices
     cv::Mat infraredToVisibleHomography, visibleToInfraredHomography;
 
     // Read the matrices from the file
-    fs["homography"] >> visibleToInfraredHomography;
-
-    // Close the file
-    fs.release();
+    visibleToInfraredHomography = loadHomography(filename);
 
     // Check if matrices are empty after reading from file
     if (visibleToInfraredHomography.empty())
@@ -258,35 +449,96 @@ int main()
         return -1;
     }
 
-    // ------------------ [ READ IMAGES ] ------------------ //
+    // Used to pick up a new homography.yml without restarting
+    std::filesystem::file_time_type homographyWriteTime = std::filesystem::last_write_time(filename);
+
+    // ------------------ [ OFFLINE BATCH MODE ] ------------------ //
+    if (!batchOptions.irInput.empty())
+    {
+        batchOptions.offsetX = offsetX;
+        batchOptions.offsetY = offsetY;
+        batchOptions.syncToleranceMs = syncToleranceMs;
+        batchOptions.syncPolicy = syncPolicy;
+        batchOptions.imageCodec = codec;
+        batchOptions.irAnalysisScale = irAnalysisScale;
+        batchOptions.irAnalysisOutput = irAnalysisOutput;
+        return runBatch(batchOptions, visibleToInfraredHomography);
+    }
 
-    std::string irImagePath = "/root/CVG-Tietronix/ProfusionProject/LinuxFolder/AlignImages/ir.jpg";
-    std::string visibleImagePath = "/root/CVG-Tietronix/ProfusionProject/LinuxFolder/AlignImages/visible.jpg";
+    cv::Mat irImage, visibleImage;
+    cv::Mat ColoredFrame;
 
-    cv::Mat irImage = cv::imread(irImagePath, cv::IMREAD_UNCHANGED);
-    cv::Mat visibleImage = cv::imread(visibleImagePath, cv::IMREAD_GRAYSCALE);
+    // Owns the CLAHE instance, histograms, LUTs and IR frames so the per frame processing doesn't allocate
+    IRProcessingContext irContext;
+    irContext.setAnalysisScale(irAnalysisScale, irAnalysisOutput);
+    irContext.setIncremental(incremental, incrementalTolerance);
+    int irBitDepth = batchOptions.irBitDepth; // Valid bits in 16 bit IR samples, 0 = all 16
 
-    if (irImage.empty() || visibleImage.empty())
+    // ------------------ [ START CAMERAS ] ------------------ //
+    VideoCapture irCap, visibleCap;
+    RawRecording irRecording, visibleRecording;
+    TripleBuffer<Mat> irFrames, visibleFrames;
+    std::thread irThread, visibleThread;
+
+    if (liveMode)
     {
-        std::cerr << "Could not open or find the images!" << std::endl;
-        return -1;
+        if (!openCamera(irCap, NOIR_CAMERA) || !openCamera(visibleCap, VISIBLE_CAMERA))
+            return -1;
+
+        preallocateFrames(irFrames);
+        preallocateFrames(visibleFrames);
+
+        // Grayscale visible frame and IR working frames for the processing side, sized once here
+        visibleImage.create(VERTICAL_RESOLUTION, HORIZONTAL_RESOLUTION, CV_8UC1);
+        irContext.allocate(cv::Size(HORIZONTAL_RESOLUTION, VERTICAL_RESOLUTION));
+
+        irThread = std::thread(captureIRFrames, std::ref(irCap), std::ref(irFrames));
+        visibleThread = std::thread(captureVisibleFrames, std::ref(visibleCap), std::ref(visibleFrames));
     }
+    else
+    {
+    // ------------------ [ READ IMAGES ] ------------------ //
 
-    // Normalize 16bit TIFF data to 8bit
-    if (irImage.depth() != CV_8U)
+    if (!irRawPath.empty())
     {
-        // std::cout << "Normalizing IR frame to 8-bits" << std::endl;
-        double minVal, maxVal;
-        cv::minMaxLoc(irImage, &minVal, &maxVal); // Get min and max pixel values
-        irImage.convertTo(irImage, CV_8U, 255.0 / (maxVal - minVal), -minVal * (255.0 / (maxVal - minVal)));
+        if (!irRecording.open(irRawPath) || !visibleRecording.open(visibleRawPath))
+            return -1;
 
-        if (irImage.empty())
+        if (rawFrameIndex < 0 || rawFrameIndex >= irRecording.frameCount())
         {
-            std::cerr << "Error: IR Image is empty after conversion!" << std::endl;
+            std::cerr << "Frame " << rawFrameIndex << " is out of range, " << irRawPath << " has " << irRecording.frameCount() << " frames" << std::endl;
             return -1;
         }
+
+        // Use the visible frame recorded closest in time to the IR frame when the PTS files are there
+        int visibleFrameIndex = std::min(rawFrameIndex, visibleRecording.frameCount() - 1);
+        if (irRecording.hasTimestamps() && visibleRecording.hasTimestamps())
+            visibleFrameIndex = visibleRecording.frameAtPts(irRecording.pts(rawFrameIndex));
+
+        std::cout << "Aligning IR frame " << rawFrameIndex << " with visible frame " << visibleFrameIndex << std::endl;
+
+        // Luminance straight from the Bayer mosaic, the IR frame stays 16 bit for the threshold
+        decodeRawFrame(irRecording.frame(rawFrameIndex), RAW_BIT_DEPTH, RawDecode::Full, CV_16U, irImage);
+        decodeRawFrame(visibleRecording.frame(visibleFrameIndex), RAW_BIT_DEPTH, RawDecode::Full, CV_8U, visibleImage);
+        irBitDepth = decodedBitDepth(RAW_BIT_DEPTH, RawDecode::Full);
     }
+    else
+    {
+        std::string irImagePath = "/root/CVG-Tietronix/ProfusionProject/LinuxFolder/AlignImages/ir.jpg";
+        std::string visibleImagePath = "/root/CVG-Tietronix/ProfusionProject/LinuxFolder/AlignImages/visible.jpg";
 
+        irImage = cv::imread(irImagePath, cv::IMREAD_UNCHANGED);
+        visibleImage = cv::imread(visibleImagePath, cv::IMREAD_GRAYSCALE);
+    }
+
+    if (irImage.empty() || visibleImage.empty())
+    {
+        std::cerr << "Could not open or find the images!" << std::endl;
+        return -1;
+    }
+
+    // 16 bit TIFF / raw IR frames stay at their native depth, colorize() thresholds them without going through 8 bit first
+    // Only the visible frame gets normalized, the blend wants it as 8 bit gray
     if (visibleImage.depth() != CV_8U)
     {
         // std::cout << "Normalizing Visible frame to 8-bits" << std::endl;
@@ -303,58 +555,267 @@ int main()
     //cv::imshow("irImage", irImage);
 
     // ------------------ [ APPLY THRESHOLDING ALGORITHM TO IR FRAME ] ------------------ //
-    double foundThresh;
-    cv::Mat processedFrame;
-    int remapMin = 0;
-
-    cv::Mat yenThresholdedFrame = ImgProc_YenThreshold(irImage, false, foundThresh);
-
-    remapMin = (int)foundThresh;
-    int topkvalue = 0;
-    remap_lut_threshold(yenThresholdedFrame, processedFrame, 0.1, remapMin, topkvalue);
-    // cv::imshow("Thresholded with Transparency", processedFrame);
-
-    cv::Ptr<cv::Mat> ColoredFrame;
-    ColoredFrame = cv::Ptr<cv::Mat>(new cv::Mat());
-    cv::applyColorMap(processedFrame, *ColoredFrame, cv::COLORMAP_JET);
-    // cv::imshow("ColoredFrame", *ColoredFrame);
-    std::vector<cv::Mat> channels;
-    cv::split(*ColoredFrame, channels);
-    std::vector<cv::Mat> chansToMerge = {channels[0], channels[1], channels[2], yenThresholdedFrame};
-    cv::merge(&chansToMerge[0], chansToMerge.size(), *ColoredFrame);
+    ColoredFrame = irContext.colorize(irImage, irBitDepth);
+    }
 
     //  ------------------ [ SET PHYSICAL OFFSET FOR IR FRAME ] ------------------ //
 
     cv::Mat visibleWarpedFrame, visibleToIRProjectedFrame;
-    // Set translation values
 
-    // These offset values work on home laptop for Profusion study
-    // int offsetX = -45; // Negative value moves left | Positive values to the right
-    // int offsetY = 90;  // Negative values moves up | Positive values move down
+    // Homography + translation are baked into one set of remap tables, rebuilt only when either changes
+    WarpMapCache visibleWarpCache;
+    cv::Rect colorizedOverlap; // The overlap ColoredFrame was colorized over, empty = the whole frame
+    int frameCount = 0;
+    int traceDumps = 0;
+
+    // Replaces writing a PNG and scp'ing it to the Pi, the display keeps up with every frame
+    // Connecting (and reconnecting after the display went away) happens on the stream thread, never in the loops below
+    FrameStreamThread frameStream;
+    if (!streamEndpoint.empty())
+        frameStream.start(streamEndpoint, codec);
+
+    // Same machine display : the blend renders straight into a shared memory slot, the viewer maps it without a copy
+    SharedFrameWriter sharedFrames;
+    if (!sharedRingName.empty())
+        sharedFrames.open(sharedRingName);
+
+    // Keeps the offsets (and with --auto-align-homography the homography) tracking the cameras without anyone at the keyboard
+    // w/a/s/d still work, but the estimator pulls the overlay back to what it measures
+    OffsetEstimator offsetEstimator;
+    AlignmentEstimate alignment;
+    if (autoAlign)
+        offsetEstimator.start(autoAlignHomography);
+
+    // Replaces saving FinalImage.PNG, the whole session goes to a video file without the loop waiting on the encoder
+    // The blended frames are always BGRA and the size of the IR frame
+    VideoRecorder recorder;
+    if (!recordPath.empty())
+    {
+        cv::Size recordSize = liveMode ? cv::Size(HORIZONTAL_RESOLUTION, VERTICAL_RESOLUTION) : ColoredFrame.size();
+        if (!recorder.open(recordPath, recordFormat, recordFps, recordSize, CV_8UC4, recordQueueCapacity))
+            return -1;
+    }
 
-    // Testing for streaming
-    int offsetX = 41; // Negative value moves left | Positive values to the right
-    int offsetY = -66;  // Negative values moves up | Positive values move down
+    // imshow() and waitKey() run on the display thread, the loops below hand it frames and poll it for keys
+    DisplayThread display;
+    if (!headless && !display.start(DISPLAY_WINDOW_NAME, offsetX, offsetY))
+        return -1;
+
+    // ------------------ [ PIPELINED LIVE LOOP ] ------------------ //
+    // The stages run on their own threads, this thread only hands the blended frames on and picks up the keys
+    if (liveMode && usePipeline)
+    {
+        if (incremental)
+            std::cout << "--incremental only applies to the live loop without --pipeline, ignoring it" << std::endl;
+        pipelineOptions.irAnalysisScale = irAnalysisScale;
+        pipelineOptions.irAnalysisOutput = irAnalysisOutput;
+        LivePipeline pipeline(pipelineOptions, cv::Size(HORIZONTAL_RESOLUTION, VERTICAL_RESOLUTION));
+        pipeline.start(irFrames, visibleFrames, captureFrames, visibleToInfraredHomography, offsetX, offsetY,
+                       autoAlign ? &offsetEstimator : nullptr);
+
+        // Nothing paces this loop anymore, it waits for the blend stage with the same backoff as the stages
+        Backoff backoff;
+        while (captureFrames)
+        {
+            bool newFrame = pipeline.update();
+            if (newFrame)
+            {
+                const cv::Mat &blended = pipeline.frame().blended;
+                display.show(blended);
+
+                // The blend stage owns its output frames, so --shm gets a copy here instead of being blended into
+                if (sharedFrames.isOpen() && sharedFrames.acquire(blended.size(), CV_8UC4, visibleToIRProjectedFrame))
+                {
+                    blended.copyTo(visibleToIRProjectedFrame);
+                    sharedFrames.publish();
+                }
+
+                frameStream.send(blended);
+
+                recorder.record(blended);
+
+                if (++frameCount % 30 == 0)
+                {
+                    if (reloadHomographyIfChanged(filename, homographyWriteTime, visibleToInfraredHomography))
+                        pipeline.setHomography(visibleToInfraredHomography);
+                }
+            }
+
+            if (offsetEstimator.poll(alignment))
+            {
+                applyAlignment(alignment, offsetX, offsetY, visibleToInfraredHomography);
+                pipeline.setOffsets(offsetX, offsetY);
+                display.setOffsets(offsetX, offsetY);
+                if (alignment.homographyValid)
+                    pipeline.setHomography(visibleToInfraredHomography);
+            }
+
+            if (display.traceRequested() || traceDumpRequested())
+                traceDumpReport("trace_" + std::to_string(++traceDumps) + ".json", std::cout);
+            if (display.quitRequested())
+                break;
+            if (display.pollOffsets(offsetX, offsetY))
+                pipeline.setOffsets(offsetX, offsetY);
+
+            if (newFrame)
+                backoff.reset();
+            else
+                backoff.pause();
+        }
+
+        pipeline.stop();
+        pipeline.printStats(std::cout);
+        if (display.isRunning())
+        {
+            display.stop();
+            display.printStats(std::cout);
+        }
+        if (recorder.isOpen())
+        {
+            recorder.close();
+            recorder.printStats(std::cout);
+        }
+        offsetEstimator.stop();
+        captureFrames = false;
+        irThread.join();
+        visibleThread.join();
+        return 0;
+    }
+
+    // --incremental : the visible frame as it was last warped, and the tiles each step redid this frame
+    cv::Mat visibleReference;
+    DirtyTiles visibleTiles, warpedTiles, blendTiles;
+    uint64_t incrementalFrames = 0, idleFrames = 0, colorizedTiles = 0, warpedTileCount = 0, blendedTiles = 0;
+
+    // The live loop waits for the cameras instead of on waitKey()
+    Backoff cameraBackoff;
 
     // START WHILE LOOP HERE
     while(true)
     {
-    cv::Mat translationMatrix = (cv::Mat_<double>(2, 3) << 1, 0, offsetX, 0, 1, offsetY);
+    TRACE_SCOPE("frame");
 
-    cv::Mat translatedIRFrameColored;
-    // void cv::warpAffine(cv::InputArray src, cv::OutputArray dst, cv::InputArray M, cv::Size dsize, int flags = 1, int borderMode = 0, const cv::Scalar &borderValue = cv::Scalar())
+    // Checking the file timestamp every frame is wasted syscalls, about once a second is plenty
+    if (++frameCount % 30 == 0)
+    {
+        reloadHomographyIfChanged(filename, homographyWriteTime, visibleToInfraredHomography);
+    }
+
+    // Debug builds check that the processing below stops allocating once it's warmed up
+    // Rebuilding the warp maps is allowed to allocate, so those frames aren't checked
+    size_t allocationsBefore = allocationCount();
+    bool mapsRebuilt = false;
+
+    // Set whenever something that feeds the blended frame changed, nothing gets redrawn otherwise
+    bool irChanged = false;
+    bool visibleChanged = false;
+    bool newFrames = false;
+    blendTiles.clear();
+
+    if (liveMode)
+    {
+        // A capture thread stops on its own if its camera fails
+        if (!captureFrames)
+            break;
+
+        // Always grab the newest frame from each camera, the capture threads never wait on us
+        if (irFrames.update())
+        {
+            colorizedOverlap = visibleWarpCache.overlap();
+            ColoredFrame = irContext.colorize(irFrames.readBuffer(), 0, colorizedOverlap);
+            newFrames = true;
+
+            // --incremental : a frame within the tolerance of the last one leaves the colored frame as it was
+            irChanged = !incremental || irContext.changedTiles().count() > 0;
+        }
+        if (visibleFrames.update())
+        {
+            TRACE_SCOPE("visible gray");
+            cv::cvtColor(visibleFrames.readBuffer(), visibleImage, cv::COLOR_BGR2GRAY);
+            visibleChanged = newFrames = true;
+
+            // The warp reads visibleReference, which only takes the tiles that moved past the tolerance
+            if (incremental)
+            {
+                if (visibleReference.size() != visibleImage.size())
+                {
+                    visibleImage.copyTo(visibleReference);
+                    visibleTiles.reset(visibleImage.size());
+                }
+                else
+                {
+                    visibleTiles.clear();
+                    visibleChanged = updateReferenceTiles(visibleImage, visibleReference, cv::Point(), incrementalTolerance, visibleTiles) > 0;
+                }
+            }
+        }
+    }
+    else if (frameCount == 1)
+    {
+        irChanged = true;
+    }
+
+    // Whatever the estimator published since the last frame, picking it up is just an index swap
+    if (offsetEstimator.poll(alignment))
+    {
+        applyAlignment(alignment, offsetX, offsetY, visibleToInfraredHomography);
+        display.setOffsets(offsetX, offsetY);
+    }
 
-    // Move translationMatrix to align with visible frame
-    cv::warpAffine(*ColoredFrame, translatedIRFrameColored, translationMatrix, irImage.size());
+    // The visible frame is warped straight into the IR frame's coordinates so the IR frame doesn't have to be translated
+    // With the static images the remap only runs when the maps were rebuilt (new homography or WASD offsets)
+    if (!ColoredFrame.empty())
+        mapsRebuilt = visibleWarpCache.update(visibleToInfraredHomography, offsetX, offsetY, visibleImage.size(), ColoredFrame.size());
 
-    // Apply homography to visibleImage
-    cv::warpPerspective(visibleImage, visibleWarpedFrame, visibleToInfraredHomography, visibleImage.size());
+    // New offsets / homography move the overlap, the IR frame is colorized over it again (static images have no next frame)
+    if (mapsRebuilt && visibleWarpCache.overlap() != colorizedOverlap)
+    {
+        colorizedOverlap = visibleWarpCache.overlap();
+        ColoredFrame = liveMode ? irContext.colorize(irFrames.readBuffer(), 0, colorizedOverlap)
+                                : irContext.colorize(irImage, irBitDepth, colorizedOverlap);
+        irChanged = true;
+    }
 
-    // Needed since ColoredMap is 4 channels while visibleWarpedFrame before cvtColor() is grayscale (One channel) and addWeighted() needs both frames to have the same number of channels
-    // std::cout << "Chagning visibleWarpedFrame channels  " << std::endl;
+    // With --incremental the remap only covers the tiles whose source moved, unless the maps themselves changed
+    const cv::Mat &warpSource = incremental && liveMode ? visibleReference : visibleImage;
+    bool warpedAll = false;
+    if (incremental && !ColoredFrame.empty() && blendTiles.frameSize() != ColoredFrame.size())
+    {
+        blendTiles.reset(ColoredFrame.size());
+        warpedTiles.reset(ColoredFrame.size());
+    }
+    if (!visibleWarpCache.empty() && (mapsRebuilt || visibleChanged))
+    {
+        TRACE_SCOPE("warp");
+        if (incremental && liveMode && !mapsRebuilt && !visibleWarpedFrame.empty())
+        {
+            warpedTiles.clear();
+            visibleChanged = visibleWarpCache.applyTiles(warpSource, visibleWarpedFrame, visibleTiles, warpedTiles) > 0;
+            blendTiles.merge(warpedTiles);
+            warpedTileCount += warpedTiles.count();
+        }
+        else
+        {
+            visibleWarpCache.apply(warpSource, visibleWarpedFrame);
+            visibleChanged = warpedAll = true;
+            warpedTileCount += blendTiles.total();
+        }
+    }
+    if (incremental && irChanged)
+    {
+        blendTiles.merge(irContext.changedTiles());
+        colorizedTiles += irContext.changedTiles().count();
+    }
+    if (incremental && liveMode && newFrames)
+    {
+        incrementalFrames++;
+        idleFrames += !irChanged && !visibleChanged;
+    }
 
-    visibleWarpedFrame.convertTo(visibleWarpedFrame, (*ColoredFrame).type());
-    cv::cvtColor(visibleWarpedFrame, visibleWarpedFrame, cv::COLOR_GRAY2BGRA);
+    // Both cameras need to have delivered at least one frame before there's anything to blend
+    if ((irChanged || visibleChanged) && !visibleWarpedFrame.empty())
+    {
+    cv::Mat &translatedIRFrameColored = ColoredFrame;
 
     // Used for a sanity check to determine a particular pixel value after COLORJET was applied to the image
     //cv::Mat debugPixel;
@@ -362,10 +823,10 @@ int main()
     //std::cout << "Pixel value at (x, y): " << debugPixel.at<Vec4b>(400, 400) << std::endl;
 
     // Draw a circle to indicate what point was sampled
-    cv::Point center(400, 400);    // Center of the circle
-    int radius = 10;               // Radius of the circle
-    cv::Scalar color(255, 255, 0); // Color (blue in this case)
-    int thickness = 2;             // Thickness of the circle outline
+    // cv::Point center(400, 400);    // Center of the circle
+    // int radius = 10;               // Radius of the circle
+    // cv::Scalar color(255, 255, 0); // Color (blue in this case)
+    // int thickness = 2;             // Thickness of the circle outline
 
     // cv::circle(translatedIRFrameColored, center, radius, color, thickness);
     //  cv::resize(translatedIRFrameColored,translatedIRFrameColored,(cv::Size(640,480)));
@@ -373,65 +834,124 @@ int main()
 
     // frameInformation("translatedIRFrameColored", translatedIRFrameColored);
 
-    cv::Mat mask;
-    std::vector<cv::Mat> irChannels;
+    // Blend the premultiplied IR frame (cold pixels already have alpha 0) with the visible frame in one pass
+    // blendIROverlay() reads the grayscale visibleWarpedFrame directly, so no GRAY2BGRA conversion is needed
+    {
+        TRACE_SCOPE("blend");
 
-    // Split the channels of the 4-channel image
-    cv::split(translatedIRFrameColored, irChannels);
+        // With --shm visibleToIRProjectedFrame becomes a view of the next ring slot, otherwise it's a normal frame
+        bool toSharedRing = sharedFrames.isOpen() &&
+                            sharedFrames.acquire(translatedIRFrameColored.size(), CV_8UC4, visibleToIRProjectedFrame);
 
-    // Define the range for blue pixels
-    // cv::Scalar(BGRA)
-    cv::inRange(translatedIRFrameColored, cv::Scalar(100, 0, 0, 0), cv::Scalar(255, 100, 100, 255), mask);
+        // --incremental : only the tiles colorize() or the warp changed, on top of the last blended frame
+        // A ring slot holds whatever was blended into it a few frames ago, so --shm always gets the whole frame
+        if (incremental && !toSharedRing && !warpedAll && !visibleToIRProjectedFrame.empty())
+        {
+            blendTiles.forEachRun([&](const cv::Rect &run)
+                                  { blendIROverlayRegion(translatedIRFrameColored, visibleWarpedFrame, visibleToIRProjectedFrame,
+                                                         THRESHOLD_WEIGHT, WARPEDFRAME_WEIGHT, run); },
+                                  colorizedOverlap);
+            blendedTiles += blendTiles.count();
+        }
+        else
+        {
+            // Only the overlap is blended, the border only the IR camera covers is filled black
+            blendIROverlay(translatedIRFrameColored, visibleWarpedFrame, visibleToIRProjectedFrame, THRESHOLD_WEIGHT, WARPEDFRAME_WEIGHT,
+                           colorizedOverlap);
+            blendedTiles += blendTiles.total();
+        }
 
-    // Set the alpha channel to 0 where the mask is true
-    irChannels[3].setTo(0, mask);
+        if (toSharedRing)
+            sharedFrames.publish();
+    }
 
-    // Set RGB channels to 0 (black) where the mask is true
-    for (int c = 0; c < 3; c++)
+    size_t frameAllocations = allocationCount() - allocationsBefore;
+    if (allocationCounterEnabled() && frameCount > ALLOCATION_WARMUP_FRAMES && !mapsRebuilt && frameAllocations != 0)
     {
-        irChannels[c].setTo(0, mask);
+        std::cerr << "Warning : " << frameAllocations << " heap allocations while processing frame " << frameCount << std::endl;
     }
 
-    // Merge the channels back into the original image
-    cv::merge(irChannels, translatedIRFrameColored);
-
-    // Blend the translated IR frame with the visible frame
-    // void cv::addWeighted(cv::InputArray src1, double alpha, cv::InputArray src2, double beta, double gamma, cv::OutputArray dst, int dtype = -1)
-    cv::addWeighted(translatedIRFrameColored, THRESHOLD_WEIGHT, visibleWarpedFrame, WARPEDFRAME_WEIGHT, 0, visibleToIRProjectedFrame);
-
     //  ------------------ [ DISPLAY/WRITE  ] ------------------ //
 
     // cv::Mat displayWarpedImage;
 
-    cv::imshow("visibleToIRProjectedFrame", visibleToIRProjectedFrame);
+    // A copy into the display thread's mailbox, the window is drawn on its own thread
+    display.show(visibleToIRProjectedFrame);
 
+    // A copy into the stream thread's mailbox, encoding and sending happen on its own thread
+    frameStream.send(visibleToIRProjectedFrame);
 
-    int key = cv::waitKey(10);
-    if (key == 27) break;              // ESC to exit
-    else if (key == 'w') offsetY -= 1; // Move IR image up
-    else if (key == 's') offsetY += 1; // Move IR image down
-    else if (key == 'a') offsetX -= 1; // Move IR image left
-    else if (key == 'd') offsetX += 1; // Move IR image right
-    else if (key == 'x') {
-    std::ofstream out("offset.txt");
-    if (out.is_open()) {
-        out << offsetX << " " << offsetY << "\n";
-        std::cout << "Saved offset: (" << offsetX << ", " << offsetY << ")\n";
-        out.close();
-    } else {
-        std::cerr << "Failed to write to offset.txt\n";
+    // A copy into the recorder's queue, the encoding happens on its own thread
+    recorder.record(visibleToIRProjectedFrame);
     }
 
+    // Only copies the pair when the estimator is ready for one (every AUTO_ALIGN_INTERVAL_MS), a no-op otherwise
+    // Offered every frame so the static images get re-estimated too, until two estimates in a row agree
+    if (offsetEstimator.running() && !ColoredFrame.empty() && !visibleWarpedFrame.empty())
+        offsetEstimator.submit(ColoredFrame, visibleWarpedFrame, visibleToInfraredHomography, offsetX, offsetY);
+
+    // t or SIGUSR1 : dump the last few seconds of spans (the frame that writes it will show up as a slow one)
+    if (display.traceRequested() || traceDumpRequested())
+        traceDumpReport("trace_" + std::to_string(++traceDumps) + ".json", std::cout);
+
+    if (display.quitRequested() || !captureFrames) break; // ESC (or Ctrl-C with --headless) to exit
+    display.pollOffsets(offsetX, offsetY);
+
+    if (liveMode)
+    {
+        if (newFrames)
+            cameraBackoff.reset();
+        else
+            cameraBackoff.pause();
+    }
+    else if (headless && !offsetEstimator.running())
+    {
+        // Nobody can press a key, so with the images blended once there's nothing left to do
+        break;
+    }
+    else
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(STATIC_POLL_MS));
     }
-    
 }
-    // cv::imshow("Mask", mask);
 
-    //   Save the final blended image
-    //cv::imwrite("FinalImage.PNG", visibleToIRProjectedFrame);
+    offsetEstimator.stop();
+
+    if (display.isRunning())
+    {
+        display.stop();
+        display.printStats(std::cout);
+    }
 
-    cv::destroyAllWindows();
-    //cv::waitKey(0);
+    if (incremental && incrementalFrames > 0 && blendTiles.total() > 0)
+    {
+        double tiles = (double)incrementalFrames * blendTiles.total() / 100.0;
+        std::cout << "Incremental : " << incrementalFrames << " frames, " << idleFrames << " with nothing to redo | tiles per frame : "
+                  << colorizedTiles / tiles << "% recolored, " << warpedTileCount / tiles << "% warped, "
+                  << blendedTiles / tiles << "% blended | palette built " << irContext.paletteBuilds() << " times" << std::endl;
+    }
+
+    if (recorder.isOpen())
+    {
+        recorder.close();
+        recorder.printStats(std::cout);
+    }
+
+    if (liveMode)
+    {
+        captureFrames = false;
+        irThread.join();
+        visibleThread.join();
+    }
+
+    // Save the final blended image, with --headless there was no window to see it in
+    if (headless && !liveMode && !visibleToIRProjectedFrame.empty())
+    {
+        if (cv::imwrite("FinalImage.PNG", visibleToIRProjectedFrame))
+            std::cout << "Wrote FinalImage.PNG" << std::endl;
+        else
+            std::cerr << "Failed to write FinalImage.PNG" << std::endl;
+    }
 
 
     return 0;
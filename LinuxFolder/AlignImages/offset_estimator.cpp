@@ -0,0 +1,197 @@
+#include "offset_estimator.h"
+#include "alloc_counter.h"
+#include "trace.h"
+
+#include <opencv2/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+OffsetEstimator::~OffsetEstimator()
+{
+    stop();
+}
+
+void OffsetEstimator::start(bool estimateHomography)
+{
+    stop();
+    withHomography = estimateHomography;
+    havePrevious = false;
+    stopRequested = false;
+    worker = std::thread(&OffsetEstimator::run, this);
+}
+
+void OffsetEstimator::stop()
+{
+    if (!worker.joinable())
+        return;
+    stopRequested = true;
+    worker.join();
+    wantFrame = false;
+}
+
+void OffsetEstimator::submit(const cv::Mat &irColored, const cv::Mat &visibleWarped, const cv::Mat &homography, int offsetX, int offsetY)
+{
+    // Only one frame pair per request, the copies below are all the frame loop ever pays for
+    if (!wantFrame.load(std::memory_order_relaxed) || !wantFrame.exchange(false, std::memory_order_acquire))
+        return;
+
+    Job &job = jobs.writeBuffer();
+    cv::cvtColor(irColored, job.ir, irColored.channels() == 4 ? cv::COLOR_BGRA2GRAY : cv::COLOR_BGR2GRAY);
+    visibleWarped.copyTo(job.visible);
+    for (int r = 0; r < 3; r++)
+        for (int c = 0; c < 3; c++)
+            job.homography(r, c) = homography.depth() == CV_64F ? homography.at<double>(r, c) : homography.at<float>(r, c);
+    job.offsetX = offsetX;
+    job.offsetY = offsetY;
+    jobs.publish();
+}
+
+bool OffsetEstimator::poll(AlignmentEstimate &estimate)
+{
+    if (!estimates.update())
+        return false;
+    estimate = estimates.readBuffer();
+    return true;
+}
+
+void OffsetEstimator::run()
+{
+    traceSetThreadName("offset estimator");
+
+    // Everything in here allocates freely, that's fine off the frame loop
+    ignoreThreadAllocations();
+
+    // Per thread nice value on Linux, so only this thread gets deprioritized
+    if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), AUTO_ALIGN_NICE) != 0)
+        std::cerr << "Could not lower the offset estimator's priority" << std::endl;
+
+    wantFrame = true;
+    while (!stopRequested)
+    {
+        if (!jobs.update())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+
+        {
+            TRACE_SCOPE("auto align");
+            AlignmentEstimate &result = estimates.writeBuffer();
+            if (estimate(jobs.readBuffer(), result))
+                estimates.publish();
+        }
+
+        // Reduced rate, the cameras don't move often and the frame loop gets the cores in between
+        auto resume = std::chrono::steady_clock::now() + std::chrono::milliseconds(AUTO_ALIGN_INTERVAL_MS);
+        while (!stopRequested && std::chrono::steady_clock::now() < resume)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        wantFrame = true;
+    }
+}
+
+// Edges are what IR and visible frames have in common
+static void gradientMagnitude(const cv::Mat &src, cv::Mat &dst)
+{
+    cv::Mat dx, dy;
+    cv::Sobel(src, dx, CV_32F, 1, 0, 3);
+    cv::Sobel(src, dy, CV_32F, 0, 1, 3);
+    cv::magnitude(dx, dy, dst);
+}
+
+bool OffsetEstimator::estimate(const Job &job, AlignmentEstimate &result)
+{
+    std::vector<cv::Mat> irPyramid, visiblePyramid;
+    cv::buildPyramid(job.ir, irPyramid, AUTO_ALIGN_PYRAMID_LEVELS - 1);
+    cv::buildPyramid(job.visible, visiblePyramid, AUTO_ALIGN_PYRAMID_LEVELS - 1);
+
+    std::vector<cv::Mat> irEdges(AUTO_ALIGN_PYRAMID_LEVELS), visibleEdges(AUTO_ALIGN_PYRAMID_LEVELS), valid(AUTO_ALIGN_PYRAMID_LEVELS);
+    for (int level = 0; level < AUTO_ALIGN_PYRAMID_LEVELS; level++)
+    {
+        gradientMagnitude(irPyramid[level], irEdges[level]);
+        gradientMagnitude(visiblePyramid[level], visibleEdges[level]);
+
+        // The black border the warp leaves around the visible frame would be the strongest edge of all and pin
+        // the match at the current offsets, so edges near it don't count
+        valid[level] = visiblePyramid[level] > 0;
+        cv::erode(valid[level], valid[level], cv::Mat(), cv::Point(-1, -1), 2);
+        visibleEdges[level].setTo(0, valid[level] == 0);
+    }
+
+    // Coarse to fine : each level only measures the shift that's left after the coarser levels' estimate
+    cv::Point2d shift(0, 0);
+    double response = 0;
+    cv::Mat window, shifted;
+    for (int level = AUTO_ALIGN_PYRAMID_LEVELS - 1; level >= 0; level--)
+    {
+        double scale = 1.0 / (1 << level);
+        cv::Matx23d undo(1, 0, -shift.x * scale,
+                         0, 1, -shift.y * scale);
+        cv::warpAffine(visibleEdges[level], shifted, undo, visibleEdges[level].size());
+
+        cv::createHanningWindow(window, irEdges[level].size(), CV_32F);
+        shift += cv::phaseCorrelate(irEdges[level], shifted, window, &response) / scale;
+    }
+
+    // The visible frame sits shifted by +shift relative to the IR frame, bigger offsets move it back
+    cv::Point2d target(job.offsetX + shift.x, job.offsetY + shift.y);
+    bool confident = response >= AUTO_ALIGN_MIN_RESPONSE && std::abs(shift.x) <= AUTO_ALIGN_MAX_STEP && std::abs(shift.y) <= AUTO_ALIGN_MAX_STEP;
+    bool stable = havePrevious && cv::norm(target - previousTarget) <= AUTO_ALIGN_STABLE_PIXELS;
+    havePrevious = confident;
+    previousTarget = target;
+
+    // A single lucky (or unlucky) match doesn't move the overlay, it has to be repeated first
+    if (!confident || !stable)
+        return false;
+
+    result.offsetX = cvRound(target.x);
+    result.offsetY = cvRound(target.y);
+    result.response = response;
+    result.homographyValid = false;
+    result.correlation = 0;
+
+    if (withHomography)
+    {
+        // ECC at 1/2 resolution, starting from the translation that was just found
+        int level = std::min(1, AUTO_ALIGN_PYRAMID_LEVELS - 1);
+        double scale = 1.0 / (1 << level);
+        cv::Mat warp = (cv::Mat_<float>(3, 3) << 1, 0, shift.x * scale, 0, 1, shift.y * scale, 0, 0, 1);
+        try
+        {
+            result.correlation = cv::findTransformECC(irEdges[level], visibleEdges[level], warp, cv::MOTION_HOMOGRAPHY,
+                                                      cv::TermCriteria(cv::TermCriteria::COUNT | cv::TermCriteria::EPS, AUTO_ALIGN_ECC_ITERATIONS, AUTO_ALIGN_ECC_EPSILON),
+                                                      valid[level], 5);
+        }
+        catch (const cv::Exception &)
+        {
+            // ECC throws when it doesn't converge, the translation alone is still good
+            result.correlation = 0;
+        }
+
+        if (result.correlation >= AUTO_ALIGN_ECC_MIN_CORRELATION)
+        {
+            // warp maps IR pixels into the warped visible frame : undo it inside the offset translation the maps apply,
+            // so the offsets stay where they were and the homography carries the whole correction
+            cv::Matx33d W = cv::Matx33f(warp);
+            cv::Matx33d S(scale, 0, 0, 0, scale, 0, 0, 0, 1);
+            cv::Matx33d fullW = S.inv() * W * S;
+            cv::Matx33d T(1, 0, -job.offsetX, 0, 1, -job.offsetY, 0, 0, 1);
+            cv::Matx33d H = T.inv() * fullW.inv() * T * job.homography;
+
+            result.homography = H * (1.0 / H(2, 2));
+            result.homographyValid = true;
+            result.offsetX = job.offsetX;
+            result.offsetY = job.offsetY;
+        }
+    }
+
+    result.count = ++published;
+    return true;
+}
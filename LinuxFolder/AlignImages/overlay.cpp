@@ -0,0 +1,98 @@
+#include "overlay.h"
+
+#include <opencv2/core/utility.hpp>
+
+void fillOutside(cv::Mat &frame, const cv::Rect &inside, const cv::Scalar &value)
+{
+    cv::Rect area = inside & cv::Rect(0, 0, frame.cols, frame.rows);
+    if (area.empty())
+    {
+        frame.setTo(value);
+        return;
+    }
+
+    frame.rowRange(0, area.y).setTo(value);
+    frame.rowRange(area.y + area.height, frame.rows).setTo(value);
+
+    cv::Mat band = frame.rowRange(area.y, area.y + area.height);
+    band.colRange(0, area.x).setTo(value);
+    band.colRange(area.x + area.width, frame.cols).setTo(value);
+}
+
+void blendIROverlay(const cv::Mat &irPremultiplied, const cv::Mat &visibleGray, cv::Mat &dst,
+                    double irWeight, double visibleWeight, const cv::Rect &overlap)
+{
+    CV_Assert(irPremultiplied.type() == CV_8UC4 && visibleGray.type() == CV_8UC1);
+    CV_Assert(irPremultiplied.size() == visibleGray.size());
+
+    dst.create(irPremultiplied.size(), CV_8UC4);
+
+    // Outside the overlap there's no visible frame to blend with, the border gets a plain fill instead
+    const cv::Rect frame(0, 0, dst.cols, dst.rows);
+    const cv::Rect clipped = overlap & frame;
+    const cv::Rect area = clipped.empty() ? frame : clipped;
+    if (area != frame)
+        fillOutside(dst, area, cv::Scalar(0, 0, 0, 255));
+
+    blendIROverlayRegion(irPremultiplied, visibleGray, dst, irWeight, visibleWeight, area);
+}
+
+void blendIROverlayRegion(const cv::Mat &irPremultiplied, const cv::Mat &visibleGray, cv::Mat &dst,
+                          double irWeight, double visibleWeight, const cv::Rect &region)
+{
+    CV_Assert(dst.type() == CV_8UC4 && dst.size() == irPremultiplied.size());
+    const cv::Rect area = region & cv::Rect(0, 0, dst.cols, dst.rows);
+    if (area.empty())
+        return;
+
+    // Weights in 8.8 fixed point so the whole blend stays in integer math
+    // Everything the rows need goes through one reference so the loop body fits std::function's small buffer (no allocation)
+    struct
+    {
+        const cv::Mat &ir;
+        const cv::Mat &vis;
+        cv::Mat &out;
+        int irW;
+        int visW;
+        int x0;
+        int cols;
+    } job{irPremultiplied, visibleGray, dst, cvRound(irWeight * 256), cvRound(visibleWeight * 256), area.x, area.width};
+
+    cv::parallel_for_(cv::Range(area.y, area.y + area.height), [&job](const cv::Range &range)
+    {
+        const int irW = job.irW;
+        const int visW = job.visW;
+        const int cols = job.cols;
+
+        for (int y = range.start; y < range.end; y++)
+        {
+            const uchar *ir = job.ir.ptr<uchar>(y) + 4 * job.x0;
+            const uchar *vis = job.vis.ptr<uchar>(y) + job.x0;
+            uchar *out = job.out.ptr<uchar>(y) + 4 * job.x0;
+
+            // Kept branch free so the compiler can vectorize the row
+            for (int x = 0; x < cols; x++)
+            {
+                int b = ir[4 * x + 0];
+                int g = ir[4 * x + 1];
+                int r = ir[4 * x + 2];
+                int a = ir[4 * x + 3];
+                int v = vis[x];
+
+                // The colors are already scaled by alpha, so only the visible weight depends on it
+                // visible gets visW + irW * (1 - a / 255)
+                int wv = visW + irW - ((irW * a * 257 + 32896) >> 16);
+                int visPart = wv * v + 128;
+
+                int ob = (irW * b + visPart) >> 8;
+                int og = (irW * g + visPart) >> 8;
+                int orr = (irW * r + visPart) >> 8;
+
+                out[4 * x + 0] = (uchar)(ob > 255 ? 255 : ob);
+                out[4 * x + 1] = (uchar)(og > 255 ? 255 : og);
+                out[4 * x + 2] = (uchar)(orr > 255 ? 255 : orr);
+                out[4 * x + 3] = 255;
+            }
+        }
+    });
+}
@@ -0,0 +1,346 @@
+// Exports every frame of RecordRawVideo recordings as 16 bit TIFF or DNG files, build with "make rawExport"
+//
+// Replaces the Python export, which only wrote the first frame of each recording. Any number of .raw files can be
+// given (irCamera_N.raw, visibleCamera_N.raw ...) and all of their frames go through one pipeline :
+//  - reading : each recording is memory mapped (RawRecording), the kernel is asked to read EXPORT_READ_AHEAD frames
+//    ahead of the encoders and each frame is dropped from the page cache once it's encoded
+//  - encoding : a pool of encoder threads turns frames into complete files in memory (dng_writer.h)
+//  - writing : encoded files go through a bounded queue to writer threads, so writing overlaps with reading and
+//    encoding, and the encoders only wait when the disk can't keep up. File buffers are recycled.
+//
+// Files are named <recording>_<frame index>_<PTS in microseconds>us.<tiff|dng>, e.g. irCamera_3_000042_001400033us.dng,
+// without the PTS part when the recording has no timestamp file. The frame index and PTS also go in ImageDescription.
+//
+// Usage : rawExport <camera_N.raw>... -o <outputDir> [--format tiff|dng] [--threads N] [--writers N]
+//                   [--first K] [--count N] [--size W H] [--stride bytes] [--black-level N]
+
+#include "dng_writer.h"
+#include "raw_recording.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define EXPORT_READ_AHEAD 8     // Frames the kernel is asked to read ahead of the encoders
+#define EXPORT_QUEUE_DEPTH 16   // Encoded files waiting for a writer, bounds the memory in flight
+#define EXPORT_WRITER_THREADS 2 // More than one keeps a slow file system's open / close latency off the critical path
+
+// One frame of one recording
+struct ExportJob
+{
+    int recording;
+    int frame;
+};
+
+// One encoded file on its way to the disk
+struct ExportFile
+{
+    std::string path;
+    std::vector<unsigned char> bytes;
+};
+
+// Bounded queue between the encoders and the writers, plus the pool of file buffers they hand back and forth
+class ExportQueue
+{
+public:
+    // Blocks while the queue is full
+    void push(std::unique_ptr<ExportFile> file)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [&]
+                     { return queued.size() < EXPORT_QUEUE_DEPTH; });
+        queued.push_back(std::move(file));
+        notEmpty.notify_one();
+    }
+
+    // Returns null once finish() was called and everything was handed out
+    std::unique_ptr<ExportFile> pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [&]
+                      { return !queued.empty() || finished; });
+        if (queued.empty())
+            return nullptr;
+
+        std::unique_ptr<ExportFile> file = std::move(queued.front());
+        queued.pop_front();
+        notFull.notify_one();
+        return file;
+    }
+
+    void finish()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+        notEmpty.notify_all();
+    }
+
+    // A written file's buffer goes back to the encoders, so after the first few frames nothing is allocated
+    std::unique_ptr<ExportFile> takeBuffer()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (spare.empty())
+            return std::make_unique<ExportFile>();
+        std::unique_ptr<ExportFile> file = std::move(spare.back());
+        spare.pop_back();
+        return file;
+    }
+
+    void recycle(std::unique_ptr<ExportFile> file)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        spare.push_back(std::move(file));
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable notFull, notEmpty;
+    std::deque<std::unique_ptr<ExportFile>> queued;
+    std::vector<std::unique_ptr<ExportFile>> spare;
+    bool finished = false;
+};
+
+static bool writeFile(const ExportFile &file)
+{
+    int fd = ::open(file.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to create " << file.path << " : " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    const unsigned char *data = file.bytes.data();
+    size_t left = file.bytes.size();
+    while (left > 0)
+    {
+        ssize_t written = ::write(fd, data, left);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+        {
+            std::cerr << "Failed to write " << file.path << " : " << std::strerror(errno) << std::endl;
+            ::close(fd);
+            return false;
+        }
+        data += written;
+        left -= written;
+    }
+    return ::close(fd) == 0;
+}
+
+// irCamera_3.raw -> irCamera_3
+static std::string recordingName(const std::string &path)
+{
+    return std::filesystem::path(path).stem().string();
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> inputs;
+    std::string outputDir;
+    bool dng = false;
+    int threads = 0;
+    int writers = EXPORT_WRITER_THREADS;
+    int first = 0;
+    int count = -1;
+    int width = RAW_FRAME_WIDTH, height = RAW_FRAME_HEIGHT;
+    size_t stride = 0;
+    int blackLevel = 0;
+
+    auto printUsage = [&]()
+    {
+        std::cerr << "Usage : " << argv[0]
+                  << " <camera_N.raw>... -o <outputDir> [--format tiff|dng] [--threads N] [--writers N]"
+                  << " [--first K] [--count N] [--size W H] [--stride bytes] [--black-level N]" << std::endl;
+    };
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        try
+        {
+            if (arg == "-o" && i + 1 < argc)
+                outputDir = argv[++i];
+            else if (arg == "--format" && i + 1 < argc && (std::string(argv[i + 1]) == "tiff" || std::string(argv[i + 1]) == "dng"))
+                dng = std::string(argv[++i]) == "dng";
+            else if (arg == "--threads" && i + 1 < argc)
+                threads = std::stoi(argv[++i]);
+            else if (arg == "--writers" && i + 1 < argc)
+                writers = std::max(1, std::stoi(argv[++i]));
+            else if (arg == "--first" && i + 1 < argc)
+                first = std::max(0, std::stoi(argv[++i]));
+            else if (arg == "--count" && i + 1 < argc)
+                count = std::stoi(argv[++i]);
+            else if (arg == "--size" && i + 2 < argc)
+            {
+                width = std::stoi(argv[++i]);
+                height = std::stoi(argv[++i]);
+            }
+            else if (arg == "--stride" && i + 1 < argc)
+                stride = std::stoul(argv[++i]);
+            else if (arg == "--black-level" && i + 1 < argc)
+                blackLevel = std::stoi(argv[++i]);
+            else if (arg.size() > 4 && arg.compare(arg.size() - 4, 4, ".raw") == 0)
+                inputs.push_back(arg);
+            else
+            {
+                std::cerr << "Unknown argument : " << arg << std::endl;
+                printUsage();
+                return -1;
+            }
+        }
+        catch (const std::logic_error &) // What std::stoi & co throw on a malformed value : invalid_argument / out_of_range
+        {
+            std::cerr << "Invalid value for " << arg << std::endl;
+            printUsage();
+            return -1;
+        }
+    }
+
+    if (inputs.empty() || outputDir.empty())
+    {
+        std::cerr << "Need at least one .raw recording and an output directory (-o)" << std::endl;
+        return -1;
+    }
+
+    // ------------------ [ OPEN RECORDINGS ] ------------------ //
+    std::vector<std::unique_ptr<RawRecording>> recordings;
+    std::vector<ExportJob> jobs;
+    size_t frameBytes = 0;
+    for (size_t r = 0; r < inputs.size(); r++)
+    {
+        recordings.push_back(std::make_unique<RawRecording>());
+        if (!recordings.back()->open(inputs[r], "", width, height, stride))
+            return -1;
+
+        int available = recordings.back()->frameCount();
+        int last = count < 0 ? available : std::min(available, first + count);
+        std::cout << inputs[r] << " : " << available << " frames"
+                  << (recordings.back()->hasTimestamps() ? "" : " (no timestamps)") << ", exporting " << std::max(0, last - first) << std::endl;
+
+        for (int frame = first; frame < last; frame++)
+            jobs.push_back({(int)r, frame});
+        frameBytes = (stride ? stride : (size_t)width * 2) * height;
+    }
+
+    if (jobs.empty())
+    {
+        std::cerr << "No frames to export" << std::endl;
+        return -1;
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(outputDir, error);
+    if (error)
+    {
+        std::cerr << "Failed to create " << outputDir << " : " << error.message() << std::endl;
+        return -1;
+    }
+
+    int encoderCount = threads > 0 ? threads : (int)std::max(1u, std::thread::hardware_concurrency());
+    encoderCount = std::min(encoderCount, (int)jobs.size());
+    std::cout << "Exporting " << jobs.size() << " frames as " << (dng ? "DNG" : "TIFF") << " to " << outputDir << " with "
+              << encoderCount << " encoders and " << writers << " writers" << std::endl;
+
+    // ------------------ [ ENCODE / WRITE ] ------------------ //
+    ExportQueue queue;
+    std::atomic<size_t> nextJob(0);
+    std::atomic<size_t> bytesWritten(0);
+    std::atomic<int> failedFrames(0);
+
+    // The first window is requested up front, after that each job asks for the one EXPORT_READ_AHEAD frames later
+    for (size_t i = 0; i < std::min(jobs.size(), (size_t)EXPORT_READ_AHEAD); i++)
+        recordings[jobs[i].recording]->prefetch(jobs[i].frame, 1);
+
+    auto encoder = [&]()
+    {
+        RawImageInfo info;
+        info.bitDepth = RAW_BIT_DEPTH;
+        info.blackLevel = blackLevel;
+
+        for (size_t index = nextJob++; index < jobs.size(); index = nextJob++)
+        {
+            if (index + EXPORT_READ_AHEAD < jobs.size())
+            {
+                const ExportJob &ahead = jobs[index + EXPORT_READ_AHEAD];
+                recordings[ahead.recording]->prefetch(ahead.frame, 1);
+            }
+
+            const ExportJob &job = jobs[index];
+            const RawRecording &recording = *recordings[job.recording];
+            const std::string name = recordingName(inputs[job.recording]);
+            const double pts = recording.pts(job.frame);
+
+            char suffix[64];
+            if (pts >= 0)
+                std::snprintf(suffix, sizeof(suffix), "_%06d_%09lldus", job.frame, (long long)(pts * 1000.0 + 0.5));
+            else
+                std::snprintf(suffix, sizeof(suffix), "_%06d", job.frame);
+
+            char description[96];
+            std::snprintf(description, sizeof(description), "%s frame %d, PTS %.3f ms", name.c_str(), job.frame, pts);
+            info.description = description;
+            info.cameraModel = name.substr(0, name.find('_'));
+
+            std::unique_ptr<ExportFile> file = queue.takeBuffer();
+            file->path = outputDir + "/" + name + suffix + (dng ? ".dng" : ".tiff");
+            if (dng)
+                encodeRawDng(recording.frame(job.frame), info, file->bytes);
+            else
+                encodeRawTiff(recording.frame(job.frame), info, file->bytes);
+
+            // The frame is in the file buffer now, its pages won't be touched again
+            recording.release(job.frame, 1);
+            queue.push(std::move(file));
+        }
+    };
+
+    auto writer = [&]()
+    {
+        while (std::unique_ptr<ExportFile> file = queue.pop())
+        {
+            if (writeFile(*file))
+                bytesWritten += file->bytes.size();
+            else
+                failedFrames++;
+            queue.recycle(std::move(file));
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> writerThreads, encoderThreads;
+    for (int i = 0; i < writers; i++)
+        writerThreads.emplace_back(writer);
+    for (int i = 0; i < encoderCount; i++)
+        encoderThreads.emplace_back(encoder);
+
+    for (std::thread &thread : encoderThreads)
+        thread.join();
+    queue.finish();
+    for (std::thread &thread : writerThreads)
+        thread.join();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double readMB = (double)jobs.size() * frameBytes / 1e6;
+    std::cout << "Exported " << jobs.size() - failedFrames << "/" << jobs.size() << " frames in " << seconds << " s | "
+              << jobs.size() / seconds << " frames/s | read " << readMB / seconds << " MB/s, wrote "
+              << bytesWritten / 1e6 / seconds << " MB/s" << std::endl;
+
+    return failedFrames == 0 ? 0 : -1;
+}
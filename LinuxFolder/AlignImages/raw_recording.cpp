@@ -0,0 +1,153 @@
+#include "raw_recording.h"
+#include "frame_sync.h"
+
+#include <algorithm>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::string timestampPathForRaw(const std::string &rawPath)
+{
+    std::string path = rawPath;
+
+    size_t camera = path.rfind("Camera_");
+    if (camera != std::string::npos)
+        path.replace(camera, 7, "TimeStamps_");
+
+    size_t extension = path.rfind(".raw");
+    if (extension != std::string::npos)
+        path.replace(extension, 4, ".txt");
+
+    return path;
+}
+
+RawRecording::~RawRecording()
+{
+    close();
+}
+
+bool RawRecording::open(const std::string &rawPath, const std::string &timestampPath, int width, int height, size_t stride)
+{
+    close();
+
+    int fd = ::open(rawPath.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open raw recording " << rawPath << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        std::cerr << "Raw recording " << rawPath << " is empty" << std::endl;
+        ::close(fd);
+        return false;
+    }
+
+    rowStride = stride ? stride : (size_t)width * 2;
+    frameBytes = rowStride * height;
+    numFrames = (int)(st.st_size / frameBytes);
+    if (numFrames == 0)
+    {
+        std::cerr << "Raw recording " << rawPath << " is smaller than one " << width << "x" << height << " frame" << std::endl;
+        ::close(fd);
+        return false;
+    }
+
+    mappingSize = st.st_size;
+    void *address = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file
+    ::close(fd);
+
+    if (address == MAP_FAILED)
+    {
+        std::cerr << "Failed to mmap raw recording " << rawPath << std::endl;
+        mappingSize = 0;
+        numFrames = 0;
+        return false;
+    }
+
+    mapping = (unsigned char *)address;
+    size = cv::Size(width, height);
+
+    // Most consumers walk the file front to back, so ask for aggressive read ahead by default
+    madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+
+    timestamps = loadTimestamps(timestampPath.empty() ? timestampPathForRaw(rawPath) : timestampPath);
+    if (!timestamps.empty() && (int)timestamps.size() != numFrames)
+    {
+        std::cerr << "Warning : " << rawPath << " has " << numFrames << " frames but " << timestamps.size() << " timestamps" << std::endl;
+    }
+
+    return true;
+}
+
+void RawRecording::close()
+{
+    if (mapping)
+        munmap(mapping, mappingSize);
+
+    mapping = nullptr;
+    mappingSize = 0;
+    numFrames = 0;
+    timestamps.clear();
+}
+
+cv::Mat RawRecording::frame(int index) const
+{
+    CV_Assert(mapping && index >= 0 && index < numFrames);
+    return cv::Mat(size, CV_16UC1, mapping + (size_t)index * frameBytes, rowStride);
+}
+
+double RawRecording::pts(int index) const
+{
+    if (index < 0 || index >= (int)timestamps.size())
+        return -1.0;
+    return timestamps[index];
+}
+
+int RawRecording::frameAtPts(double ptsMs) const
+{
+    if (timestamps.empty())
+        return -1;
+
+    auto next = std::lower_bound(timestamps.begin(), timestamps.end(), ptsMs);
+    if (next == timestamps.end())
+        return std::min((int)timestamps.size(), numFrames) - 1;
+    if (next != timestamps.begin() && ptsMs - *(next - 1) < *next - ptsMs)
+        --next;
+
+    return std::min((int)(next - timestamps.begin()), numFrames - 1);
+}
+
+void RawRecording::prefetch(int first, int count) const
+{
+    advise(first, count, MADV_WILLNEED);
+}
+
+void RawRecording::release(int first, int count) const
+{
+    advise(first, count, MADV_DONTNEED);
+}
+
+void RawRecording::advise(int first, int count, int advice) const
+{
+    if (!mapping || count <= 0)
+        return;
+
+    first = std::max(first, 0);
+    int last = std::min(first + count, numFrames);
+    if (first >= last)
+        return;
+
+    // madvise() needs a page aligned start address
+    static const size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t begin = (size_t)first * frameBytes;
+    size_t end = std::min((size_t)last * frameBytes, mappingSize);
+    size_t alignedBegin = begin - begin % pageSize;
+
+    madvise(mapping + alignedBegin, end - alignedBegin, advice);
+}
@@ -0,0 +1,253 @@
+#include "shared_frame_ring.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static size_t pageAlign(size_t bytes)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) / page * page;
+}
+
+static uint64_t realtimeNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// ------------------ [ WRITER ] ------------------ //
+
+SharedFrameWriter::~SharedFrameWriter()
+{
+    close();
+}
+
+void SharedFrameWriter::open(const std::string &segmentName)
+{
+    close();
+    name = segmentName;
+}
+
+void SharedFrameWriter::close()
+{
+    unmap();
+    if (!name.empty())
+        shm_unlink(name.c_str());
+    name.clear();
+}
+
+void SharedFrameWriter::unmap()
+{
+    if (header)
+    {
+        // Readers still holding the old mapping see this and reopen by name
+        header->stale.store(1, std::memory_order_release);
+        munmap(header, mappedBytes);
+    }
+    header = nullptr;
+    mappedBytes = 0;
+    writingSlot = -1;
+}
+
+bool SharedFrameWriter::create(cv::Size size, int type)
+{
+    unmap();
+
+    // A new segment rather than resizing the old one, readers mapped to the old size must never see the new layout
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "shm_open " << name << " failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    size_t frameBytes = (size_t)size.width * size.height * CV_ELEM_SIZE(type);
+    size_t slotStride = pageAlign(frameBytes);
+    size_t dataOffset = pageAlign(sizeof(SharedRingHeader));
+    size_t totalBytes = dataOffset + slotStride * SHARED_RING_SLOTS;
+
+    void *mapping = MAP_FAILED;
+    if (ftruncate(fd, totalBytes) == 0)
+        mapping = mmap(nullptr, totalBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (mapping == MAP_FAILED)
+    {
+        std::cerr << "Failed to map " << totalBytes << " bytes of shared memory for " << name << ": " << std::strerror(errno) << std::endl;
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    // ftruncate() zero fills, so every seq / latest / stale starts at 0
+    header = (SharedRingHeader *)mapping;
+    mappedBytes = totalBytes;
+    header->version = SHARED_RING_VERSION;
+    header->slotCount = SHARED_RING_SLOTS;
+    header->width = size.width;
+    header->height = size.height;
+    header->type = type;
+    header->slotStride = slotStride;
+    header->dataOffset = dataOffset;
+
+    // Readers check the magic before anything else, publish it last
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = SHARED_RING_MAGIC;
+
+    // nextFrame keeps counting across segments so frame numbers stay unique for the whole run
+    return true;
+}
+
+bool SharedFrameWriter::acquire(cv::Size size, int type, cv::Mat &slot)
+{
+    if (name.empty())
+    {
+        slot.release();
+        return false;
+    }
+
+    if (!header || (int)header->width != size.width || (int)header->height != size.height || (int)header->type != type)
+    {
+        if (!create(size, type))
+        {
+            slot.release();
+            return false;
+        }
+    }
+
+    writingSlot = nextFrame % SHARED_RING_SLOTS;
+    SharedRingSlot &ringSlot = header->slots[writingSlot];
+
+    // Odd sequence : readers that look at this slot from now on know it's being overwritten
+    ringSlot.seq.store(ringSlot.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // A header over the shared pixels, no allocation, and create() on it is a no-op for the same size / type
+    slot = cv::Mat(size, type, (char *)header + header->dataOffset + writingSlot * header->slotStride);
+    return true;
+}
+
+void SharedFrameWriter::publish()
+{
+    if (!header || writingSlot < 0)
+        return;
+
+    SharedRingSlot &ringSlot = header->slots[writingSlot];
+    ringSlot.frameNumber = ++nextFrame;
+    ringSlot.timestampNs = realtimeNs();
+
+    // Even again : the pixels and the metadata above are complete
+    ringSlot.seq.store(ringSlot.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    header->latest.store(nextFrame, std::memory_order_release);
+    writingSlot = -1;
+}
+
+// ------------------ [ READER ] ------------------ //
+
+SharedFrameReader::~SharedFrameReader()
+{
+    close();
+}
+
+bool SharedFrameReader::open(const std::string &segmentName)
+{
+    close();
+    name = segmentName;
+
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(SharedRingHeader))
+        mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (mapping == MAP_FAILED)
+        return false;
+
+    const SharedRingHeader *candidate = (const SharedRingHeader *)mapping;
+    bool valid = candidate->magic == SHARED_RING_MAGIC;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    valid = valid && candidate->version == SHARED_RING_VERSION && candidate->slotCount == SHARED_RING_SLOTS &&
+            !candidate->stale.load(std::memory_order_acquire);
+
+    // latest() builds a cv::Mat straight from these fields, so a frame has to fit its slot and every slot the mapping
+    // (written so none of the products can overflow : two 32 bit factors, or one already bounded by the file size)
+    const uint64_t fileBytes = (uint64_t)info.st_size;
+    valid = valid && (candidate->type == CV_8UC3 || candidate->type == CV_8UC4) &&
+            candidate->width > 0 && candidate->height > 0 &&
+            candidate->dataOffset >= sizeof(SharedRingHeader) && candidate->dataOffset <= fileBytes &&
+            candidate->slotStride <= fileBytes &&
+            (uint64_t)candidate->width * candidate->height <= candidate->slotStride / CV_ELEM_SIZE(candidate->type) &&
+            candidate->dataOffset + candidate->slotStride * candidate->slotCount <= fileBytes;
+
+    // Not initialized yet, already replaced (caught between the writer's munmap and unlink), or from an
+    // incompatible build or a corrupt segment, try again later
+    if (!valid)
+    {
+        munmap(mapping, info.st_size);
+        return false;
+    }
+
+    header = candidate;
+    mappedBytes = info.st_size;
+    lastFrame = 0;
+    return true;
+}
+
+void SharedFrameReader::close()
+{
+    if (header)
+        munmap((void *)header, mappedBytes);
+    header = nullptr;
+    mappedBytes = 0;
+    readingSlot = -1;
+}
+
+bool SharedFrameReader::latest(cv::Mat &view, uint32_t &frameNumber, uint64_t &timestampNs)
+{
+    if (header && header->stale.load(std::memory_order_acquire))
+        close();
+    if (!header && !open(name))
+        return false;
+
+    uint32_t newest = header->latest.load(std::memory_order_acquire);
+    if (newest == 0 || newest == lastFrame)
+        return false;
+
+    int slot = (newest - 1) % header->slotCount;
+    const SharedRingSlot &ringSlot = header->slots[slot];
+    uint32_t seq = ringSlot.seq.load(std::memory_order_acquire);
+
+    // The writer is already back in this slot, the next call picks up whatever it publishes
+    if (seq & 1)
+        return false;
+
+    frameNumber = ringSlot.frameNumber;
+    timestampNs = ringSlot.timestampNs;
+    view = cv::Mat(header->height, header->width, header->type,
+                   (void *)((const char *)header + header->dataOffset + slot * header->slotStride));
+
+    readingSlot = slot;
+    readingSeq = seq;
+    lastFrame = newest;
+    return true;
+}
+
+bool SharedFrameReader::stillValid() const
+{
+    if (!header || readingSlot < 0)
+        return false;
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return header->slots[readingSlot].seq.load(std::memory_order_relaxed) == readingSeq;
+}
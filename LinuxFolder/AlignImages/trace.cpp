@@ -0,0 +1,207 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <vector>
+
+std::atomic<bool> tracingEnabled(true);
+
+// One per traced thread, only the owning thread writes
+//
+// The fields are relaxed atomics so the dump thread can read them while they're being written, head is
+// published last and tells the reader which slots hold complete spans
+struct TraceRing
+{
+    struct Slot
+    {
+        std::atomic<const char *> name{nullptr};
+        std::atomic<uint64_t> startNs{0};
+        std::atomic<uint64_t> endNs{0};
+    };
+
+    std::atomic<uint64_t> head{0};
+    std::atomic<const char *> threadName{nullptr};
+    Slot slots[TRACE_RING_CAPACITY];
+};
+
+static_assert((TRACE_RING_CAPACITY & (TRACE_RING_CAPACITY - 1)) == 0, "TRACE_RING_CAPACITY must be a power of two");
+
+// Static storage, a thread claims the next ring the first time it records, nothing is ever allocated
+static TraceRing rings[TRACE_MAX_THREADS];
+static std::atomic<int> ringCount(0);
+
+// -1 = not claimed yet, TRACE_MAX_THREADS = out of rings
+static thread_local int threadRingIndex = -1;
+
+static std::atomic<bool> dumpRequested(false);
+
+static TraceRing *threadRing()
+{
+    if (threadRingIndex < 0)
+    {
+        int index = ringCount.fetch_add(1);
+        threadRingIndex = index < TRACE_MAX_THREADS ? index : TRACE_MAX_THREADS;
+    }
+    return threadRingIndex < TRACE_MAX_THREADS ? &rings[threadRingIndex] : nullptr;
+}
+
+uint64_t traceNowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void traceRecord(const char *name, uint64_t startNs, uint64_t endNs)
+{
+    TraceRing *ring = threadRing();
+    if (!ring)
+        return;
+
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    TraceRing::Slot &slot = ring->slots[head & (TRACE_RING_CAPACITY - 1)];
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.startNs.store(startNs, std::memory_order_relaxed);
+    slot.endNs.store(endNs, std::memory_order_relaxed);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+void traceSetThreadName(const char *name)
+{
+    TraceRing *ring = threadRing();
+    if (ring)
+        ring->threadName.store(name, std::memory_order_relaxed);
+}
+
+struct TraceSnapshotSpan
+{
+    int thread;
+    const char *name;
+    uint64_t startNs;
+    uint64_t endNs;
+};
+
+// Copies the complete spans out of every ring
+static std::vector<TraceSnapshotSpan> snapshot()
+{
+    std::vector<TraceSnapshotSpan> spans;
+    int threads = std::min(ringCount.load(), TRACE_MAX_THREADS);
+
+    for (int t = 0; t < threads; t++)
+    {
+        const TraceRing &ring = rings[t];
+        uint64_t head = ring.head.load(std::memory_order_acquire);
+        uint64_t first = head > TRACE_RING_CAPACITY ? head - TRACE_RING_CAPACITY : 0;
+
+        size_t copied = spans.size();
+        for (uint64_t i = first; i < head; i++)
+        {
+            const TraceRing::Slot &slot = ring.slots[i & (TRACE_RING_CAPACITY - 1)];
+            spans.push_back({t, slot.name.load(std::memory_order_relaxed), slot.startNs.load(std::memory_order_relaxed),
+                             slot.endNs.load(std::memory_order_relaxed)});
+        }
+
+        // The owner kept recording during the copy, anything it may have lapped is dropped
+        uint64_t headAfter = ring.head.load(std::memory_order_acquire);
+        uint64_t firstValid = headAfter >= TRACE_RING_CAPACITY ? headAfter - TRACE_RING_CAPACITY + 1 : 0;
+        if (firstValid > first)
+        {
+            size_t skip = std::min<uint64_t>(firstValid - first, head - first);
+            spans.erase(spans.begin() + copied, spans.begin() + copied + skip);
+        }
+    }
+
+    return spans;
+}
+
+void tracePrintPercentiles(std::ostream &out)
+{
+    std::vector<TraceSnapshotSpan> spans = snapshot();
+
+    std::map<std::string, std::vector<double>> durations;
+    for (const TraceSnapshotSpan &span : spans)
+        durations[span.name].push_back((span.endNs - span.startNs) / 1e6);
+
+    char line[160];
+    std::snprintf(line, sizeof(line), "%-22s %8s %10s %10s %10s %10s", "stage", "count", "mean ms", "p50 ms", "p99 ms", "max ms");
+    out << line << "\n";
+
+    for (auto &entry : durations)
+    {
+        std::vector<double> &d = entry.second;
+        std::sort(d.begin(), d.end());
+
+        double total = 0;
+        for (double v : d)
+            total += v;
+
+        size_t n = d.size();
+        std::snprintf(line, sizeof(line), "%-22s %8zu %10.3f %10.3f %10.3f %10.3f", entry.first.c_str(), n,
+                      total / n, d[n / 2], d[std::min(n - 1, (size_t)(n * 0.99))], d[n - 1]);
+        out << line << "\n";
+    }
+    out.flush();
+}
+
+bool traceDumpReport(const std::string &path, std::ostream &out)
+{
+    std::vector<TraceSnapshotSpan> spans = snapshot();
+
+    std::ofstream json(path);
+    if (!json.is_open())
+    {
+        out << "Failed to open " << path << std::endl;
+        return false;
+    }
+
+    // Timestamps relative to the oldest span so the viewer doesn't start at the machine's uptime
+    uint64_t origin = UINT64_MAX;
+    for (const TraceSnapshotSpan &span : spans)
+        origin = std::min(origin, span.startNs);
+
+    json << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool firstEvent = true;
+
+    int threads = std::min(ringCount.load(), TRACE_MAX_THREADS);
+    for (int t = 0; t < threads; t++)
+    {
+        const char *threadName = rings[t].threadName.load(std::memory_order_relaxed);
+        if (!threadName)
+            continue;
+        json << (firstEvent ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t
+             << ",\"args\":{\"name\":\"" << threadName << "\"}}";
+        firstEvent = false;
+    }
+
+    char event[256];
+    for (const TraceSnapshotSpan &span : spans)
+    {
+        std::snprintf(event, sizeof(event), "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                      span.name, span.thread, (span.startNs - origin) / 1e3, (span.endNs - span.startNs) / 1e3);
+        json << (firstEvent ? "" : ",\n") << event;
+        firstEvent = false;
+    }
+    json << "\n]}\n";
+    json.close();
+
+    out << "Wrote " << spans.size() << " spans to " << path << "\n";
+    tracePrintPercentiles(out);
+    return true;
+}
+
+static void onDumpSignal(int)
+{
+    dumpRequested.store(true, std::memory_order_relaxed);
+}
+
+void traceInstallSignalHandler(int signal)
+{
+    std::signal(signal, onDumpSignal);
+}
+
+bool traceDumpRequested()
+{
+    return dumpRequested.exchange(false, std::memory_order_relaxed);
+}
@@ -0,0 +1,248 @@
+#include "video_recorder.h"
+#include "alloc_counter.h"
+#include "frame_stream.h"
+#include "trace.h"
+
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/uio.h>
+#include <unistd.h>
+
+bool parseRecordFormat(const std::string &name, RecordFormat &format)
+{
+    if (name == "mjpg")
+        format = RecordFormat::Mjpg;
+    else if (name == "ffv1")
+        format = RecordFormat::Ffv1;
+    else if (name == "raw")
+        format = RecordFormat::Raw;
+    else
+        return false;
+    return true;
+}
+
+const char *recordFormatName(RecordFormat format)
+{
+    return format == RecordFormat::Mjpg ? "mjpg" : format == RecordFormat::Ffv1 ? "ffv1" : "raw";
+}
+
+VideoRecorder::~VideoRecorder()
+{
+    close();
+}
+
+bool VideoRecorder::open(const std::string &path, RecordFormat format, double fps, cv::Size frameSize, int type,
+                         int queueCapacity)
+{
+    close();
+    CV_Assert(type == CV_8UC4 || type == CV_8UC3 || type == CV_8UC1);
+
+    if (format == RecordFormat::Raw)
+    {
+        rawFd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (rawFd < 0)
+        {
+            std::cerr << "Failed to create " << path << " : " << std::strerror(errno) << std::endl;
+            return false;
+        }
+    }
+    else
+    {
+        int fourcc = format == RecordFormat::Ffv1 ? cv::VideoWriter::fourcc('F', 'F', 'V', '1')
+                                                  : cv::VideoWriter::fourcc('M', 'J', 'P', 'G');
+        if (!videoWriter.open(path, fourcc, fps, frameSize, type != CV_8UC1))
+        {
+            std::cerr << "Failed to open " << path << " for " << recordFormatName(format) << " recording" << std::endl;
+            return false;
+        }
+        if (type == CV_8UC4)
+            bgr.create(frameSize, CV_8UC3);
+    }
+
+    this->path = path;
+    this->format = format;
+    this->frameSize = frameSize;
+    this->type = type;
+    recorded = dropped = 0;
+    maxQueued = 0;
+    written = failed = encodeSumNs = encodeMaxNs = 0;
+
+    // DropNewest, but record() checks for room before copying so the queue never gets to drop anything itself
+    queue = std::make_unique<SpscQueue<RecordedFrame>>(queueCapacity, OverflowPolicy::DropNewest);
+    this->queueCapacity = queue->maxSize();
+    queue->forEach([&](RecordedFrame &frame)
+                   { frame.image.create(frameSize, type); });
+
+    running = true;
+    encoderThread = std::thread(&VideoRecorder::encodeLoop, this);
+    std::cout << "Recording to " << path << " (" << recordFormatName(format) << ", " << frameSize.width << "x"
+              << frameSize.height << ", " << this->queueCapacity << " frame queue)" << std::endl;
+    return true;
+}
+
+void VideoRecorder::close()
+{
+    if (!queue)
+        return;
+
+    // The encoder drains the queue before it sees running go false
+    running = false;
+    encoderThread.join();
+    queue.reset();
+
+    videoWriter.release();
+    if (rawFd >= 0)
+    {
+        if (::close(rawFd) != 0)
+            std::cerr << "Failed to close " << path << " : " << std::strerror(errno) << std::endl;
+        rawFd = -1;
+    }
+}
+
+bool VideoRecorder::record(const cv::Mat &frame)
+{
+    if (!queue)
+        return false;
+
+    CV_Assert(frame.size() == frameSize && frame.type() == type);
+
+    // The producer is the only one adding to the queue, so a queue with room now still has room at push()
+    int queued = queue->size();
+    maxQueued = std::max(maxQueued, queued);
+    if (queued >= queue->maxSize())
+    {
+        dropped++;
+        return false;
+    }
+
+    RecordedFrame &slot = queue->writeBuffer();
+    {
+        TRACE_SCOPE("record copy");
+        frame.copyTo(slot.image);
+    }
+    slot.sequence = recorded + dropped;
+    slot.timestampNs = frameStreamNowNs();
+    if (!queue->push())
+    {
+        dropped++;
+        return false;
+    }
+    recorded++;
+    return true;
+}
+
+void VideoRecorder::encodeLoop()
+{
+    traceSetThreadName("recorder");
+
+    // VideoWriter / FFmpeg allocate packets every frame, none of that is the frame loop's
+    ignoreThreadAllocations();
+
+    Backoff backoff;
+    while (true)
+    {
+        if (!queue->update())
+        {
+            if (running)
+            {
+                backoff.pause();
+                continue;
+            }
+
+            // Only stops once the queue is empty, so everything record() accepted ends up in the file. The update()
+            // above can have missed a push() from just before close(), once running reads false that push is visible
+            if (!queue->update())
+                break;
+        }
+        backoff.reset();
+
+        uint64_t startNs = traceNowNs();
+        bool ok;
+        {
+            TRACE_SCOPE("record encode");
+            ok = writeFrame(queue->readBuffer());
+        }
+        uint64_t encodeNs = traceNowNs() - startNs;
+
+        if (ok)
+            written.fetch_add(1, std::memory_order_relaxed);
+        else if (failed.fetch_add(1, std::memory_order_relaxed) == 0)
+            std::cerr << "Failed to write to " << path << " : " << std::strerror(errno) << std::endl;
+
+        encodeSumNs.fetch_add(encodeNs, std::memory_order_relaxed);
+        if (encodeNs > encodeMaxNs.load(std::memory_order_relaxed))
+            encodeMaxNs.store(encodeNs, std::memory_order_relaxed);
+    }
+}
+
+bool VideoRecorder::writeFrame(const RecordedFrame &frame)
+{
+    if (format != RecordFormat::Raw)
+    {
+        if (frame.image.type() == CV_8UC4)
+        {
+            cv::cvtColor(frame.image, bgr, cv::COLOR_BGRA2BGR);
+            videoWriter.write(bgr);
+        }
+        else
+        {
+            videoWriter.write(frame.image);
+        }
+        return true;
+    }
+
+    // Same header as a --stream frame sent with --codec raw
+    FrameHeader header = {};
+    header.magic = FRAME_STREAM_MAGIC;
+    header.version = FRAME_STREAM_VERSION;
+    header.format = type == CV_8UC4 ? FRAME_FORMAT_BGRA : type == CV_8UC3 ? FRAME_FORMAT_BGR : FRAME_FORMAT_GRAY;
+    header.width = frameSize.width;
+    header.height = frameSize.height;
+    header.sequence = frame.sequence;
+    header.timestampNs = frame.timestampNs;
+    header.payloadBytes = (uint32_t)(frame.image.total() * frame.image.elemSize());
+    header.codec = FRAME_CODEC_RAW;
+
+    // The queue's frames are allocated whole, so header and pixels go out in one writev()
+    struct iovec iov[2] = {{&header, sizeof(header)}, {frame.image.data, header.payloadBytes}};
+    int count = 2;
+    struct iovec *next = iov;
+    while (count > 0)
+    {
+        ssize_t bytes = ::writev(rawFd, next, count);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return false;
+
+        while (count > 0 && (size_t)bytes >= next->iov_len)
+        {
+            bytes -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0)
+        {
+            next->iov_base = (char *)next->iov_base + bytes;
+            next->iov_len -= bytes;
+        }
+    }
+    return true;
+}
+
+void VideoRecorder::printStats(std::ostream &out) const
+{
+    uint64_t writtenFrames = writtenCount();
+    out << "Recording " << path << " : " << recorded << " recorded, " << dropped << " dropped (queue full), "
+        << writtenFrames << " written";
+    if (failed > 0)
+        out << ", " << failed << " failed";
+    out << " | queue peak " << maxQueued << "/" << queueCapacity;
+    if (writtenFrames > 0)
+        out << " | encode mean " << encodeSumNs / writtenFrames / 1e6 << " ms, max " << encodeMaxNs / 1e6 << " ms";
+    out << std::endl;
+}
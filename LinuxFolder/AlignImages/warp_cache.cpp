@@ -0,0 +1,216 @@
+#include "warp_cache.h"
+#include "overlay.h"
+
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <iostream>
+
+cv::Mat loadHomography(const std::string &filename)
+{
+    cv::Mat homography;
+
+    cv::FileStorage fs(filename, cv::FileStorage::READ);
+    if (!fs.isOpened())
+    {
+        std::cerr << "Failed to open " << filename << std::endl;
+        return homography;
+    }
+
+    fs["homography"] >> homography;
+    fs.release();
+
+    return homography;
+}
+
+bool saveHomography(const std::string &filename, const cv::Mat &homography)
+{
+    std::string temporary = filename + ".tmp";
+    {
+        cv::FileStorage fs(temporary, cv::FileStorage::WRITE | cv::FileStorage::FORMAT_YAML);
+        if (!fs.isOpened())
+        {
+            std::cerr << "Failed to open " << temporary << " for writing" << std::endl;
+            return false;
+        }
+        fs << "homography" << homography;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(temporary, filename, ec);
+    if (ec)
+    {
+        std::cerr << "Failed to replace " << filename << ": " << ec.message() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool reloadHomographyIfChanged(const std::string &filename, std::filesystem::file_time_type &lastWriteTime, cv::Mat &homography)
+{
+    std::error_code ec;
+    auto writeTime = std::filesystem::last_write_time(filename, ec);
+    if (ec || writeTime == lastWriteTime)
+        return false;
+
+    lastWriteTime = writeTime;
+
+    // Keep using the old matrix if the file is half written or otherwise unreadable
+    cv::Mat newHomography = loadHomography(filename);
+    if (newHomography.empty())
+        return false;
+
+    homography = newHomography;
+    std::cout << "Reloaded homography from " << filename << std::endl;
+    return true;
+}
+
+bool WarpMapCache::update(const cv::Mat &homography, int offsetX, int offsetY, cv::Size srcSize, cv::Size dstSize)
+{
+    CV_Assert(homography.rows == 3 && homography.cols == 3);
+
+    CV_Assert(homography.depth() == CV_64F || homography.depth() == CV_32F);
+
+    // Read the elements directly, this runs every frame and must not allocate
+    cv::Matx33d H;
+    for (int r = 0; r < 3; r++)
+        for (int c = 0; c < 3; c++)
+            H(r, c) = homography.depth() == CV_64F ? homography.at<double>(r, c) : homography.at<float>(r, c);
+
+    if (!map1.empty() && H == cachedHomography && offsetX == cachedOffsetX && offsetY == cachedOffsetY &&
+        srcSize == cachedSrcSize && dstSize == cachedDstSize)
+    {
+        return false;
+    }
+
+    cachedHomography = H;
+    cachedOffsetX = offsetX;
+    cachedOffsetY = offsetY;
+    cachedSrcSize = srcSize;
+    cachedDstSize = dstSize;
+
+    // Composite transform : homography first, then the translation back into IR coordinates
+    cv::Matx33d translation(1, 0, -offsetX,
+                            0, 1, -offsetY,
+                            0, 0, 1);
+    cv::Matx33d inverse = (translation * H).inv();
+
+    // Float maps first, then let OpenCV pack them into the fixed point format remap() is fastest with
+    // The overlap is tracked on the way, a destination pixel is covered if its bilinear sample touches the visible frame
+    cv::Mat mapX(dstSize, CV_32FC1), mapY(dstSize, CV_32FC1);
+    const float limitX = (float)srcSize.width, limitY = (float)srcSize.height;
+    int minCoveredX = dstSize.width, maxCoveredX = -1, minCoveredY = dstSize.height, maxCoveredY = -1;
+
+    // Source pixel bounds per destination tile, for applyTiles()
+    const int dstTilesX = (dstSize.width + DIRTY_TILE_SIZE - 1) / DIRTY_TILE_SIZE;
+    const int dstTilesY = (dstSize.height + DIRTY_TILE_SIZE - 1) / DIRTY_TILE_SIZE;
+    std::vector<cv::Vec4i> bounds(dstTilesX * dstTilesY, cv::Vec4i(srcSize.width, srcSize.height, -1, -1));
+
+    for (int y = 0; y < dstSize.height; y++)
+    {
+        float *mx = mapX.ptr<float>(y);
+        float *my = mapY.ptr<float>(y);
+        cv::Vec4i *tileBounds = &bounds[(y / DIRTY_TILE_SIZE) * dstTilesX];
+        int rowMin = dstSize.width, rowMax = -1;
+        for (int x = 0; x < dstSize.width; x++)
+        {
+            double w = inverse(2, 0) * x + inverse(2, 1) * y + inverse(2, 2);
+            w = w != 0 ? 1.0 / w : 0.0;
+            mx[x] = (float)((inverse(0, 0) * x + inverse(0, 1) * y + inverse(0, 2)) * w);
+            my[x] = (float)((inverse(1, 0) * x + inverse(1, 1) * y + inverse(1, 2)) * w);
+
+            if (w > 0 && mx[x] > -1 && mx[x] < limitX && my[x] > -1 && my[x] < limitY)
+            {
+                rowMin = std::min(rowMin, x);
+                rowMax = x;
+
+                // The bilinear sample reads floor(m) and floor(m) + 1, one more since the fixed point maps round
+                // m to 1/32 of a pixel, which can push it over the next integer
+                cv::Vec4i &b = tileBounds[x / DIRTY_TILE_SIZE];
+                int sx = cvFloor(mx[x]), sy = cvFloor(my[x]);
+                b[0] = std::min(b[0], std::max(sx, 0));
+                b[1] = std::min(b[1], std::max(sy, 0));
+                b[2] = std::max(b[2], std::min(sx + 2, srcSize.width - 1));
+                b[3] = std::max(b[3], std::min(sy + 2, srcSize.height - 1));
+            }
+        }
+
+        if (rowMax >= 0)
+        {
+            minCoveredX = std::min(minCoveredX, rowMin);
+            maxCoveredX = std::max(maxCoveredX, rowMax);
+            minCoveredY = std::min(minCoveredY, y);
+            maxCoveredY = y;
+        }
+    }
+    cv::convertMaps(mapX, mapY, map1, map2, CV_16SC2);
+
+    footprints.resize(bounds.size());
+    for (size_t i = 0; i < bounds.size(); i++)
+    {
+        const cv::Vec4i &b = bounds[i];
+        footprints[i] = b[2] < 0 ? cv::Rect()
+                                 : cv::Rect(cv::Point(b[0] / DIRTY_TILE_SIZE, b[1] / DIRTY_TILE_SIZE),
+                                            cv::Point(b[2] / DIRTY_TILE_SIZE + 1, b[3] / DIRTY_TILE_SIZE + 1));
+    }
+
+    overlapRect = maxCoveredY >= 0 ? cv::Rect(minCoveredX, minCoveredY, maxCoveredX - minCoveredX + 1, maxCoveredY - minCoveredY + 1)
+                                   : cv::Rect(0, 0, dstSize.width, dstSize.height);
+
+    return true;
+}
+
+cv::Point2f WarpMapCache::sourcePoint(cv::Point dst) const
+{
+    CV_Assert(!map1.empty() && cv::Rect(cv::Point(), cachedDstSize).contains(dst));
+
+    // map1 holds the integer part, map2 the fraction in 1/INTER_TAB_SIZE steps, x in the low bits
+    const cv::Vec2s &whole = map1.at<cv::Vec2s>(dst);
+    const ushort fraction = map2.at<ushort>(dst);
+    return cv::Point2f(whole[0] + (float)(fraction % cv::INTER_TAB_SIZE) / cv::INTER_TAB_SIZE,
+                       whole[1] + (float)(fraction / cv::INTER_TAB_SIZE) / cv::INTER_TAB_SIZE);
+}
+
+void WarpMapCache::apply(const cv::Mat &src, cv::Mat &dst) const
+{
+    CV_Assert(!map1.empty() && src.size() == cachedSrcSize);
+
+    if (overlapRect.size() == cachedDstSize)
+    {
+        cv::remap(src, dst, map1, map2, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar());
+        return;
+    }
+
+    // remap() into the overlap's view of dst, the size matches so it writes in place
+    dst.create(cachedDstSize, src.type());
+    cv::Mat covered = dst(overlapRect);
+    cv::remap(src, covered, map1(overlapRect), map2(overlapRect), cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar());
+    fillOutside(dst, overlapRect, cv::Scalar());
+}
+
+int WarpMapCache::applyTiles(const cv::Mat &src, cv::Mat &dst, const DirtyTiles &srcTiles, DirtyTiles &dstTiles) const
+{
+    CV_Assert(!map1.empty() && src.size() == cachedSrcSize && dst.size() == cachedDstSize);
+    CV_Assert(srcTiles.frameSize() == cachedSrcSize && dstTiles.frameSize() == cachedDstSize);
+
+    for (int ty = 0; ty < dstTiles.rows(); ty++)
+    {
+        for (int tx = 0; tx < dstTiles.columns(); tx++)
+        {
+            const cv::Rect &footprint = footprints[ty * dstTiles.columns() + tx];
+            bool touched = false;
+            for (int sy = footprint.y; !touched && sy < footprint.y + footprint.height; sy++)
+                for (int sx = footprint.x; !touched && sx < footprint.x + footprint.width; sx++)
+                    touched = srcTiles.dirty(sx, sy);
+            if (touched)
+                dstTiles.mark(tx, ty);
+        }
+    }
+
+    dstTiles.forEachRun([&](const cv::Rect &run)
+                        {
+                            cv::Mat out = dst(run);
+                            cv::remap(src, out, map1(run), map2(run), cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar());
+                        },
+                        overlapRect);
+    return dstTiles.count();
+}
@@ -5,6 +5,12 @@
 using namespace cv;
 
 int Yen(Mat data)
+{
+    CV_Assert(data.type() == CV_32F && data.isContinuous());
+    return Yen(data.ptr<float>(), (int)data.total());
+}
+
+int Yen(const float *histogram, int bins)
 {
     // Ported to C++ by Alexander Ivakov from Java implementation of ImageJ plugin Auto_Threshold
 
@@ -21,39 +27,40 @@ int Yen(Mat data)
     // 06.15.2007
     // Ported to ImageJ plugin by G.Landini from E Celebi's fourier_0.8 routines
 
+    // Generalized from the fixed 256 bins so 10/12 bit histograms can be thresholded directly
+    CV_Assert(bins > 1 && bins <= YEN_MAX_BINS);
+
     int total = 0;
-    for (int ih = 0; ih < 256; ih++)
+    for (int ih = 0; ih < bins; ih++)
     {
-        float extr = data.at<float>(ih);
-        ;
-        total += (int)extr;
+        total += (int)histogram[ih];
     }
 
     // normalized histogram
-    double norm_histo[256];
-    for (int ih = 0; ih < 256; ih++)
+    double norm_histo[YEN_MAX_BINS];
+    for (int ih = 0; ih < bins; ih++)
     {
-        norm_histo[ih] = (double)data.at<float>(ih) / total;
+        norm_histo[ih] = (double)histogram[ih] / total;
     }
 
     // cumulative normalized histogram
-    double P1[256];
+    double P1[YEN_MAX_BINS];
     P1[0] = norm_histo[0];
-    for (int ih = 1; ih < 256; ih++)
+    for (int ih = 1; ih < bins; ih++)
     {
         P1[ih] = P1[ih - 1] + norm_histo[ih];
     }
 
-    double P1_sq[256];
+    double P1_sq[YEN_MAX_BINS];
     P1_sq[0] = norm_histo[0] * norm_histo[0];
-    for (int ih = 1; ih < 256; ih++)
+    for (int ih = 1; ih < bins; ih++)
     {
         P1_sq[ih] = P1_sq[ih - 1] + norm_histo[ih] * norm_histo[ih];
     }
 
-    double P2_sq[256];
-    P2_sq[255] = 0.0;
-    for (int ih = 254; ih >= 0; ih--)
+    double P2_sq[YEN_MAX_BINS];
+    P2_sq[bins - 1] = 0.0;
+    for (int ih = bins - 2; ih >= 0; ih--)
     {
         P2_sq[ih] = P2_sq[ih + 1] + norm_histo[ih + 1] * norm_histo[ih + 1];
     }
@@ -62,7 +69,7 @@ int Yen(Mat data)
     int threshold = -1;
     double max_crit = std::numeric_limits<double>::min();
 
-    for (int it = 0; it < 256; it++)
+    for (int it = 0; it < bins; it++)
     {
         double crit = -1.0 * ((P1_sq[it] * P2_sq[it]) > 0.0 ? log(P1_sq[it] * P2_sq[it]) : 0.0) + 2 * ((P1[it] * (1.0 - P1[it])) > 0.0 ? log(P1[it] * (1.0 - P1[it])) : 0.0);
         if (crit > max_crit)
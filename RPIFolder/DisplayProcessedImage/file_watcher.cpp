@@ -0,0 +1,148 @@
+#include "file_watcher.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+FileWatcher::~FileWatcher()
+{
+    close();
+}
+
+bool FileWatcher::open(const std::string &dir, const std::vector<std::string> &exts)
+{
+    close();
+    directory = dir;
+    extensions = exts;
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+    {
+        std::cerr << "inotify_init1 failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    watch = inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (watch < 0)
+    {
+        std::cerr << "Failed to watch " << directory << ": " << std::strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    // Scan after the watch is in place so nothing that lands in between is missed
+    // (a file can end up queued twice, next() skips the copy that's already gone)
+    scanDirectory();
+    return true;
+}
+
+void FileWatcher::close()
+{
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+    watch = -1;
+    pending.clear();
+}
+
+bool FileWatcher::matches(const std::string &name) const
+{
+    for (const std::string &extension : extensions)
+    {
+        if (name.size() > extension.size() &&
+            name.compare(name.size() - extension.size(), extension.size(), extension) == 0)
+            return true;
+    }
+    return false;
+}
+
+void FileWatcher::scanDirectory()
+{
+    std::vector<std::pair<fs::file_time_type, std::string>> found;
+
+    std::error_code ec;
+    for (const auto &entry : fs::directory_iterator(directory, ec))
+    {
+        std::string name = entry.path().filename().string();
+        if (entry.is_regular_file(ec) && matches(name))
+            found.emplace_back(entry.last_write_time(ec), entry.path().string());
+    }
+
+    std::sort(found.begin(), found.end());
+    for (const auto &file : found)
+        pending.push_back(file.second);
+}
+
+void FileWatcher::readEvents()
+{
+    // Big enough for a burst of events, inotify_event must be read into aligned storage
+    alignas(struct inotify_event) char buffer[16 * 1024];
+
+    while (true)
+    {
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length <= 0)
+        {
+            if (length < 0 && errno != EAGAIN && errno != EINTR)
+                std::cerr << "inotify read failed: " << std::strerror(errno) << std::endl;
+            return;
+        }
+
+        for (char *ptr = buffer; ptr < buffer + length;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            // The kernel dropped events, fall back to one listing to pick up whatever was missed
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                std::cerr << "inotify queue overflowed, rescanning " << directory << std::endl;
+                scanDirectory();
+                continue;
+            }
+
+            if (event->len == 0 || (event->mask & IN_ISDIR))
+                continue;
+
+            std::string name = event->name;
+            if (matches(name))
+                pending.push_back(directory + "/" + name);
+        }
+    }
+}
+
+bool FileWatcher::next(std::string &path, int timeoutMs)
+{
+    if (fd < 0)
+        return false;
+
+    while (true)
+    {
+        // Whatever already arrived, in order
+        while (!pending.empty())
+        {
+            path = pending.front();
+            pending.pop_front();
+
+            std::error_code ec;
+            if (fs::exists(path, ec))
+                return true;
+        }
+
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeoutMs);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready <= 0)
+            return false;
+
+        readEvents();
+    }
+}
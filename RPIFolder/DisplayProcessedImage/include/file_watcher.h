@@ -0,0 +1,43 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <vector>
+
+// Event driven replacement for polling the incoming directory with directory_iterator + sleep
+//
+// Uses inotify and only reacts to IN_CLOSE_WRITE (a writer finished and closed the file) and IN_MOVED_TO
+// (a file was renamed into the directory, what scp -> mv or rsync's temp file do), so a file is never handed
+// out while it's still being written. Files come out in the order they landed.
+class FileWatcher
+{
+public:
+    FileWatcher() = default;
+    ~FileWatcher();
+
+    FileWatcher(const FileWatcher &) = delete;
+    FileWatcher &operator=(const FileWatcher &) = delete;
+
+    // Starts watching directory for files ending in any of extensions, files that are already there are queued first (oldest first)
+    bool open(const std::string &directory, const std::vector<std::string> &extensions);
+    void close();
+
+    // Next finished file, waits up to timeoutMs for one (-1 = forever)
+    // Returns false on timeout or error
+    bool next(std::string &path, int timeoutMs);
+
+private:
+    // Reads every pending event into the queue
+    void readEvents();
+
+    // Queues the files already in the directory, also used to recover after the event queue overflowed
+    void scanDirectory();
+
+    bool matches(const std::string &name) const;
+
+    int fd = -1;
+    int watch = -1;
+    std::string directory;
+    std::vector<std::string> extensions;
+    std::deque<std::string> pending;
+};
@@ -2,68 +2,176 @@
 #include <iostream>
 #include <filesystem>
 #include <chrono>
-#include <thread>
+#include "file_watcher.h"
+#include "frame_codec.h"
+#include "frame_stream.h"
+#include "shared_frame_ring.h"
+
+#define ESC_KEY 27
+#define WATCH_TIMEOUT_MS 15 // How long to wait for a file before giving the HighGUI event loop a turn
+#define STREAM_STATS_INTERVAL_S 5.0
 
 namespace fs = std::filesystem;
 
-int main()
+// --listen : frames come straight from alignImages --stream, received into the same buffer every time
+static int runStream(const std::string &endpoint)
+{
+    FrameReceiver receiver;
+    if (!receiver.listen(endpoint))
+        return -1;
+
+    std::cout << "Listening for frames on " << endpoint << " (ESC to quit)\n";
+
+    cv::Mat frame;
+    FrameHeader header;
+    int framesSinceStats = 0;
+    double latencySumMs = 0;
+    auto statsStart = std::chrono::steady_clock::now();
+
+    while (true)
+    {
+        if (receiver.receive(frame, header, WATCH_TIMEOUT_MS))
+        {
+            cv::imshow("Received Image", frame);
+
+            // Only meaningful if both machines are NTP synced, it's still a good relative number otherwise
+            latencySumMs += ((int64_t)frameStreamNowNs() - (int64_t)header.timestampNs) / 1e6;
+            framesSinceStats++;
+        }
+
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - statsStart).count();
+        if (elapsed >= STREAM_STATS_INTERVAL_S && framesSinceStats > 0)
+        {
+            std::cout << framesSinceStats / elapsed << " fps | latency " << latencySumMs / framesSinceStats
+                      << " ms | dropped " << receiver.framesDropped() << " | frame " << header.sequence << std::endl;
+            framesSinceStats = 0;
+            latencySumMs = 0;
+            statsStart = std::chrono::steady_clock::now();
+        }
+
+        if (cv::waitKey(1) == ESC_KEY)
+            break;
+    }
+
+    cv::destroyAllWindows();
+    return 0;
+}
+
+// --shm : alignImages --shm runs on this machine, frames are shown straight out of its shared memory ring
+static int runSharedRing(const std::string &name)
 {
+    SharedFrameReader reader;
+    reader.open(name); // Fine if alignImages isn't up yet, latest() keeps retrying
+
+    std::cout << "Reading frames from shared memory " << name << " (ESC to quit)\n";
+
+    cv::Mat view;
+    uint32_t frameNumber = 0, lastFrameNumber = 0;
+    uint64_t timestampNs = 0;
+    int framesSinceStats = 0, tornFrames = 0, skippedFrames = 0;
+    double latencySumMs = 0;
+    auto statsStart = std::chrono::steady_clock::now();
+
+    while (true)
+    {
+        if (reader.latest(view, frameNumber, timestampNs))
+        {
+            // view points into the ring, imshow() copies it into the window so the slot is only needed for this call
+            cv::imshow("Received Image", view);
+
+            // The writer lapped us while imshow() was reading, the next frame replaces it right away
+            if (!reader.stillValid())
+                tornFrames++;
+
+            if (lastFrameNumber != 0 && frameNumber > lastFrameNumber + 1)
+                skippedFrames += frameNumber - lastFrameNumber - 1;
+            lastFrameNumber = frameNumber;
+
+            latencySumMs += ((int64_t)frameStreamNowNs() - (int64_t)timestampNs) / 1e6;
+            framesSinceStats++;
+        }
+
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - statsStart).count();
+        if (elapsed >= STREAM_STATS_INTERVAL_S && framesSinceStats > 0)
+        {
+            std::cout << framesSinceStats / elapsed << " fps | latency " << latencySumMs / framesSinceStats
+                      << " ms | skipped " << skippedFrames << " | torn " << tornFrames << " | frame " << frameNumber << std::endl;
+            framesSinceStats = 0;
+            latencySumMs = 0;
+            statsStart = std::chrono::steady_clock::now();
+        }
+
+        // Also the polling interval, a new frame is picked up within about a millisecond
+        if (cv::waitKey(1) == ESC_KEY)
+            break;
+    }
+
+    cv::destroyAllWindows();
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    // --listen <tcp:host:port | port | unix:/path> : receive frames from alignImages --stream instead of watching IncomingData
+    // --shm [name] : show frames from alignImages --shm running on this machine
+    if (argc == 3 && std::string(argv[1]) == "--listen")
+        return runStream(argv[2]);
+    if ((argc == 2 || argc == 3) && std::string(argv[1]) == "--shm")
+        return runSharedRing(argc == 3 ? argv[2] : SHARED_RING_DEFAULT_NAME);
+    if (argc != 1)
+    {
+        std::cerr << "Usage : " << argv[0] << " [--listen <tcp:host:port | port | unix:/path>] [--shm [name]]" << std::endl;
+        return -1;
+    }
+
     // std::string watch_dir = "/home/pi/ProfusionProject/RPIFolder/DisplayProcessedImage/IncomingData";
     std::string watch_dir = "./IncomingData";
 
-    std::string file_extension = ".PNG"; // File extension to watch for
+    // File extensions to watch for, .qoi is what alignImages --batch ... --codec qoi writes
+    std::vector<std::string> file_extensions = {".PNG", ".qoi"};
+
+    // inotify instead of listing the directory every second, a new file is picked up as soon as its writer closes it
+    FileWatcher watcher;
+    if (!watcher.open(watch_dir, file_extensions))
+    {
+        std::cerr << "Error: Could not watch " << watch_dir << std::endl;
+        return -1;
+    }
 
-    std::cout << "Monitoring directory: " << watch_dir << " for PNG files...\n";
+    std::cout << "Monitoring directory: " << watch_dir << " for PNG / QOI files... (ESC to quit)\n";
     bool runProgram = true;
     while (runProgram)
     {
-        bool file_found = false;
-
-        // Iterate over files in the directory
-        for (const auto &entry : fs::directory_iterator(watch_dir))
+        std::string file_path;
+        if (watcher.next(file_path, WATCH_TIMEOUT_MS))
         {
-            if (entry.is_regular_file() && entry.path().extension() == file_extension)
+            std::cout << "New file detected: " << file_path << std::endl;
+
+            // Load the image, QOI isn't something imread() knows about
+            bool isQoi = file_path.size() > 4 && file_path.compare(file_path.size() - 4, 4, ".qoi") == 0;
+            cv::Mat image = isQoi ? readQoiFile(file_path) : cv::imread(file_path, cv::IMREAD_COLOR);
+
+            // Check if the image was loaded successfully
+            if (image.empty())
             {
-                std::string file_path = entry.path().string();
-                std::cout << "New file detected: " << file_path << std::endl;
-
-                // Load the image using OpenCV
-                cv::Mat image = cv::imread(file_path, cv::IMREAD_COLOR);
-
-                // Check if the image was loaded successfully
-                if (image.empty())
-                {
-                    std::cerr << "Error: Could not load image: " << file_path << std::endl;
-                }
-                else
-                {
-                    // Display the image
-                    cv::imshow("Received Image", image);
-                    std::cout << "Displaying image. Press any key to close." << std::endl;
-
-                    // Wait for a key press
-                    cv::waitKey(0);
-                    cv::destroyAllWindows();
-                    // file_found = true;
-                    // runProgram = false;
-
-                    // Optionally, delete the file after displaying
-                    fs::remove(file_path);
-                    std::cout << "File " << file_path << " deleted.\n";
-                }
-
-                file_found = true;
-                break; // Stop monitoring temporarily after detecting one file
+                std::cerr << "Error: Could not load image: " << file_path << std::endl;
+            }
+            else
+            {
+                // Replace whatever was on screen, the window stays open between frames
+                cv::imshow("Received Image", image);
             }
-        }
 
-        // If no file is found, wait for a short period before checking again
-        if (!file_found)
-        {
-            std::cout << "Waiting for file..." << std::endl;
-            std::this_thread::sleep_for(std::chrono::seconds(1));
+            // Optionally, delete the file after displaying
+            std::error_code ec;
+            fs::remove(file_path, ec);
         }
+
+        // Keeps the window responsive while waiting
+        if (cv::waitKey(1) == ESC_KEY)
+            runProgram = false;
     }
 
+    cv::destroyAllWindows();
     return 0;
 }
@@ -2,9 +2,6 @@
 import time
 import threading
 import subprocess
-import numpy as np
-from pidng.core import RAW2DNG, DNGTags, Tag
-from pidng.defs import *
 from picamera2 import Picamera2, Preview
 from picamera2.encoders import Encoder
 import os
@@ -40,31 +37,17 @@ def countdown_timer(duration):
         duration -= 1
     print("\n================= Recording COMPLETE =================")
 
-# Function to create DNG files
-def create_dng(arr, size, camera_number, save_dir):
-    r = RAW2DNG()
-    t = DNGTags()
-    bpp = 10
-    t.set(Tag.ImageWidth, size[0])
-    t.set(Tag.ImageLength, size[1])
-    t.set(Tag.TileWidth, size[0])
-    t.set(Tag.TileLength, size[1])
-    t.set(Tag.Orientation, Orientation.Horizontal)
-    t.set(Tag.PhotometricInterpretation, PhotometricInterpretation.Color_Filter_Array)
-    t.set(Tag.SamplesPerPixel, 1)
-    t.set(Tag.BitsPerSample, bpp)
-    t.set(Tag.CFARepeatPatternDim, [2, 2])
-    t.set(Tag.CFAPattern, CFAPattern.GBRG)
-    t.set(Tag.DNGVersion, DNGVersion.V1_4)
-    t.set(Tag.DNGBackwardVersion, DNGVersion.V1_2)
-
-    save_path = f"{save_dir}/camera{camera_number}"
-    r.options(t, path=save_dir, compress=False)
-    r.convert(arr, filename=save_path)
+# Function to export every frame of the recordings with LinuxFolder/AlignImages' rawExport (make rawExport there first)
+def export_recordings(recordings, size, export_dir):
+    try:
+        subprocess.run([raw_export, *recordings, "-o", export_dir, "--format", "dng", "--size", str(size[0]), str(size[1])], check=True)
+    except (OSError, subprocess.CalledProcessError) as e:
+        print(f"Error while exporting the recordings with {raw_export}: {e}")
 
 # Main script
 size = (1920, 1080)
 save_dir = "/media/pi/YELLOW_USB/profusionFolder"
+raw_export = os.path.join(os.path.dirname(os.path.abspath(__file__)), "../../LinuxFolder/AlignImages/rawExport")
 recording_counter = 0  # Initialize recording counter
 
 # Ensure the save directory exists
@@ -132,16 +115,9 @@ recording_counter += 1
 
 print("\n================= Processing Data =================")
 
-# Process raw data
-def process_camera_data(filename, size, camera_number):
-    raw_file = f"{save_dir}/{filename}_{recording_counter-1}.raw"  # Correct the counter to the previous file
-    with open(raw_file, "rb") as f:
-        buf = f.read(size[0] * size[1] * 2)
-    arr = np.frombuffer(buf, dtype=np.uint16).reshape((size[1], size[0]))
-    create_dng(arr, size, camera_number, save_dir)
-
-process_camera_data("visibleCamera", size, 0)
-process_camera_data("irCamera", size, 1)
+# Every frame of both recordings, as DNG with the same CFA pattern the recording has
+export_recordings([f"{save_dir}/visibleCamera_{recording_counter-1}.raw", f"{save_dir}/irCamera_{recording_counter-1}.raw"],
+                  size, f"{save_dir}/export_{recording_counter-1}")
 
 print("\n================= Processing Data COMPLETE =================")
 print(f"\nFiles saved at: {save_dir}\n\n")